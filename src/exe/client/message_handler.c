@@ -34,6 +34,13 @@ typedef struct {
    circus_automaton_t *automaton;
 } impl_mh_t;
 
+// circus_message_visitor_reply_backup_fn
+static void visit_reply_backup(circus_message_visitor_reply_t *visitor, circus_message_reply_backup_t *visited) {
+   impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
+   // TODO
+   (void)visited; (void)this;
+}
+
 // circus_message_visitor_reply_change_master_fn
 static void visit_reply_change_master(circus_message_visitor_reply_t *visitor, circus_message_reply_change_master_t *visited) {
    impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
@@ -97,6 +104,13 @@ static void visit_reply_property(circus_message_visitor_reply_t *visitor, circus
    (void)visited; (void)this;
 }
 
+// circus_message_visitor_reply_stats_fn
+static void visit_reply_stats(circus_message_visitor_reply_t *visitor, circus_message_reply_stats_t *visited) {
+   impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
+   // TODO
+   (void)visited; (void)this;
+}
+
 // circus_message_visitor_reply_stop_fn
 static void visit_reply_stop(circus_message_visitor_reply_t *visitor, circus_message_reply_stop_t *visited) {
    impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
@@ -133,6 +147,7 @@ static void visit_reply_version(circus_message_visitor_reply_t *visitor, circus_
 }
 
 static circus_message_visitor_reply_t visitor_fn = {
+   (circus_message_visitor_reply_backup_fn)visit_reply_backup,
    (circus_message_visitor_reply_change_master_fn)visit_reply_change_master,
    (circus_message_visitor_reply_close_fn)visit_reply_close,
    (circus_message_visitor_reply_is_open_fn)visit_reply_is_open,
@@ -142,6 +157,7 @@ static circus_message_visitor_reply_t visitor_fn = {
    (circus_message_visitor_reply_pass_fn)visit_reply_pass,
    (circus_message_visitor_reply_ping_fn)visit_reply_ping,
    (circus_message_visitor_reply_property_fn)visit_reply_property,
+   (circus_message_visitor_reply_stats_fn)visit_reply_stats,
    (circus_message_visitor_reply_stop_fn)visit_reply_stop,
    (circus_message_visitor_reply_tags_fn)visit_reply_tags,
    (circus_message_visitor_reply_unset_fn)visit_reply_unset,
@@ -240,6 +256,7 @@ static void impl_register_to(impl_mh_t *this, circus_channel_t *channel, circus_
 }
 
 static void impl_free(impl_mh_t *this) {
+   circus_message_pool_clean();
    this->memory.free(this);
 }
 
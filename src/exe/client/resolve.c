@@ -108,7 +108,7 @@ struct meta_resolved_strings {
 int meta_resolved_strings_get(struct meta_resolved_strings *this, unsigned int index) {
    int result = 0;
    if (index < this->value->count(this->value)) {
-      char *item = this->value->get(this->value, index);
+      char *item = *(char**)this->value->get(this->value, index);
       cad_hash_t *hash = *(cad_hash_t**)this->meta->nested->get(this->meta->nested, this->meta_index);
       hash->set(hash, "item", item);
       result = 1;
@@ -27,64 +27,71 @@ size_t b64_size(size_t len) {
    return ((len + 2) / 3 * 4);
 }
 
-char *base64(cad_memory_t memory, const char *raw, size_t len) {
+void base64_to(char *b64, const char *raw, size_t len) {
    static char *ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
    static char PAD = '=';
-   int n = b64_size(len) + 1;
-   char *result = memory.malloc(n);
-   if (result != NULL) {
-      size_t i;
-      char *p = result;
-      for (i = 0; i < len - 2; i += 3) {
-         *p++ = ALPHABET[(raw[i] >> 2) & 0x3F];
-         *p++ = ALPHABET[((raw[i] & 0x3) << 4) | ((int) (raw[i + 1] & 0xF0) >> 4)];
-         *p++ = ALPHABET[((raw[i + 1] & 0xF) << 2) | ((int) (raw[i + 2] & 0xC0) >> 6)];
-         *p++ = ALPHABET[raw[i + 2] & 0x3F];
-      }
-      if (i < len) {
-         *p++ = ALPHABET[(raw[i] >> 2) & 0x3F];
-         if (i == (len - 1)) {
-            *p++ = ALPHABET[((raw[i] & 0x3) << 4)];
-            *p++ = PAD;
-         }
-         else {
-            *p++ = ALPHABET[((raw[i] & 0x3) << 4) | ((int) (raw[i + 1] & 0xF0) >> 4)];
-            *p++ = ALPHABET[((raw[i + 1] & 0xF) << 2)];
-         }
+   size_t i;
+   char *p = b64;
+   for (i = 0; i + 2 < len; i += 3) {
+      *p++ = ALPHABET[(raw[i] >> 2) & 0x3F];
+      *p++ = ALPHABET[((raw[i] & 0x3) << 4) | ((int) (raw[i + 1] & 0xF0) >> 4)];
+      *p++ = ALPHABET[((raw[i + 1] & 0xF) << 2) | ((int) (raw[i + 2] & 0xC0) >> 6)];
+      *p++ = ALPHABET[raw[i + 2] & 0x3F];
+   }
+   if (i < len) {
+      *p++ = ALPHABET[(raw[i] >> 2) & 0x3F];
+      if (i == (len - 1)) {
+         *p++ = ALPHABET[((raw[i] & 0x3) << 4)];
          *p++ = PAD;
       }
-      *p++ = '\0';
-      assert(p == result + n);
+      else {
+         *p++ = ALPHABET[((raw[i] & 0x3) << 4) | ((int) (raw[i + 1] & 0xF0) >> 4)];
+         *p++ = ALPHABET[((raw[i + 1] & 0xF) << 2)];
+      }
+      *p++ = PAD;
+   }
+   *p++ = '\0';
+   assert(p == b64 + b64_size(len) + 1);
+}
+
+char *base64(cad_memory_t memory, const char *raw, size_t len) {
+   char *result = memory.malloc(b64_size(len) + 1);
+   if (result != NULL) {
+      base64_to(result, raw, len);
    }
    return result;
 }
 
+static const char B64_TABLE[256] = {
+   /*       0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f */
+   /* 0 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* 1 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* 2 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 64, 63,
+   /* 3 */ 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 99, 64, 64,
+   /* 4 */ 64,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+   /* 5 */ 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 64,
+   /* 6 */ 64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+   /* 7 */ 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64,
+   /* 8 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* 9 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* a */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* b */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* c */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* d */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* e */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+   /* f */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
+};
+
 char *unbase64(cad_memory_t memory, const char *b64, size_t *len) {
-   assert(strlen(b64) % 4 == 0);
+   return unbase64_len(memory, b64, strlen(b64), len);
+}
 
-   static const char B64_TABLE[256] = {
-      /*       0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f */
-      /* 0 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* 1 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* 2 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 64, 63,
-      /* 3 */ 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 99, 64, 64,
-      /* 4 */ 64,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
-      /* 5 */ 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 64,
-      /* 6 */ 64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
-      /* 7 */ 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64,
-      /* 8 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* 9 */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* a */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* b */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* c */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* d */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* e */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
-      /* f */ 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
-   };
+char *unbase64_len(cad_memory_t memory, const char *b64, size_t b64len, size_t *len) {
+   assert(b64len % 4 == 0);
 
 #define B64(i) (B64_TABLE[((int)b64[i]) & 0xff])
-   char *end = strchrnul(b64, '=');
-   size_t l = end - b64;
+   const char *end = memchr(b64, '=', b64len);
+   size_t l = end == NULL ? b64len : (size_t)(end - b64);
    size_t n = ((l + 3) / 4) * 3 + 1;
    char *result = memory.malloc(n);
    if (result != NULL) {
@@ -115,3 +122,40 @@ char *unbase64(cad_memory_t memory, const char *b64, size_t *len) {
    return result;
 #undef B64
 }
+
+int unbase64_to(char *raw, const char *b64, size_t b64len) {
+   if (b64len % 4 != 0) {
+      return -1;
+   }
+#define B64(i) (B64_TABLE[((int)b64[i]) & 0xff])
+   const char *end = memchr(b64, '=', b64len);
+   size_t l = end == NULL ? b64len : (size_t)(end - b64);
+   size_t i;
+   char *p = raw;
+   if (b64len - l > 2 || l % 4 == 1) {
+      return -1;
+   }
+   for (i = 0; i < l; i++) {
+      if (B64(i) >= 64) {
+         return -1;
+      }
+   }
+   while (l > 4) {
+      *(p++) = (B64(0) << 2 | B64(1) >> 4);
+      *(p++) = (B64(1) << 4 | B64(2) >> 2);
+      *(p++) = (B64(2) << 6 | B64(3));
+      l -= 4;
+      b64 += 4;
+   }
+   if (l > 1) {
+      *(p++) = (B64(0) << 2 | B64(1) >> 4);
+   }
+   if (l > 2) {
+      *(p++) = (B64(1) << 4 | B64(2) >> 2);
+   }
+   if (l > 3) {
+      *(p++) = (B64(2) << 6 | B64(3));
+   }
+   return (int)(p - raw);
+#undef B64
+}
@@ -17,11 +17,15 @@
 */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 #include <circus.h>
+#include <circus_log.h>
 #include <circus_memory.h>
 
 #pragma GCC push_options
@@ -62,50 +66,325 @@ __attribute__ (( noinline )) size_t max_bzero(size_t count) {
 
 typedef struct {
    size_t size;
+   unsigned int site;
    volatile long canary;
-   char data[0];
+   char data[0] __attribute__ (( aligned(16) ));
 } mem;
 
+/*
+ * The locked pool: a single mlock'ed region, carved into power-of-two
+ * size classes. Freed blocks are wiped and kept in per-class free
+ * lists; they are never given back to the system. Allocations that do
+ * not fit (too big, or pool exhausted) fall back to one mlock per
+ * allocation.
+ */
+
+#define POOL_MIN_SHIFT 5   // 32 bytes
+#define POOL_CLASSES   12  // up to 64 kB
+
+#define UNLOCKED_CANARY (~CANARY)
+
+typedef struct pool_block_s {
+   struct pool_block_s *next;
+} pool_block_t;
+
+static struct {
+   char *base;
+   size_t size;
+   size_t top;
+   pool_block_t *free_list[POOL_CLASSES];
+   size_t used;
+   size_t peak;
+   size_t overflow;
+   pthread_mutex_t lock;
+} pool = { NULL, 0, 0, { NULL, }, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static int pool_class(size_t s) {
+   int result;
+   for (result = 0; result < POOL_CLASSES; result++) {
+      if (s <= ((size_t)1 << (POOL_MIN_SHIFT + result))) {
+         return result;
+      }
+   }
+   return -1;
+}
+
+static int in_pool(const void *p) {
+   return pool.base != NULL && (const char*)p >= pool.base && (const char*)p < pool.base + pool.size;
+}
+
+static mem *pool_alloc(size_t s) {
+   mem *result = NULL;
+   if (pool.base != NULL) {
+      int c = pool_class(s);
+      if (c >= 0) {
+         size_t n = (size_t)1 << (POOL_MIN_SHIFT + c);
+         pthread_mutex_lock(&pool.lock);
+         pool_block_t *block = pool.free_list[c];
+         if (block != NULL) {
+            pool.free_list[c] = block->next;
+            block->next = NULL; // the rest of the block was wiped when freed
+         } else if (pool.top + n <= pool.size) {
+            block = (pool_block_t*)(pool.base + pool.top);
+            pool.top += n;
+         }
+         if (block != NULL) {
+            pool.used += n;
+            if (pool.used > pool.peak) {
+               pool.peak = pool.used;
+            }
+            result = (mem*)block;
+         } else {
+            pool.overflow++;
+         }
+         pthread_mutex_unlock(&pool.lock);
+      } else {
+         pthread_mutex_lock(&pool.lock);
+         pool.overflow++;
+         pthread_mutex_unlock(&pool.lock);
+      }
+   }
+   return result;
+}
+
+static void pool_free(mem *p, size_t s) {
+   int c = pool_class(s);
+   assert(c >= 0);
+   pool_block_t *block = (pool_block_t*)p;
+   pthread_mutex_lock(&pool.lock);
+   block->next = pool.free_list[c];
+   pool.free_list[c] = block;
+   pool.used -= (size_t)1 << (POOL_MIN_SHIFT + c);
+   pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * The locked blocks outside of the pool, sorted by address: is_locked()
+ * is asked about any pointer (libgcrypt also asks about its callers'
+ * buffers), so it must never read memory it does not own. The table
+ * itself is not locked memory: it holds no secret.
+ */
+
+typedef struct {
+   const char *start;
+   const char *end;
+} block_range_t;
+
+static struct {
+   block_range_t *ranges;
+   size_t count;
+   size_t capacity;
+   pthread_mutex_t lock;
+} blocks = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * The index of the first range starting after p
+ */
+static size_t blocks_after(const char *p) {
+   size_t lo = 0, hi = blocks.count;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (blocks.ranges[mid].start <= p) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+static int blocks_add(const void *p, size_t s) {
+   int result = 1;
+   pthread_mutex_lock(&blocks.lock);
+   if (blocks.count == blocks.capacity) {
+      size_t capacity = blocks.capacity == 0 ? 64 : blocks.capacity * 2;
+      block_range_t *ranges = realloc(blocks.ranges, capacity * sizeof(block_range_t));
+      if (ranges == NULL) {
+         result = 0;
+      } else {
+         blocks.ranges = ranges;
+         blocks.capacity = capacity;
+      }
+   }
+   if (result) {
+      size_t i = blocks_after(p);
+      memmove(blocks.ranges + i + 1, blocks.ranges + i, (blocks.count - i) * sizeof(block_range_t));
+      blocks.ranges[i].start = p;
+      blocks.ranges[i].end = (const char*)p + s;
+      blocks.count++;
+   }
+   pthread_mutex_unlock(&blocks.lock);
+   return result;
+}
+
+static void blocks_del(const void *p) {
+   pthread_mutex_lock(&blocks.lock);
+   size_t i = blocks_after(p);
+   assert(i > 0 && blocks.ranges[i - 1].start == p);
+   memmove(blocks.ranges + i - 1, blocks.ranges + i, (blocks.count - i) * sizeof(block_range_t));
+   blocks.count--;
+   pthread_mutex_unlock(&blocks.lock);
+}
+
+static int in_blocks(const void *p) {
+   int result = 0;
+   pthread_mutex_lock(&blocks.lock);
+   size_t i = blocks_after(p);
+   if (i > 0 && (const char*)p < blocks.ranges[i - 1].end) {
+      result = 1;
+   }
+   pthread_mutex_unlock(&blocks.lock);
+   return result;
+}
+
+/*
+ * Accounting: live bytes, high-water mark, number of allocations and
+ * wiped bytes, per pool size class and per call site. Call sites are
+ * the file and line given to circus_malloc_at() and
+ * circus_realloc_at(), kept in a fixed table (no allocation in the
+ * allocator); slot 0 gathers the plain MEMORY calls (libraries, and
+ * the code not using the macros) and the sites that do not fit.
+ */
+
+#define SITES 256
+#define LARGE POOL_CLASSES // the size "class" of blocks too big for the pool
+
+typedef struct {
+   size_t live;
+   size_t peak;
+   size_t count;
+   size_t wiped;
+} counters_t;
+
+static struct {
+   counters_t total;
+   counters_t classes[POOL_CLASSES + 1];
+   struct {
+      const char *file;
+      int line;
+      counters_t counters;
+   } sites[SITES];
+   size_t soft_budget;
+   size_t hard_budget;
+   pthread_mutex_t lock;
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int stats_site(const char *file, int line) {
+   if (file == NULL) {
+      return 0;
+   }
+   // __FILE__ strings are shared by all the sites of a file
+   unsigned int h = (unsigned int)((((uintptr_t)file >> 3) * 31 + (unsigned int)line) % (SITES - 1));
+   unsigned int i;
+   for (i = 0; i < SITES - 1; i++) {
+      unsigned int result = 1 + (h + i) % (SITES - 1);
+      if (stats.sites[result].file == file && stats.sites[result].line == line) {
+         return result;
+      }
+      if (stats.sites[result].file == NULL) {
+         stats.sites[result].file = file;
+         stats.sites[result].line = line;
+         return result;
+      }
+   }
+   return 0;
+}
+
+static int stats_class(size_t s) {
+   int result = pool_class(s);
+   return result < 0 ? LARGE : result;
+}
+
+static void counters_alloc(counters_t *counters, size_t s) {
+   counters->live += s;
+   counters->count++;
+   if (counters->live > counters->peak) {
+      counters->peak = counters->live;
+   }
+}
+
+static void counters_free(counters_t *counters, size_t s) {
+   counters->live -= s;
+   counters->wiped += s;
+}
+
+static void stats_alloc(mem *p, size_t s, const char *file, int line) {
+   pthread_mutex_lock(&stats.lock);
+   p->site = stats_site(file, line);
+   counters_alloc(&stats.total, s);
+   counters_alloc(&stats.classes[stats_class(s)], s);
+   counters_alloc(&stats.sites[p->site].counters, s);
+   pthread_mutex_unlock(&stats.lock);
+}
+
+static void stats_free(mem *p, size_t s) {
+   pthread_mutex_lock(&stats.lock);
+   counters_free(&stats.total, s);
+   counters_free(&stats.classes[stats_class(s)], s);
+   counters_free(&stats.sites[p->site].counters, s);
+   pthread_mutex_unlock(&stats.lock);
+}
+
 static void circus_memfree(mem *p) {
    assert(p->canary == CANARY);
    size_t size = p->size;
    assert(size > 0);
    assert(*(p->data + size) == '\003');
+   stats_free(p, sizeof(mem) + size + 1);
    max_bzero(size);
    force_bzero(p, sizeof(mem) + size + 1);
-   munlock(p, sizeof(mem) + size + 1);
-   free(p);
+   if (in_pool(p)) {
+      pool_free(p, sizeof(mem) + size + 1);
+   } else {
+      blocks_del(p);
+      munlock(p, sizeof(mem) + size + 1);
+      free(p);
+   }
 }
 
-static mem *circus_memalloc(size_t size) {
+static mem *circus_memalloc(size_t size, const char *file, int line) {
    size_t s = sizeof(mem) + size + 1;
-   mem *result = calloc(s, 1);
+   mem *result = pool_alloc(s);
    if (result != NULL) {
       result->size = (uintptr_t)size;
       result->canary = CANARY;
-      int n = mlock(result, s);
-      if (n != 0) {
-         circus_memfree(result);
-         result = NULL;
-      }
       *(result->data + size) = '\003';
+      stats_alloc(result, s, file, line);
+   } else {
+      result = calloc(s, 1);
+      if (result != NULL) {
+         result->size = (uintptr_t)size;
+         result->canary = CANARY;
+         *(result->data + size) = '\003';
+         if (!blocks_add(result, s)) {
+            free(result);
+            return NULL;
+         }
+         stats_alloc(result, s, file, line);
+         int n = mlock(result, s);
+         if (n != 0) {
+            circus_memfree(result);
+            result = NULL;
+         }
+      }
    }
    return result;
 }
 
-static void *circus_malloc(size_t size) {
+static void *locked_malloc(size_t size, const char *file, int line) {
    assert(size > 0);
-   mem *result = circus_memalloc(size);
+   mem *result = circus_memalloc(size, file, line);
    if (result == NULL) {
       return NULL;
    }
    return result->data;
 }
 
-static void *circus_realloc(void *ptr, size_t size) {
+static void *locked_realloc(void *ptr, size_t size, const char *file, int line) {
    assert(size > 0);
    if (ptr == NULL) {
-      return circus_malloc(size);
+      mem *result = circus_memalloc(size, file, line);
+      return result == NULL ? NULL : result->data;
    }
    mem *p = container_of(ptr, mem, data);
    assert(p->canary == CANARY);
@@ -113,9 +392,10 @@ static void *circus_realloc(void *ptr, size_t size) {
    if (size <= p->size) {
       return ptr;
    }
-   mem *result = circus_memalloc(size);
+   mem *result = circus_memalloc(size, file, line);
    if (result == NULL) {
-      circus_memfree(p);
+      // like realloc(3): the block is left untouched, its owner (maybe
+      // libgcrypt) still holds it
       return NULL;
    }
    memcpy(result->data, p->data, p->size);
@@ -123,6 +403,14 @@ static void *circus_realloc(void *ptr, size_t size) {
    return result->data;
 }
 
+static void *circus_malloc(size_t size) {
+   return locked_malloc(size, NULL, 0);
+}
+
+static void *circus_realloc(void *ptr, size_t size) {
+   return locked_realloc(ptr, size, NULL, 0);
+}
+
 static void circus_free(void *ptr) {
    if (ptr != NULL) {
       circus_memfree(container_of(ptr, mem, data));
@@ -131,6 +419,249 @@ static void circus_free(void *ptr) {
 
 cad_memory_t MEMORY = {circus_malloc, circus_realloc, circus_free};
 
+void *circus_malloc_at(cad_memory_t memory, size_t size, const char *file, int line) {
+   if (memory.malloc != circus_malloc) {
+      return memory.malloc(size);
+   }
+   return locked_malloc(size, file, line);
+}
+
+void *circus_realloc_at(cad_memory_t memory, void *ptr, size_t size, const char *file, int line) {
+   if (memory.realloc != circus_realloc) {
+      return memory.realloc(ptr, size);
+   }
+   return locked_realloc(ptr, size, file, line);
+}
+
+/*
+ * Unlocked memory carries the same header as locked memory (with a
+ * different canary), checked on realloc and free. Used by libraries
+ * that hand us back pointers without telling if they asked for secure
+ * memory or not (libgcrypt): is_locked() tells. Such libraries must be
+ * given our allocators before they allocate anything (see
+ * init_crypt()), so that they never hand back a pointer from the
+ * system allocator.
+ */
+
+static void *unlocked_malloc(size_t size) {
+   mem *result = malloc(sizeof(mem) + size);
+   if (result == NULL) {
+      return NULL;
+   }
+   result->size = size;
+   result->canary = UNLOCKED_CANARY;
+   return result->data;
+}
+
+static void *unlocked_realloc(void *ptr, size_t size) {
+   if (ptr == NULL) {
+      return unlocked_malloc(size);
+   }
+   mem *p = container_of(ptr, mem, data);
+   assert(p->canary == UNLOCKED_CANARY);
+   mem *result = realloc(p, sizeof(mem) + size);
+   if (result == NULL) {
+      return NULL;
+   }
+   result->size = size;
+   return result->data;
+}
+
+static void unlocked_free(void *ptr) {
+   if (ptr != NULL) {
+      mem *p = container_of(ptr, mem, data);
+      assert(p->canary == UNLOCKED_CANARY);
+      p->canary = 0;
+      free(p);
+   }
+}
+
+cad_memory_t UNLOCKED_MEMORY = {unlocked_malloc, unlocked_realloc, unlocked_free};
+
+int is_locked(const void *ptr) {
+   if (ptr == NULL) {
+      return 0;
+   }
+   return in_pool(ptr) || in_blocks(ptr);
+}
+
+int locked_pool(circus_log_t *log, size_t size) {
+   assert(pool.base == NULL);
+   if (size == 0) {
+      log_info(log, "No locked pool: locking memory per allocation");
+      return 1;
+   }
+
+   size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   size = (size + page - 1) / page * page;
+
+   struct rlimit rl;
+   if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)size > rl.rlim_cur) {
+      if (rl.rlim_max == RLIM_INFINITY || (rlim_t)size <= rl.rlim_max) {
+         rl.rlim_cur = (rlim_t)size;
+         if (setrlimit(RLIMIT_MEMLOCK, &rl) != 0) {
+            log_warning(log, "Could not raise RLIMIT_MEMLOCK to %zu: %s", size, strerror(errno));
+         }
+      }
+      if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)size > rl.rlim_cur) {
+         if (geteuid() != 0) {
+            log_error(log, "Locked pool size %zu exceeds RLIMIT_MEMLOCK (%lu); raise the limit or lower memory.locked_pool_size",
+                      size, (unsigned long)rl.rlim_cur);
+            return 0;
+         }
+         log_warning(log, "Locked pool size %zu exceeds RLIMIT_MEMLOCK (%lu), relying on privileges",
+                     size, (unsigned long)rl.rlim_cur);
+      }
+   }
+
+   char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (base == MAP_FAILED) {
+      log_error(log, "Could not map locked pool (%zu bytes): %s", size, strerror(errno));
+      return 0;
+   }
+   if (mlock(base, size) != 0) {
+      log_error(log, "Could not lock pool (%zu bytes): %s", size, strerror(errno));
+      munmap(base, size);
+      return 0;
+   }
+#ifdef MADV_DONTDUMP
+   madvise(base, size, MADV_DONTDUMP);
+#endif
+
+   pool.base = base;
+   pool.size = size;
+   log_info(log, "Locked pool: %zu bytes", size);
+   return 1;
+}
+
+void locked_pool_report(circus_log_t *log) {
+   if (pool.base == NULL) {
+      return;
+   }
+   pthread_mutex_lock(&pool.lock);
+   size_t size = pool.size;
+   size_t used = pool.used;
+   size_t peak = pool.peak;
+   size_t overflow = pool.overflow;
+   pthread_mutex_unlock(&pool.lock);
+   log_info(log, "Locked pool: size %zu, used %zu, high-water mark %zu (%zu%%), overflows %zu",
+            size, used, peak, peak * 100 / size, overflow);
+   if (overflow > 0) {
+      log_warning(log, "Locked pool too small: %zu allocations were locked individually; consider raising memory.locked_pool_size",
+                  overflow);
+   }
+}
+
+static size_t default_budget(size_t percent) {
+   if (pool.base != NULL) {
+      return pool.size / 100 * percent;
+   }
+   struct rlimit rl;
+   if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+      return (size_t)rl.rlim_cur / 100 * percent;
+   }
+   return 0;
+}
+
+void memory_budget(circus_log_t *log, size_t soft, size_t hard) {
+   if (soft == 0) {
+      soft = default_budget(75);
+   }
+   if (hard == 0) {
+      hard = default_budget(90);
+   }
+   if (hard != 0 && soft > hard) {
+      log_warning(log, "Soft memory budget %zu above hard budget %zu, using the latter", soft, hard);
+      soft = hard;
+   }
+   pthread_mutex_lock(&stats.lock);
+   stats.soft_budget = soft;
+   stats.hard_budget = hard;
+   pthread_mutex_unlock(&stats.lock);
+   if (soft == 0 && hard == 0) {
+      log_info(log, "No memory budget");
+   } else {
+      log_info(log, "Memory budget: soft %zu, hard %zu", soft, hard);
+   }
+}
+
+memory_pressure_t memory_pressure(void) {
+   memory_pressure_t result = memory_pressure_none;
+   pthread_mutex_lock(&stats.lock);
+   if (stats.hard_budget != 0 && stats.total.live >= stats.hard_budget) {
+      result = memory_pressure_hard;
+   } else if (stats.soft_budget != 0 && stats.total.live >= stats.soft_budget) {
+      result = memory_pressure_soft;
+   }
+   pthread_mutex_unlock(&stats.lock);
+   return result;
+}
+
+static void counters_stats(circus_stats_fn fn, void *data, const char *prefix, const counters_t *counters) {
+   char name[128];
+   snprintf(name, sizeof(name), "%s.live", prefix);
+   fn(data, name, counters->live);
+   snprintf(name, sizeof(name), "%s.peak", prefix);
+   fn(data, name, counters->peak);
+   snprintf(name, sizeof(name), "%s.count", prefix);
+   fn(data, name, counters->count);
+   snprintf(name, sizeof(name), "%s.wiped", prefix);
+   fn(data, name, counters->wiped);
+}
+
+void memory_stats(circus_stats_fn fn, void *data) {
+   char prefix[64];
+   int i;
+
+   // work on a copy: the visitor may allocate
+   static typeof(stats) snapshot;
+   pthread_mutex_lock(&stats.lock);
+   memcpy(&snapshot, &stats, offsetof(typeof(stats), lock));
+   pthread_mutex_unlock(&stats.lock);
+
+   counters_stats(fn, data, "memory.total", &snapshot.total);
+   fn(data, "memory.budget.soft", snapshot.soft_budget);
+   fn(data, "memory.budget.hard", snapshot.hard_budget);
+   if (pool.base != NULL) {
+      pthread_mutex_lock(&pool.lock);
+      size_t size = pool.size, used = pool.used, peak = pool.peak, overflow = pool.overflow;
+      pthread_mutex_unlock(&pool.lock);
+      fn(data, "memory.pool.size", size);
+      fn(data, "memory.pool.used", used);
+      fn(data, "memory.pool.peak", peak);
+      fn(data, "memory.pool.overflow", overflow);
+   }
+   for (i = 0; i <= LARGE; i++) {
+      if (snapshot.classes[i].count > 0) {
+         if (i == LARGE) {
+            snprintf(prefix, sizeof(prefix), "memory.class.large");
+         } else {
+            snprintf(prefix, sizeof(prefix), "memory.class.%zu", (size_t)1 << (POOL_MIN_SHIFT + i));
+         }
+         counters_stats(fn, data, prefix, &snapshot.classes[i]);
+      }
+   }
+   for (i = 0; i < SITES; i++) {
+      if (snapshot.sites[i].counters.count > 0) {
+         if (i == 0) {
+            snprintf(prefix, sizeof(prefix), "memory.site.other");
+         } else {
+            snprintf(prefix, sizeof(prefix), "memory.site.%s:%d", snapshot.sites[i].file, snapshot.sites[i].line);
+         }
+         counters_stats(fn, data, prefix, &snapshot.sites[i].counters);
+      }
+   }
+}
+
+static void log_stat(void *data, const char *name, unsigned long value) {
+   circus_log_t *log = data;
+   log_info(log, "%s = %lu", name, value);
+}
+
+void memory_report(circus_log_t *log) {
+   memory_stats(log_stat, log);
+}
+
 #pragma GCC pop_options
 
 int __wrap_mlock(const void *UNUSED(addr), size_t UNUSED(len)) {
@@ -17,6 +17,7 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -66,9 +67,54 @@ static void set_log(circus_config_t *config) {
    }
 }
 
+static int get_size(circus_config_t *config, const char *key, size_t *size) {
+   const char *sz = config->get(config, "memory", key);
+   if (sz != NULL) {
+      errno = 0;
+      unsigned long int t = strtoul(sz, NULL, 10);
+      if ((t != ULONG_MAX || errno != ERANGE) && errno != EINVAL) {
+         *size = (size_t)t;
+      } else {
+         log_error(LOG, "Invalid %s: %s", key, sz);
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static int set_memory(circus_config_t *config) {
+   size_t pool_size = 0, soft_budget = 0, hard_budget = 0;
+   if (!get_size(config, "locked_pool_size", &pool_size)
+       || !get_size(config, "soft_budget", &soft_budget)
+       || !get_size(config, "hard_budget", &hard_budget)) {
+      return 0;
+   }
+   if (!locked_pool(LOG, pool_size)) {
+      return 0;
+   }
+   memory_budget(LOG, soft_budget, hard_budget);
+   return 1;
+}
+
+/*
+ * "memory" is meant for tests and benchmarks, see circus_database_memory()
+ */
+static database_factory_fn database_factory(circus_config_t *config) {
+   const char *database = config->get(config, "vault", "database");
+   if (database == NULL || !strcmp(database, "sqlite3")) {
+      return circus_database_sqlite3;
+   }
+   if (!strcmp(database, "memory")) {
+      log_warning(LOG, "Using an in-memory vault");
+      return circus_database_memory;
+   }
+   log_error(LOG, "Unknown vault database: %s", database);
+   return NULL;
+}
+
 static void usage(const char *cmd, FILE *out) {
    fprintf(out,
-           "Usage: %s [--install <username> <password>|--help]\n"
+           "Usage: %s [--install <username> <password>|--backup|--help]\n"
            "\n"
            "Usually called without arguments; just start the Circus server.\n"
            "\n"
@@ -76,7 +122,13 @@ static void usage(const char *cmd, FILE *out) {
            "(package managers and so on).\n"
            "It checks that the database exists, is in the good version, and\n"
            "creates the administrator user with the given name and password.\n"
-           "Note: the password must not be empty.\n",
+           "Note: the password must not be empty.\n"
+           "\n"
+           "Calling with --backup copies the vault to the configured backup\n"
+           "path (vault.backup). It may run while the server is running only\n"
+           "if the server uses read connections (vault.sqlite.read_connections);\n"
+           "otherwise the server holds an exclusive lock on the vault. A running\n"
+           "server can also be asked for a backup by an administrator.\n",
            cmd
    );
 }
@@ -134,10 +186,24 @@ static void run(void) {
 
    mh->free(mh);
    channel->free(channel);
+   // the handles closed by the frees are released by the loop
+   uv_run(uv_default_loop(), UV_RUN_NOWAIT);
 
    CHECK_CANARY();
 }
 
+static void backup_done(int *status, int ok) {
+   *status = ok ? 0 : 1;
+}
+
+static int backup(void) {
+   int status = 1;
+   if (vault->backup(vault, (circus_database_done_fn)backup_done, &status)) {
+      uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+   }
+   return status;
+}
+
 static void *uv_malloc(size_t size) {
    return MEMORY.malloc(size);
 }
@@ -163,6 +229,9 @@ __PUBLIC__ int main(int argc, const char* const* argv) {
 
    config = circus_config_read(stdlib_memory, "server.conf");
    int status = 0;
+   database_factory_fn factory;
+   // a backup is a copy of the vault as it is, not of a half-migrated one
+   int migrate = argc != 2 || strcmp("--backup", argv[1]) != 0;
 
    assert(config != NULL);
 
@@ -174,18 +243,27 @@ __PUBLIC__ int main(int argc, const char* const* argv) {
    log_info(LOG, "Server starting.");
    log_info(LOG, "Configuration file is %s", config->path(config));
 
-   if (!init_crypt(LOG)) {
+   if (!set_memory(config)) {
+      status = 1;
+   } else if (!init_crypt(LOG)) {
+      status = 1;
+   } else if ((factory = database_factory(config)) == NULL) {
+      status = 1;
+   } else if ((vault = circus_vault(MEMORY, LOG, config, factory, migrate)) == NULL) {
+      log_error(LOG, "Could not open vault");
       status = 1;
    } else {
-      vault = circus_vault(MEMORY, LOG, config, circus_database_sqlite3);
       switch (argc) {
       case 1:
          run();
+         vault = NULL; // freed by the message handler
          assert(0 == status);
          break;
       case 2:
          if (0 == strcmp("--help", argv[1])) {
             usage(argv[0], stdout);
+         } else if (0 == strcmp("--backup", argv[1])) {
+            status = backup();
          } else {
             usage(argv[0], stderr);
             status = 1;
@@ -209,8 +287,15 @@ __PUBLIC__ int main(int argc, const char* const* argv) {
          status = 1;
          break;
       }
+      if (vault != NULL) {
+         vault->free(vault);
+         // the handles closed by the free are released by the loop
+         uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+         uv_loop_close(uv_default_loop());
+      }
    }
 
+   locked_pool_report(LOG);
    LOG->free(LOG);
    config->free(config);
 
@@ -22,12 +22,65 @@
 #include <circus.h>
 #include <circus_message_impl.h>
 
+/*
+ * Message objects are recycled: a few freed objects of each message
+ * type are kept (wiped) for the next allocation with the same
+ * allocator. Not thread-safe; neither are the server nor the client.
+ */
+
+#define POOL_SIZE 4
+
+typedef struct pooled_s {
+   struct pooled_s *next;
+   cad_memory_t memory;
+} pooled_t;
+
+typedef struct {
+   pooled_t *head;
+   int count;
+} message_pool_t;
+
+static void *pool_get(message_pool_t *pool, cad_memory_t memory, size_t size) {
+   pooled_t *result = pool->head;
+   if (result != NULL && result->memory.free == memory.free) {
+      pool->head = result->next;
+      pool->count--;
+      memset(result, 0, sizeof(pooled_t));
+   } else {
+      assert(size >= sizeof(pooled_t));
+      result = memory.malloc(size);
+   }
+   return result;
+}
+
+static void pool_put(message_pool_t *pool, cad_memory_t memory, void *object, size_t size) {
+   if (pool->count < POOL_SIZE && (pool->head == NULL || pool->head->memory.free == memory.free)) {
+      pooled_t *pooled = object;
+      memset(object, 0, size);
+      pooled->next = pool->head;
+      pooled->memory = memory;
+      pool->head = pooled;
+      pool->count++;
+   } else {
+      memory.free(object);
+   }
+}
+
+static void pool_clean(message_pool_t *pool) {
+   pooled_t *pooled;
+   while ((pooled = pool->head) != NULL) {
+      pool->head = pooled->next;
+      pooled->memory.free(pooled);
+   }
+   pool->count = 0;
+}
+
 static char *dup_string(cad_memory_t memory, const char *string) {
    if (string == NULL) return NULL;
-   int n = strlen(string) + 1;
+   size_t n = strlen(string) + 1;
    char *result = memory.malloc(n);
    assert(result != NULL);
-   snprintf(result, n, "%s", string);
+   memcpy(result, string, n);
    return result;
 }
 
@@ -37,8 +90,8 @@ static cad_array_t *dup_strings(cad_memory_t memory, cad_array_t *strings) {
    char *item;
    assert(result != NULL);
    for (i = 0; i < n; i++) {
-      item = strings->get(strings, i);
-      result->insert(result, i, dup_string(memory, item));
+      item = dup_string(memory, *(char**)strings->get(strings, i));
+      result->insert(result, i, &item);
    }
    return result;
 }
@@ -64,7 +117,7 @@ static cad_array_t *json_strings(cad_memory_t memory, json_array_t *array) {
    for (i = 0; i < n; i++) {
       string = (json_string_t*)array->get(array, i);
       item = json_string(memory, string);
-      result->insert(result, i, item);
+      result->insert(result, i, &item);
    }
    return result;
 }
@@ -354,6 +354,11 @@ function od_factoryc() {
         echo "    memory.free(type);"
         echo "    return result;"
     } >> $deserfile
+    {
+        echo "__PUBLIC__ void circus_message_pool_clean(void) {"
+        echo '#include "factory_clean.c"'
+        echo "}"
+    } >> $file
 }
 
 function type_factoryc() {
@@ -386,6 +391,10 @@ function msg_factoryc() {
         echo "        result = (circus_message_t*)deserialize_circus_message_${msg}_${type}(memory, object);"
         echo "    }"
     } >> $deserfile
+    local cleanfile=$(init_file factory_clean.c)
+    {
+        echo "    pool_clean(&${type}_${msg}_pool);"
+    } >> $cleanfile
     local impl_file=$(init_file msg/$type/impl.c)
     {
         echo "#include \"$msg.c\""
@@ -394,6 +403,7 @@ function msg_factoryc() {
     {
         echo "typedef struct ${type}_${msg}_impl_s ${type}_${msg}_impl_t;"
         echo "#include \"$msg.struct.c\""
+        echo "static message_pool_t ${type}_${msg}_pool;"
         echo "static const char *${type}_${msg}_type_impl_fn(${type}_${msg}_impl_t *UNUSED(this)) { return \"$type\"; }"
         echo "static const char *${type}_${msg}_command_impl_fn(${type}_${msg}_impl_t *UNUSED(this)) { return \"$msg\"; }"
         if [ "${msg#reply}" != "${msg}" ]; then
@@ -460,7 +470,7 @@ function msg_factoryc() {
     } >> $factory_file
     local new_file=$(init_file factory/$type/new_$msg.c)
     {
-        echo "    ${type}_${msg}_impl_t *result = memory.malloc(sizeof(${type}_${msg}_impl_t));"
+        echo "    ${type}_${msg}_impl_t *result = pool_get(&${type}_${msg}_pool, memory, sizeof(${type}_${msg}_impl_t));"
         echo "    if (result) {"
         echo "        result->fn = ${type}_${msg}_impl_fn;"
         echo "        result->memory = memory;"
@@ -470,7 +480,7 @@ function msg_factoryc() {
     } >> $new_file
     local deserialize_file=$(init_file factory/$type/deserialize_$msg.c)
     {
-        echo "    ${type}_${msg}_impl_t *result = memory.malloc(sizeof(${type}_${msg}_impl_t));"
+        echo "    ${type}_${msg}_impl_t *result = pool_get(&${type}_${msg}_pool, memory, sizeof(${type}_${msg}_impl_t));"
         echo "    if (result) {"
         echo "        result->fn = ${type}_${msg}_impl_fn;"
         echo "        result->memory = memory;"
@@ -497,7 +507,7 @@ function gsm_factoryc() {
         if [ "${msg#reply}" != "${msg}" ]; then
             echo "this->memory.free(this->error);"
         fi
-        echo "this->memory.free(this);"
+        echo "pool_put(&${type}_${msg}_pool, this->memory, this, sizeof(${type}_${msg}_impl_t));"
     } >> $free_file
     local serialize_file=$(init_file msg/$type/$msg.serialize.c)
     {
@@ -549,7 +559,7 @@ function key_factoryc() {
             STRINGS)
                 echo "    int i$key, n$key = this->$key->count(this->$key);"
                 echo "    for (i$key = 0; i$key < n$key; i$key++) {"
-                echo "        this->memory.free(this->$key->get(this->$key, i$key));"
+                echo "        this->memory.free(*(char**)this->$key->get(this->$key, i$key));"
                 echo "    }"
                 echo "    this->$key->free(this->$key);"
                 ;;
@@ -569,7 +579,7 @@ function key_factoryc() {
                 echo "    json_string_t *js$key;"
                 echo "    char *sz$key;"
                 echo "    for (i$key = 0; i$key < n$key; i$key++) {"
-                echo "        sz$key = this->$key->get(this->$key, i$key);"
+                echo "        sz$key = *(char**)this->$key->get(this->$key, i$key);"
                 echo "        js$key = json_new_string(this->memory);"
                 echo "        js$key->add_string(js$key, \"%s\", sz$key);"
                 echo "        ja$key->set(ja$key, i$key, (json_value_t*)js$key);"
@@ -16,26 +16,81 @@
     Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
 */
 
+#include <cad_hash.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <uv.h>
 
 #include <circus_database.h>
+#include <circus_memory.h>
 
 #define FETCH_TO_DO 0
 #define FETCH_READY 1
 #define FETCH_OFF -1
 #define FETCH_ERROR -2
 
+#define STMT_CACHE_SIZE 64
+#define READERS_MAX 64
+#define GROUP_SIZE_MAX 1024
+#define GROUP_DELAY_MAX 10000
+#define GROUP_DELAY_DEFAULT 10
+#define BACKUP_PAGES_MAX 65536
+#define BACKUP_PAGES_DEFAULT 64
+#define BACKUP_INTERVAL 10
+#define SLOW_QUERY_MAX 60000
+#define PROFILES_MAX 1024
+#define KINDS_MAX 1024
+
 typedef struct database_resultset_sqlite3_s database_resultset_sqlite3_t;
 typedef struct database_query_sqlite3_s database_query_sqlite3_t;
 typedef struct database_sqlite3_s database_sqlite3_t;
 
+typedef struct {
+   sqlite3 *db;
+   cad_hash_t *stmts; // prepared statements not in use, per SQL text
+} connection_t;
+
+typedef struct {
+   sqlite3 *db;
+   sqlite3_backup *backup;
+   char *path;
+   char *tmp_path; // the backup is renamed to path only when complete
+   circus_database_done_fn done;
+   void *data;
+   uint64_t start;
+   int progress; // last logged tenth
+} backup_t;
+
+typedef struct {
+   circus_database_done_fn done;
+   void *data;
+   int level; // the transaction depth the callback belongs to
+} callback_t;
+
+/*
+ * The profile of one SQL text, on all the connections
+ */
+typedef struct {
+   char *sql;
+   uint32_t id; // short, stable name for the stats
+   unsigned long calls;
+   uint64_t total; // ns
+   uint64_t max; // ns
+   unsigned long rows;
+   unsigned long prepares;
+} profile_t;
+
 struct database_resultset_sqlite3_s {
    circus_database_resultset_t fn;
    cad_memory_t memory;
    circus_log_t *log;
-   char *sql;
    sqlite3_stmt *stmt;
    int fetched;
    database_query_sqlite3_t *query;
@@ -45,47 +100,169 @@ struct database_query_sqlite3_s {
    circus_database_query_t fn;
    cad_memory_t memory;
    circus_log_t *log;
-   sqlite3 *db;
-   char *sql;
+   database_sqlite3_t *database;
+   connection_t *connection;
    sqlite3_stmt *stmt;
+   int cacheable;
    int running;
+   unsigned long rows; // stepped since the last reset
 };
 
 struct database_sqlite3_s {
    circus_database_t fn;
    cad_memory_t memory;
    circus_log_t *log;
-   sqlite3 *db;
+   connection_t writer;
+   connection_t *readers; // read-only connections, only in WAL mode
+   int readers_count;
+   cad_hash_t *kinds; // per SQL text: whether a statement may run on a reader
+   pthread_mutex_t kinds_lock;
+   int depth; // transaction nesting: 0 = none, 1 = transaction, more = savepoints
+   callback_t *callbacks; // called when the transaction ends
+   int callbacks_count;
+   int callbacks_capacity;
+   int group; // 1 if the outermost transaction is a pending write group
+   int group_count; // parts in the pending write group
+   int group_size; // 0 = no group commit
+   uint64_t group_delay;
+   uv_timer_t group_timer;
+   backup_t *backup; // the running backup, if any
+   int backup_pages;
+   int backup_timer_init;
+   uv_timer_t backup_timer;
+   int closing; // handles being closed: the last close callback frees the database
+   char *dump_path; // in-memory databases: where to dump the data when closed, if set
+   cad_hash_t *profiles; // per SQL text; NULL if not profiling
+   pthread_mutex_t profiles_lock; // the read connections may be used by other threads
+   uint64_t slow_query; // ns; 0 = no slow query log
 };
 
-static void ensure_stmt(database_query_sqlite3_t *q) {
-   assert(!q->running);
-   if (q->stmt == NULL) {
-      int n = sqlite3_prepare_v2(q->db, q->sql, -1, &q->stmt, NULL);
+/*
+ * The rows stepped by the statement being stepped or reset, for the
+ * profile callback (called by SQLite from within step or reset)
+ */
+static __thread unsigned long stepped_rows = 0;
+
+static uint32_t profile_id(const char *sql) {
+   uint32_t result = 2166136261U;
+   for (; *sql != 0; sql++) {
+      result = (result ^ (uint8_t)*sql) * 16777619U;
+   }
+   return result;
+}
+
+/*
+ * Called with the profiles lock held
+ */
+static profile_t *get_profile(database_sqlite3_t *this, const char *sql) {
+   profile_t *result = this->profiles->get(this->profiles, sql);
+   if (result == NULL && this->profiles->count(this->profiles) < PROFILES_MAX) {
+      result = memory_malloc(this->memory, sizeof(profile_t));
+      assert(result != NULL);
+      memset(result, 0, sizeof(profile_t));
+      result->sql = szprintf(this->memory, NULL, "%s", sql);
+      result->id = profile_id(sql);
+      this->profiles->set(this->profiles, result->sql, result);
+      log_info(this->log, "SQL profile %08"PRIx32": %s", result->id, sql);
+   }
+   return result;
+}
+
+static int trace_profile(unsigned UNUSED(type), database_sqlite3_t *this, sqlite3_stmt *stmt, sqlite3_int64 *elapsed) {
+   const char *sql = sqlite3_sql(stmt);
+   unsigned long rows = stepped_rows;
+   uint64_t time = (uint64_t)*elapsed;
+   stepped_rows = 0;
+   if (sql != NULL) {
+      pthread_mutex_lock(&(this->profiles_lock));
+      profile_t *profile = get_profile(this, sql);
+      if (profile != NULL) {
+         profile->calls++;
+         profile->total += time;
+         if (time > profile->max) {
+            profile->max = time;
+         }
+         profile->rows += rows;
+      }
+      pthread_mutex_unlock(&(this->profiles_lock));
+      if (this->slow_query > 0 && time >= this->slow_query) {
+         log_warning(this->log, "Slow query: %"PRIu64" ms, %lu rows -- %s", time / 1000000, rows, sql);
+      }
+   }
+   return 0;
+}
+
+static void trace_connection(database_sqlite3_t *this, sqlite3 *db) {
+   if (this->profiles != NULL) {
+      sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, (int(*)(unsigned, void*, void*, void*))trace_profile, this);
+   }
+}
+
+/*
+ * Take a prepared statement from the cache, or prepare a new one if
+ * none is available (never used, or already in use by another
+ * query). Only single statements are cacheable: the cache is keyed by
+ * the statement SQL text.
+ */
+static sqlite3_stmt *acquire_stmt(database_sqlite3_t *db, connection_t *connection, const char *sql, int *cacheable) {
+   sqlite3_stmt *result = connection->stmts->del(connection->stmts, sql);
+   *cacheable = 1;
+   if (result == NULL) {
+      const char *tail = NULL;
+      int n = sqlite3_prepare_v2(connection->db, sql, -1, &result, &tail);
       if (n != SQLITE_OK) {
-         q->stmt = NULL;
-         log_error(q->log, "Error preparing statement: %s -- %s", q->sql, sqlite3_errstr(n));
+         log_error(db->log, "Error preparing statement: %s -- %s", sql, sqlite3_errmsg(connection->db));
+         result = NULL;
+      } else {
+         if (tail != NULL && *tail != 0) {
+            *cacheable = 0;
+         }
+         if (db->profiles != NULL) {
+            pthread_mutex_lock(&(db->profiles_lock));
+            profile_t *profile = get_profile(db, sqlite3_sql(result));
+            if (profile != NULL) {
+               profile->prepares++;
+            }
+            pthread_mutex_unlock(&(db->profiles_lock));
+         }
       }
    }
+   return result;
 }
 
-static void requery(database_query_sqlite3_t *q) {
-   if (q->stmt != NULL) {
-      int n = sqlite3_finalize(q->stmt);
+/*
+ * Give back a prepared statement to the cache, or finalize it if the
+ * cache already has one for the same SQL text (or is full)
+ */
+static void release_stmt(database_sqlite3_t *db, connection_t *connection, sqlite3_stmt *stmt, int cacheable) {
+   const char *sql = sqlite3_sql(stmt);
+   if (cacheable && connection->stmts->get(connection->stmts, sql) == NULL && connection->stmts->count(connection->stmts) < STMT_CACHE_SIZE) {
+      connection->stmts->set(connection->stmts, sql, stmt);
+   } else {
+      int n = sqlite3_finalize(stmt);
       if (n != SQLITE_OK) {
-         log_warning(q->log, "Error in finalize: %s", sqlite3_errstr(n));
+         log_warning(db->log, "Error in finalize: %s", sqlite3_errstr(n));
       }
    }
-   q->stmt = NULL;
+}
+
+static void requery(database_query_sqlite3_t *q) {
+   stepped_rows = q->rows;
+   sqlite3_reset(q->stmt);
+   stepped_rows = 0;
+   sqlite3_clear_bindings(q->stmt);
    q->running = 0;
+   q->rows = 0;
 }
 
 static int fetch(database_resultset_sqlite3_t *rs) {
    if (rs->fetched == FETCH_TO_DO) {
+      stepped_rows = rs->query->rows;
       switch(sqlite3_step(rs->stmt)) {
       case SQLITE_OK:
       case SQLITE_ROW:
          rs->fetched = FETCH_READY;
+         rs->query->rows++;
          break;
       case SQLITE_DONE:
          rs->fetched = FETCH_OFF;
@@ -94,6 +271,7 @@ static int fetch(database_resultset_sqlite3_t *rs) {
          rs->fetched = FETCH_ERROR;
          break;
       }
+      stepped_rows = 0;
    }
    return rs->fetched;
 }
@@ -124,6 +302,23 @@ static const char *database_resultset_get_string_sqlite3(database_resultset_sqli
    return (const char*)sqlite3_column_text(this->stmt, index);
 }
 
+static const char *database_resultset_get_string_len_sqlite3(database_resultset_sqlite3_t *this, int index, size_t *len) {
+   assert(index >= 0 && index < sqlite3_column_count(this->stmt));
+   assert(this->fetched == FETCH_TO_DO);
+   // text first, then bytes: the length is the one of the converted value
+   const char *result = (const char*)sqlite3_column_text(this->stmt, index);
+   *len = (size_t)sqlite3_column_bytes(this->stmt, index);
+   return result;
+}
+
+static const void *database_resultset_get_blob_sqlite3(database_resultset_sqlite3_t *this, int index, size_t *len) {
+   assert(index >= 0 && index < sqlite3_column_count(this->stmt));
+   assert(this->fetched == FETCH_TO_DO);
+   const void *result = sqlite3_column_blob(this->stmt, index);
+   *len = (size_t)sqlite3_column_bytes(this->stmt, index);
+   return result;
+}
+
 static void database_resultset_free_sqlite3(database_resultset_sqlite3_t *this) {
    requery(this->query);
    this->memory.free(this);
@@ -135,16 +330,17 @@ static circus_database_resultset_t database_resultset_sqlite3_fn = {
    (circus_database_resultset_next_fn) database_resultset_next_sqlite3,
    (circus_database_resultset_get_int_fn) database_resultset_get_int_sqlite3,
    (circus_database_resultset_get_string_fn) database_resultset_get_string_sqlite3,
+   (circus_database_resultset_get_string_len_fn) database_resultset_get_string_len_sqlite3,
+   (circus_database_resultset_get_blob_fn) database_resultset_get_blob_sqlite3,
    (circus_database_resultset_free_fn) database_resultset_free_sqlite3,
 };
 
 static int database_query_set_int_sqlite3(database_query_sqlite3_t *this, int index, int64_t value) {
    assert(!this->running);
-   ensure_stmt(this);
    assert(index >= 0 && index < sqlite3_bind_parameter_count(this->stmt));
    int n = sqlite3_bind_int64(this->stmt, index + 1, (sqlite3_int64)value);
    if (n != SQLITE_OK) {
-      log_error(this->log, "Error binding parameter #%d: %s -- %s", index, this->sql, sqlite3_errstr(n));
+      log_error(this->log, "Error binding parameter #%d: %s -- %s", index, sqlite3_sql(this->stmt), sqlite3_errstr(n));
       return 0;
    }
    return 1;
@@ -152,11 +348,32 @@ static int database_query_set_int_sqlite3(database_query_sqlite3_t *this, int in
 
 static int database_query_set_string_sqlite3(database_query_sqlite3_t *this, int index, const char *value) {
    assert(!this->running);
-   ensure_stmt(this);
    assert(index >= 0 && index < sqlite3_bind_parameter_count(this->stmt));
    int n = sqlite3_bind_text(this->stmt, index + 1, value, -1, SQLITE_TRANSIENT);
    if (n != SQLITE_OK) {
-      log_error(this->log, "Error binding parameter #%d: %s -- %s", index, this->sql, sqlite3_errstr(n));
+      log_error(this->log, "Error binding parameter #%d: %s -- %s", index, sqlite3_sql(this->stmt), sqlite3_errstr(n));
+      return 0;
+   }
+   return 1;
+}
+
+static int database_query_set_string_static_sqlite3(database_query_sqlite3_t *this, int index, const char *value, int len) {
+   assert(!this->running);
+   assert(index >= 0 && index < sqlite3_bind_parameter_count(this->stmt));
+   int n = sqlite3_bind_text(this->stmt, index + 1, value, len < 0 ? -1 : len, SQLITE_STATIC);
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Error binding parameter #%d: %s -- %s", index, sqlite3_sql(this->stmt), sqlite3_errstr(n));
+      return 0;
+   }
+   return 1;
+}
+
+static int database_query_set_blob_static_sqlite3(database_query_sqlite3_t *this, int index, const void *value, size_t len) {
+   assert(!this->running);
+   assert(index >= 0 && index < sqlite3_bind_parameter_count(this->stmt));
+   int n = sqlite3_bind_blob64(this->stmt, index + 1, value, (sqlite3_uint64)len, SQLITE_STATIC);
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Error binding parameter #%d: %s -- %s", index, sqlite3_sql(this->stmt), sqlite3_errstr(n));
       return 0;
    }
    return 1;
@@ -164,14 +381,12 @@ static int database_query_set_string_sqlite3(database_query_sqlite3_t *this, int
 
 static database_resultset_sqlite3_t *database_query_run_sqlite3(database_query_sqlite3_t *this) {
    assert(!this->running);
-   ensure_stmt(this);
-   database_resultset_sqlite3_t *result = this->memory.malloc(sizeof(database_resultset_sqlite3_t));
+   database_resultset_sqlite3_t *result = memory_malloc(this->memory, sizeof(database_resultset_sqlite3_t));
    assert(result != NULL);
 
    result->fn = database_resultset_sqlite3_fn;
    result->memory = this->memory;
    result->log = this->log;
-   result->sql = this->sql;
    result->stmt = this->stmt;
    result->fetched = FETCH_TO_DO;
    result->query = this;
@@ -184,44 +399,295 @@ static database_resultset_sqlite3_t *database_query_run_sqlite3(database_query_s
 
 static void database_query_free_sqlite3(database_query_sqlite3_t *this) {
    requery(this);
-   int n = sqlite3_db_cacheflush(this->db);
-   if (n != SQLITE_OK) {
-      log_error(this->log, "Error flushing: %s -- %s", this->sql, sqlite3_errstr(n));
-   }
-   this->memory.free(this->sql);
+   release_stmt(this->database, this->connection, this->stmt, this->cacheable);
    this->memory.free(this);
 }
 
 static circus_database_query_t database_query_sqlite3_fn = {
    (circus_database_query_set_int_fn)database_query_set_int_sqlite3,
    (circus_database_query_set_string_fn)database_query_set_string_sqlite3,
+   (circus_database_query_set_string_static_fn)database_query_set_string_static_sqlite3,
+   (circus_database_query_set_blob_static_fn)database_query_set_blob_static_sqlite3,
    (circus_database_query_run_fn)database_query_run_sqlite3,
    (circus_database_query_free_fn)database_query_free_sqlite3,
 };
 
+/*
+ * Each thread sticks to one reader connection; the server loop being
+ * single-threaded, it usually means that there is only one reader in
+ * use at a time, but the connections are opened with full mutexing
+ * anyway.
+ */
+static __thread int reader_slot = -1;
+static int next_reader_slot = 0;
+
+static connection_t *reader_connection(database_sqlite3_t *this) {
+   if (reader_slot < 0) {
+      reader_slot = __sync_fetch_and_add(&next_reader_slot, 1);
+   }
+   return this->readers + (reader_slot % this->readers_count);
+}
+
+/*
+ * Whether the statement may run on a reader: a single read-only
+ * statement. Known from its first prepare, done on the reader, and
+ * remembered per SQL text so that the classification costs neither a
+ * prepare on the writer nor a second prepare.
+ */
+typedef struct {
+   int readonly;
+   char sql[];
+} kind_t;
+
+/*
+ * The statement prepared on the reader, or NULL if it must run on the
+ * writer
+ */
+static sqlite3_stmt *acquire_read_stmt(database_sqlite3_t *this, connection_t *reader, const char *sql, int *cacheable) {
+   int readonly = -1;
+   pthread_mutex_lock(&(this->kinds_lock));
+   kind_t *kind = this->kinds->get(this->kinds, sql);
+   if (kind != NULL) {
+      readonly = kind->readonly;
+   }
+   pthread_mutex_unlock(&(this->kinds_lock));
+   if (readonly == 0) {
+      return NULL;
+   }
+
+   sqlite3_stmt *result = acquire_stmt(this, reader, sql, cacheable);
+   if (result != NULL && readonly < 0) {
+      readonly = *cacheable && sqlite3_stmt_readonly(result);
+      size_t n = strlen(sql) + 1;
+      pthread_mutex_lock(&(this->kinds_lock));
+      if (this->kinds->get(this->kinds, sql) == NULL && this->kinds->count(this->kinds) < KINDS_MAX) {
+         kind = memory_malloc(this->memory, sizeof(kind_t) + n);
+         assert(kind != NULL);
+         kind->readonly = readonly;
+         memcpy(kind->sql, sql, n);
+         this->kinds->set(this->kinds, kind->sql, kind);
+      }
+      pthread_mutex_unlock(&(this->kinds_lock));
+      if (!readonly) {
+         release_stmt(this, reader, result, 0);
+         result = NULL;
+      }
+   }
+   return result;
+}
+
+static int database_flush_sqlite3(database_sqlite3_t *this);
+
+/*
+ * Reads that are not part of a transaction are run on a reader
+ * connection, so that they do not wait for the writer; reads in a
+ * transaction must see its uncommitted changes. The pending write group
+ * is not such a transaction: it may still be rolled back, so the reads
+ * outside its parts do not see it. A write outside a transaction
+ * commits the pending write group first.
+ */
 static database_query_sqlite3_t *database_query_sqlite3(database_sqlite3_t *this, const char *sql) {
    database_query_sqlite3_t *result = NULL;
-   result = this->memory.malloc(sizeof(database_query_sqlite3_t));
-   assert(result != NULL);
-   result->fn = database_query_sqlite3_fn;
-   result->memory = this->memory;
-   result->log = this->log;
-   result->db = this->db;
-   result->sql = szprintf(this->memory, NULL, "%s", sql);
-   result->stmt = NULL;
-   result->running = 0;
+   connection_t *connection = &(this->writer);
+   int cacheable;
+   sqlite3_stmt *stmt = NULL;
+   if ((this->depth == 0 || (this->group && this->depth == 1)) && this->readers_count > 0) {
+      connection_t *reader = reader_connection(this);
+      stmt = acquire_read_stmt(this, reader, sql, &cacheable);
+      if (stmt != NULL) {
+         connection = reader;
+      }
+   }
+   if (stmt == NULL) {
+      stmt = acquire_stmt(this, connection, sql, &cacheable);
+      if (stmt != NULL && this->group && this->depth == 1 && !sqlite3_stmt_readonly(stmt) && !database_flush_sqlite3(this)) {
+         // an autocommit write must not silently join the pending write group
+         release_stmt(this, connection, stmt, cacheable);
+         stmt = NULL;
+      }
+   }
+   if (stmt != NULL) {
+      result = memory_malloc(this->memory, sizeof(database_query_sqlite3_t));
+      assert(result != NULL);
+      result->fn = database_query_sqlite3_fn;
+      result->memory = this->memory;
+      result->log = this->log;
+      result->database = this;
+      result->connection = connection;
+      result->stmt = stmt;
+      result->cacheable = cacheable;
+      result->running = 0;
+      result->rows = 0;
+   }
    return result;
 }
 
-static void database_free_sqlite3(database_sqlite3_t *this) {
-   sqlite3_close(this->db);
-   this->memory.free(this);
+static int exec_sqlite3(database_sqlite3_t *this, const char *sql) {
+   int n = sqlite3_exec(this->writer.db, sql, NULL, NULL, NULL);
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Error executing: %s -- %s", sql, sqlite3_errmsg(this->writer.db));
+      return 0;
+   }
+   return 1;
 }
 
-static circus_database_t database_sqlite3_fn = {
-   (circus_database_query_fn) database_query_sqlite3,
-   (circus_database_free_fn) database_free_sqlite3,
-};
+static void add_callback(database_sqlite3_t *this, circus_database_done_fn done, void *data) {
+   if (this->callbacks_count == this->callbacks_capacity) {
+      int capacity = this->callbacks_capacity == 0 ? 16 : this->callbacks_capacity * 2;
+      callback_t *callbacks = memory_realloc(this->memory, this->callbacks, capacity * sizeof(callback_t));
+      assert(callbacks != NULL);
+      this->callbacks = callbacks;
+      this->callbacks_capacity = capacity;
+   }
+   this->callbacks[this->callbacks_count].done = done;
+   this->callbacks[this->callbacks_count].data = data;
+   this->callbacks[this->callbacks_count].level = this->depth;
+   this->callbacks_count++;
+}
+
+/*
+ * Called when a transaction level ends (this->depth being already
+ * decremented): its callbacks go to the enclosing level if the level
+ * was released, otherwise they are called (outermost commit, or
+ * rollback). The callbacks are detached before being called, so that
+ * they can safely use the database.
+ */
+static void end_level(database_sqlite3_t *this, int status) {
+   int i, keep = 0, fire = 0;
+   callback_t *fired = NULL;
+
+   if (this->depth == 0 && this->group) {
+      this->group = 0;
+      uv_timer_stop(&(this->group_timer));
+   }
+
+   for (i = 0; i < this->callbacks_count; i++) {
+      if (this->callbacks[i].level > this->depth && (!status || this->depth == 0)) {
+         if (fired == NULL) {
+            fired = memory_malloc(this->memory, (this->callbacks_count - i) * sizeof(callback_t));
+            assert(fired != NULL);
+         }
+         fired[fire++] = this->callbacks[i];
+      } else {
+         if (this->callbacks[i].level > this->depth) {
+            this->callbacks[i].level = this->depth;
+         }
+         this->callbacks[keep++] = this->callbacks[i];
+      }
+   }
+   this->callbacks_count = keep;
+
+   for (i = 0; i < fire; i++) {
+      fired[i].done(fired[i].data, status);
+   }
+   if (fired != NULL) {
+      this->memory.free(fired);
+   }
+}
+
+static int begin_level(database_sqlite3_t *this) {
+   int result;
+   if (this->depth == 0) {
+      result = exec_sqlite3(this, "BEGIN IMMEDIATE");
+   } else {
+      char sql[32];
+      snprintf(sql, sizeof(sql), "SAVEPOINT SP%d", this->depth);
+      result = exec_sqlite3(this, sql);
+   }
+   if (result) {
+      this->depth++;
+   }
+   return result;
+}
+
+static int database_rollback_sqlite3(database_sqlite3_t *this) {
+   int result;
+   assert(this->depth > 0);
+   this->depth--;
+   if (this->depth == 0) {
+      result = exec_sqlite3(this, "ROLLBACK");
+   } else {
+      char sql[64];
+      snprintf(sql, sizeof(sql), "ROLLBACK TO SP%d; RELEASE SP%d", this->depth, this->depth);
+      result = exec_sqlite3(this, sql);
+   }
+   end_level(this, 0);
+   return result;
+}
+
+static int database_commit_sqlite3(database_sqlite3_t *this) {
+   int result;
+   assert(this->depth > 0);
+   if (this->depth == 1) {
+      result = exec_sqlite3(this, "COMMIT");
+      if (!result) {
+         // the transaction is still open: do not leave it so
+         database_rollback_sqlite3(this);
+      } else {
+         this->depth--;
+         end_level(this, 1);
+      }
+   } else {
+      char sql[32];
+      this->depth--;
+      snprintf(sql, sizeof(sql), "RELEASE SP%d", this->depth);
+      result = exec_sqlite3(this, sql);
+      end_level(this, 1);
+   }
+   return result;
+}
+
+static int database_flush_sqlite3(database_sqlite3_t *this) {
+   int result = 1;
+   // a part still running will flush the group itself if needed
+   if (this->group && this->depth == 1) {
+      log_debug(this->log, "Committing write group of %d", this->group_count);
+      result = database_commit_sqlite3(this);
+   }
+   return result;
+}
+
+static int database_begin_sqlite3(database_sqlite3_t *this) {
+   // an explicit transaction must be durable when committed: it does not join the write group
+   if (!database_flush_sqlite3(this)) {
+      return 0;
+   }
+   return begin_level(this);
+}
+
+static void on_group_timer(uv_timer_t *timer) {
+   database_sqlite3_t *this = timer->data;
+   database_flush_sqlite3(this);
+}
+
+static int database_begin_deferred_sqlite3(database_sqlite3_t *this) {
+   if (this->group_size == 0 || (this->depth > 0 && !this->group)) {
+      return begin_level(this);
+   }
+   if (this->depth == 0) {
+      if (!begin_level(this)) {
+         return 0;
+      }
+      this->group = 1;
+      this->group_count = 0;
+      uv_timer_start(&(this->group_timer), on_group_timer, this->group_delay, 0);
+   }
+   return begin_level(this);
+}
+
+static int database_commit_deferred_sqlite3(database_sqlite3_t *this, circus_database_done_fn done, void *data) {
+   int result;
+   int part = this->group && this->depth == 2;
+   assert(this->depth > 0);
+   if (done != NULL) {
+      add_callback(this, done, data);
+   }
+   result = database_commit_sqlite3(this);
+   if (result && part && ++(this->group_count) >= this->group_size) {
+      result = database_flush_sqlite3(this);
+   }
+   return result;
+}
 
 static void mkparentdirs(cad_memory_t memory, const char *dir) {
    char *tmp;
@@ -253,25 +719,617 @@ static void mkparentdirs(cad_memory_t memory, const char *dir) {
    memory.free(tmp);
 }
 
-circus_database_t *circus_database_sqlite3(cad_memory_t memory, circus_log_t *log, const char *path) {
-   database_sqlite3_t *result = memory.malloc(sizeof(database_sqlite3_t));
+static void end_backup(database_sqlite3_t *this, int status) {
+   backup_t *backup = this->backup;
+   uv_timer_stop(&(this->backup_timer));
+   uv_unref((uv_handle_t*)&(this->backup_timer));
+
+   int pages = sqlite3_backup_pagecount(backup->backup);
+   int n = sqlite3_backup_finish(backup->backup);
+   if (status && n != SQLITE_OK) {
+      log_error(this->log, "Backup failed: %s", sqlite3_errmsg(backup->db));
+      status = 0;
+   }
+   if (sqlite3_close(backup->db) != SQLITE_OK) {
+      status = 0;
+   }
+   if (status && rename(backup->tmp_path, backup->path) != 0) {
+      log_error(this->log, "Backup failed: could not rename %s to %s: %s", backup->tmp_path, backup->path, strerror(errno));
+      status = 0;
+   }
+   if (status) {
+      log_info(this->log, "Backup to %s done: %d pages in %"PRIu64" ms", backup->path, pages, (uv_hrtime() - backup->start) / 1000000);
+   } else {
+      unlink(backup->tmp_path);
+      log_error(this->log, "Backup to %s failed", backup->path);
+   }
+
+   this->backup = NULL;
+   if (backup->done != NULL) {
+      backup->done(backup->data, status);
+   }
+   this->memory.free(backup->path);
+   this->memory.free(backup->tmp_path);
+   this->memory.free(backup);
+}
+
+/*
+ * One small batch of pages per tick, so that requests are served in
+ * between. While the writer is in a transaction, the step returns
+ * SQLITE_LOCKED (or SQLITE_BUSY): just wait for the next tick.
+ */
+static void on_backup_timer(uv_timer_t *timer) {
+   database_sqlite3_t *this = timer->data;
+   backup_t *backup = this->backup;
+   int n = sqlite3_backup_step(backup->backup, this->backup_pages);
+   switch (n) {
+   case SQLITE_OK: {
+      int total = sqlite3_backup_pagecount(backup->backup);
+      int progress = total == 0 ? 0 : 10 * (total - sqlite3_backup_remaining(backup->backup)) / total;
+      if (progress > backup->progress) {
+         backup->progress = progress;
+         log_info(this->log, "Backup to %s: %d%% of %d pages", backup->path, progress * 10, total);
+      }
+      break;
+   }
+   case SQLITE_BUSY:
+   case SQLITE_LOCKED:
+      break;
+   case SQLITE_DONE:
+      end_backup(this, 1);
+      break;
+   default:
+      log_error(this->log, "Backup failed: %s", sqlite3_errstr(n));
+      end_backup(this, 0);
+      break;
+   }
+}
+
+static int database_backup_sqlite3(database_sqlite3_t *this, const char *path, circus_database_done_fn done, void *data) {
+   if (this->backup != NULL) {
+      log_error(this->log, "Backup to %s refused: a backup to %s is already running", path, this->backup->path);
+      return 0;
+   }
+
+   backup_t *backup = memory_malloc(this->memory, sizeof(backup_t));
+   assert(backup != NULL);
+   backup->path = szprintf(this->memory, NULL, "%s", path);
+   backup->tmp_path = szprintf(this->memory, NULL, "%s.tmp", path);
+   backup->done = done;
+   backup->data = data;
+   backup->start = uv_hrtime();
+   backup->progress = 0;
+
+   mkparentdirs(this->memory, path);
+   unlink(backup->tmp_path);
+   int n = sqlite3_open_v2(backup->tmp_path, &(backup->db), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_PRIVATECACHE, NULL);
+   if (n == SQLITE_OK) {
+      backup->backup = sqlite3_backup_init(backup->db, "main", this->writer.db, "main");
+      if (backup->backup == NULL) {
+         n = sqlite3_errcode(backup->db);
+      }
+   }
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Cannot start backup to %s -- %s", path, sqlite3_errmsg(backup->db));
+      sqlite3_close(backup->db);
+      unlink(backup->tmp_path);
+      this->memory.free(backup->path);
+      this->memory.free(backup->tmp_path);
+      this->memory.free(backup);
+      return 0;
+   }
+
+   if (!this->backup_timer_init) {
+      uv_timer_init(uv_default_loop(), &(this->backup_timer));
+      this->backup_timer.data = this;
+      this->backup_timer_init = 1;
+   }
+   // the running backup keeps the loop alive (used by the --backup command line)
+   uv_ref((uv_handle_t*)&(this->backup_timer));
+   uv_timer_start(&(this->backup_timer), on_backup_timer, 0, BACKUP_INTERVAL);
+
+   this->backup = backup;
+   log_info(this->log, "Backup to %s started", path);
+   return 1;
+}
+
+/*
+ * Synchronous copy, for in-memory databases
+ */
+static int copy_database(database_sqlite3_t *this, sqlite3 *to, sqlite3 *from) {
+   sqlite3_backup *backup = sqlite3_backup_init(to, "main", from, "main");
+   if (backup == NULL) {
+      log_error(this->log, "Cannot copy database: %s", sqlite3_errmsg(to));
+      return 0;
+   }
+   sqlite3_backup_step(backup, -1);
+   int n = sqlite3_backup_finish(backup);
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Cannot copy database: %s", sqlite3_errstr(n));
+      return 0;
+   }
+   return 1;
+}
+
+static int load_snapshot(database_sqlite3_t *this, const char *path) {
+   sqlite3 *db;
+   int result = 0;
+   int n = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE, NULL);
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Cannot open snapshot: %s -- %s", path, sqlite3_errmsg(db));
+   } else {
+      result = copy_database(this, this->writer.db, db);
+   }
+   sqlite3_close(db);
+   return result;
+}
+
+static void dump_snapshot(database_sqlite3_t *this) {
+   sqlite3 *db;
+   char *tmp_path = szprintf(this->memory, NULL, "%s.tmp", this->dump_path);
+   int ok = 0;
+   mkparentdirs(this->memory, this->dump_path);
+   unlink(tmp_path);
+   int n = sqlite3_open_v2(tmp_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_PRIVATECACHE, NULL);
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Cannot open snapshot: %s -- %s", tmp_path, sqlite3_errmsg(db));
+   } else {
+      ok = copy_database(this, db, this->writer.db);
+   }
+   if (sqlite3_close(db) != SQLITE_OK) {
+      ok = 0;
+   }
+   if (ok && rename(tmp_path, this->dump_path) != 0) {
+      log_error(this->log, "Cannot rename %s to %s: %s", tmp_path, this->dump_path, strerror(errno));
+      ok = 0;
+   }
+   if (ok) {
+      log_info(this->log, "In-memory database dumped to %s", this->dump_path);
+   } else {
+      unlink(tmp_path);
+      log_error(this->log, "In-memory database NOT dumped to %s", this->dump_path);
+   }
+   this->memory.free(tmp_path);
+}
+
+static void finalize_stmt(cad_hash_t *UNUSED(hash), int UNUSED(index), const char *UNUSED(sql), sqlite3_stmt *stmt, database_sqlite3_t *UNUSED(this)) {
+   sqlite3_finalize(stmt);
+}
+
+static void close_connection(database_sqlite3_t *this, connection_t *connection) {
+   if (connection->stmts != NULL) {
+      connection->stmts->clean(connection->stmts, (cad_hash_iterator_fn)finalize_stmt, this);
+      connection->stmts->free(connection->stmts);
+   }
+   sqlite3_close(connection->db);
+}
+
+typedef struct {
+   profile_t *profiles;
+   size_t count;
+} profiles_snapshot_t;
+
+static void copy_profile(cad_hash_t *UNUSED(hash), int UNUSED(index), const char *UNUSED(sql), profile_t *profile, profiles_snapshot_t *snapshot) {
+   snapshot->profiles[snapshot->count++] = *profile;
+}
+
+static int compare_profiles(const profile_t *profile1, const profile_t *profile2) {
+   return profile1->total < profile2->total ? 1 : profile1->total > profile2->total ? -1 : 0;
+}
+
+/*
+ * A copy of the profiles, the most expensive first (the visitors may
+ * use the database)
+ */
+static profile_t *snapshot_profiles(database_sqlite3_t *this, size_t *count) {
+   profiles_snapshot_t snapshot = { NULL, 0 };
+   pthread_mutex_lock(&(this->profiles_lock));
+   size_t n = (size_t)this->profiles->count(this->profiles);
+   if (n > 0) {
+      snapshot.profiles = memory_malloc(this->memory, n * sizeof(profile_t));
+      assert(snapshot.profiles != NULL);
+      this->profiles->iterate(this->profiles, (cad_hash_iterator_fn)copy_profile, &snapshot);
+   }
+   pthread_mutex_unlock(&(this->profiles_lock));
+   if (snapshot.count > 0) {
+      qsort(snapshot.profiles, snapshot.count, sizeof(profile_t), (int(*)(const void*, const void*))compare_profiles);
+   }
+   *count = snapshot.count;
+   return snapshot.profiles;
+}
+
+static void profile_stat(circus_stats_fn fn, void *data, profile_t *profile, const char *counter, unsigned long value) {
+   char name[64];
+   snprintf(name, sizeof(name), "sqlite.%08"PRIx32".%s", profile->id, counter);
+   fn(data, name, value);
+}
+
+static void database_stats_sqlite3(database_sqlite3_t *this, circus_stats_fn fn, void *data) {
+   profile_t *profiles;
+   size_t i, count;
+   if (this->profiles != NULL) {
+      profiles = snapshot_profiles(this, &count);
+      for (i = 0; i < count; i++) {
+         profile_stat(fn, data, profiles + i, "calls", profiles[i].calls);
+         profile_stat(fn, data, profiles + i, "total_us", (unsigned long)(profiles[i].total / 1000));
+         profile_stat(fn, data, profiles + i, "max_us", (unsigned long)(profiles[i].max / 1000));
+         profile_stat(fn, data, profiles + i, "rows", profiles[i].rows);
+         profile_stat(fn, data, profiles + i, "prepares", profiles[i].prepares);
+      }
+      if (profiles != NULL) {
+         this->memory.free(profiles);
+      }
+   }
+}
+
+static void report_profiles(database_sqlite3_t *this) {
+   size_t i, count;
+   profile_t *profiles = snapshot_profiles(this, &count);
+   for (i = 0; i < count; i++) {
+      log_info(this->log, "SQL profile %08"PRIx32": %lu calls, %"PRIu64" us total, %"PRIu64" us max, %lu rows, %lu prepares -- %s",
+               profiles[i].id, profiles[i].calls, profiles[i].total / 1000, profiles[i].max / 1000, profiles[i].rows, profiles[i].prepares,
+               profiles[i].sql);
+   }
+   if (profiles != NULL) {
+      this->memory.free(profiles);
+   }
+}
+
+static void free_profile(cad_hash_t *UNUSED(hash), int UNUSED(index), const char *UNUSED(sql), profile_t *profile, database_sqlite3_t *this) {
+   this->memory.free(profile->sql);
+   this->memory.free(profile);
+}
+
+static void free_kind(cad_hash_t *UNUSED(hash), int UNUSED(index), const char *UNUSED(sql), kind_t *kind, database_sqlite3_t *this) {
+   this->memory.free(kind);
+}
+
+static void on_close(uv_handle_t *handle) {
+   database_sqlite3_t *this = handle->data;
+   if (--(this->closing) == 0) {
+      this->memory.free(this);
+   }
+}
+
+static void database_free_sqlite3(database_sqlite3_t *this) {
+   int i;
+   if (this->backup != NULL) {
+      log_warning(this->log, "Closing database with a running backup: aborting it");
+      end_backup(this, 0);
+   }
+   database_flush_sqlite3(this);
+   if (this->depth > 0) {
+      log_warning(this->log, "Closing database with a running transaction: rolling back");
+      while (this->depth > 0) {
+         database_rollback_sqlite3(this);
+      }
+   }
+   if (this->dump_path != NULL) {
+      dump_snapshot(this);
+      this->memory.free(this->dump_path);
+   }
+   for (i = 0; i < this->readers_count; i++) {
+      close_connection(this, this->readers + i);
+   }
+   if (this->readers != NULL) {
+      this->memory.free(this->readers);
+   }
+   if (this->kinds != NULL) {
+      this->kinds->clean(this->kinds, (cad_hash_iterator_fn)free_kind, this);
+      this->kinds->free(this->kinds);
+      pthread_mutex_destroy(&(this->kinds_lock));
+   }
+   close_connection(this, &(this->writer));
+   if (this->profiles != NULL) {
+      report_profiles(this);
+      this->profiles->clean(this->profiles, (cad_hash_iterator_fn)free_profile, this);
+      this->profiles->free(this->profiles);
+      pthread_mutex_destroy(&(this->profiles_lock));
+   }
+   if (this->callbacks != NULL) {
+      this->memory.free(this->callbacks);
+   }
+   // the loop keeps pointers to the timers until they are closed
+   if (this->group_size > 0) {
+      this->closing++;
+      uv_close((uv_handle_t*)&(this->group_timer), on_close);
+   }
+   if (this->backup_timer_init) {
+      this->closing++;
+      uv_close((uv_handle_t*)&(this->backup_timer), on_close);
+   }
+   if (this->closing == 0) {
+      this->memory.free(this);
+   }
+}
+
+static circus_database_t database_sqlite3_fn = {
+   (circus_database_query_fn) database_query_sqlite3,
+   (circus_database_begin_fn) database_begin_sqlite3,
+   (circus_database_commit_fn) database_commit_sqlite3,
+   (circus_database_rollback_fn) database_rollback_sqlite3,
+   (circus_database_begin_deferred_fn) database_begin_deferred_sqlite3,
+   (circus_database_commit_deferred_fn) database_commit_deferred_sqlite3,
+   (circus_database_flush_fn) database_flush_sqlite3,
+   (circus_database_backup_fn) database_backup_sqlite3,
+   (circus_database_stats_fn) database_stats_sqlite3,
+   (circus_database_free_fn) database_free_sqlite3,
+};
+
+/*
+ * The tuning pragmas, read from the "vault.sqlite" configuration
+ * section. Values are checked against the allowed keywords and/or
+ * must be integers. Only some of them make sense on the read-only
+ * connections.
+ */
+
+#define PRAGMA_KEYWORD  0
+#define PRAGMA_UNSIGNED 1
+#define PRAGMA_SIGNED   2
+
+typedef struct {
+   const char *name;
+   const char **keywords;
+   int numeric;
+   int reader;
+} pragma_t;
+
+static const char *journal_modes[] = { "delete", "truncate", "persist", "memory", "wal", "off", NULL };
+static const char *synchronous_modes[] = { "off", "normal", "full", "extra", NULL };
+static const char *temp_stores[] = { "default", "file", "memory", NULL };
+
+static pragma_t pragmas[] = {
+   { "journal_mode", journal_modes,     PRAGMA_KEYWORD,  0 },
+   { "synchronous",  synchronous_modes, PRAGMA_UNSIGNED, 0 },
+   { "mmap_size",    NULL,              PRAGMA_UNSIGNED, 1 },
+   { "cache_size",   NULL,              PRAGMA_SIGNED,   1 },
+   { "temp_store",   temp_stores,       PRAGMA_UNSIGNED, 1 },
+   { "busy_timeout", NULL,              PRAGMA_UNSIGNED, 1 },
+   { NULL, NULL, 0, 0 },
+};
+
+static int valid_pragma(pragma_t *pragma, const char *value) {
+   int i;
+   char *end;
+   if (pragma->keywords != NULL) {
+      for (i = 0; pragma->keywords[i] != NULL; i++) {
+         if (!strcasecmp(pragma->keywords[i], value)) {
+            return 1;
+         }
+      }
+   }
+   errno = 0;
+   switch (pragma->numeric) {
+   case PRAGMA_UNSIGNED:
+      if (value[0] == '-') {
+         return 0;
+      }
+      strtoull(value, &end, 10);
+      break;
+   case PRAGMA_SIGNED:
+      strtoll(value, &end, 10);
+      break;
+   default:
+      return 0;
+   }
+   return errno == 0 && end != value && *end == 0;
+}
+
+static int set_pragmas(database_sqlite3_t *this, sqlite3 *db, int reader, circus_config_t *config) {
+   int result = 1;
+   int i, n;
+   char *sql;
+   sqlite3_stmt *stmt;
+
+   for (i = 0; result && pragmas[i].name != NULL; i++) {
+      const char *value = config->get(config, "vault.sqlite", pragmas[i].name);
+      if (value != NULL && (pragmas[i].reader || !reader)) {
+         if (!valid_pragma(&pragmas[i], value)) {
+            log_error(this->log, "Invalid %s: %s", pragmas[i].name, value);
+            result = 0;
+         } else {
+            sql = szprintf(this->memory, NULL, "PRAGMA %s=%s", pragmas[i].name, value);
+            n = sqlite3_exec(db, sql, NULL, NULL, NULL);
+            if (n != SQLITE_OK) {
+               log_error(this->log, "Error setting %s -- %s", sql, sqlite3_errmsg(db));
+               result = 0;
+            }
+            this->memory.free(sql);
+         }
+      }
+   }
+
+   for (i = 0; result && !reader && pragmas[i].name != NULL; i++) {
+      sql = szprintf(this->memory, NULL, "PRAGMA %s", pragmas[i].name);
+      n = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+      if (n == SQLITE_OK) {
+         if (sqlite3_step(stmt) == SQLITE_ROW) {
+            log_info(this->log, "SQLite %s = %s", pragmas[i].name, (const char*)sqlite3_column_text(stmt, 0));
+         }
+         sqlite3_finalize(stmt);
+      }
+      this->memory.free(sql);
+   }
+
+   return result;
+}
+
+static int is_wal(database_sqlite3_t *this) {
+   int result = 0;
+   sqlite3_stmt *stmt;
+   int n = sqlite3_prepare_v2(this->writer.db, "PRAGMA journal_mode", -1, &stmt, NULL);
+   if (n == SQLITE_OK) {
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+         result = !strcasecmp((const char*)sqlite3_column_text(stmt, 0), "wal");
+      }
+      sqlite3_finalize(stmt);
+   }
+   return result;
+}
+
+/*
+ * Counters from the "vault.sqlite" configuration section: the number of
+ * read-only connections, the group commit parameters (none by
+ * default), the number of pages copied per backup step, and the slow
+ * query threshold (ms)
+ */
+static int get_count(circus_log_t *log, circus_config_t *config, const char *name, unsigned long max, unsigned long *count) {
+   int result = 1;
+   const char *value;
+   char *end;
+   if (config != NULL) {
+      value = config->get(config, "vault.sqlite", name);
+      if (value != NULL) {
+         errno = 0;
+         *count = strtoul(value, &end, 10);
+         if (errno != 0 || end == value || *end != 0 || *count > max) {
+            log_error(log, "Invalid %s: %s", name, value);
+            result = 0;
+         }
+      }
+   }
+   return result;
+}
+
+static int open_reader(database_sqlite3_t *this, connection_t *reader, circus_config_t *config, const char *path) {
+   int n = sqlite3_open_v2(path, &(reader->db),
+                           SQLITE_OPEN_READONLY | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_PRIVATECACHE,
+                           NULL);
+   reader->stmts = NULL;
+   if (n != SQLITE_OK) {
+      log_error(this->log, "Cannot open read connection: %s -- %s", path, sqlite3_errmsg(reader->db));
+      return 0;
+   }
+   reader->stmts = cad_new_hash(this->memory, cad_hash_strings);
+   assert(reader->stmts != NULL);
+   trace_connection(this, reader->db);
+   return set_pragmas(this, reader->db, 1, config);
+}
+
+/*
+ * The writer connection uses the "unix-excl" VFS (no other process may
+ * touch the vault) unless read-only connections are configured: they
+ * need to share the WAL index with the writer.
+ *
+ * In-memory databases have no read connections and no pragmas; they
+ * are seeded from path if it exists.
+ */
+static circus_database_t *open_database(cad_memory_t memory, circus_log_t *log, circus_config_t *config, const char *path, int in_memory) {
+   int i;
+   unsigned long readers_count = 0, group_size = 0, group_delay = GROUP_DELAY_DEFAULT, backup_pages = BACKUP_PAGES_DEFAULT, slow_query = 0;
+   if (!get_count(log, config, "read_connections", READERS_MAX, &readers_count)
+       || !get_count(log, config, "group_size", GROUP_SIZE_MAX, &group_size)
+       || !get_count(log, config, "group_delay", GROUP_DELAY_MAX, &group_delay)
+       || !get_count(log, config, "backup_pages", BACKUP_PAGES_MAX, &backup_pages)
+       || !get_count(log, config, "slow_query", SLOW_QUERY_MAX, &slow_query)) {
+      return NULL;
+   }
+   const char *profile = config == NULL ? NULL : config->get(config, "vault.sqlite", "profile");
+
+   if (in_memory) {
+      readers_count = 0;
+   }
+
+   database_sqlite3_t *result = memory_malloc(memory, sizeof(database_sqlite3_t));
    assert(result != NULL);
 
-   mkparentdirs(memory, path);
+   if (!in_memory) {
+      mkparentdirs(memory, path);
+   }
 
    result->fn = database_sqlite3_fn;
    result->memory = memory;
    result->log = log;
+   result->readers = NULL;
+   result->readers_count = 0;
+   result->kinds = NULL;
+   result->callbacks = NULL;
+   result->callbacks_count = 0;
+   result->callbacks_capacity = 0;
+   result->group = 0;
+   result->group_count = 0;
+   result->group_size = 0;
+   result->backup = NULL;
+   result->backup_pages = backup_pages == 0 ? BACKUP_PAGES_DEFAULT : (int)backup_pages;
+   result->backup_timer_init = 0;
+   result->dump_path = NULL;
+   result->profiles = NULL;
+   result->slow_query = (uint64_t)slow_query * 1000000;
 
-   int n = sqlite3_open_v2(path, &(result->db),
+   int n = sqlite3_open_v2(in_memory ? ":memory:" : path, &(result->writer.db),
                            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_PRIVATECACHE,
-                           "unix-excl");
+                           readers_count > 0 ? NULL : "unix-excl");
    if (n != SQLITE_OK) {
-      log_error(log, "Cannot open database: %s -- %s", path, sqlite3_errmsg(result->db));
-      sqlite3_close(result->db);
+      log_error(log, "Cannot open database: %s -- %s", path, sqlite3_errmsg(result->writer.db));
+      sqlite3_close(result->writer.db);
       memory.free(result);
       return NULL;
    }
 
+   result->writer.stmts = cad_new_hash(memory, cad_hash_strings);
+   assert(result->writer.stmts != NULL);
+   result->depth = 0;
+
+   // a slow query log needs the profiles
+   if (slow_query > 0 || (profile != NULL && !strcmp(profile, "true"))) {
+      result->profiles = cad_new_hash(memory, cad_hash_strings);
+      assert(result->profiles != NULL);
+      pthread_mutex_init(&(result->profiles_lock), NULL);
+      trace_connection(result, result->writer.db);
+      log_info(log, "SQLite profiling enabled, slow query threshold = %lu ms", slow_query);
+   }
+
+   if (group_size > 1 && group_delay > 0) {
+      result->group_size = (int)group_size;
+      result->group_delay = (uint64_t)group_delay;
+      uv_timer_init(uv_default_loop(), &(result->group_timer));
+      result->group_timer.data = result;
+      // pending writes do not keep the loop alive: they are flushed when the database is closed
+      uv_unref((uv_handle_t*)&(result->group_timer));
+      log_info(log, "SQLite write group = %d, %"PRIu64" ms", result->group_size, result->group_delay);
+   }
+
+   if (in_memory) {
+      if (path != NULL && access(path, F_OK) == 0 && !load_snapshot(result, path)) {
+         database_free_sqlite3(result);
+         return NULL;
+      }
+      const char *dump = config == NULL ? NULL : config->get(config, "vault.memory", "dump");
+      if (path != NULL && dump != NULL && !strcmp(dump, "true")) {
+         result->dump_path = szprintf(memory, NULL, "%s", path);
+      }
+   } else if (config != NULL && !set_pragmas(result, result->writer.db, 0, config)) {
+      database_free_sqlite3(result);
+      return NULL;
+   }
+
+   if (readers_count > 0) {
+      if (!is_wal(result)) {
+         log_warning(log, "Read connections need journal_mode=wal: not opened");
+      } else {
+         result->readers = memory_malloc(memory, readers_count * sizeof(connection_t));
+         assert(result->readers != NULL);
+         result->kinds = cad_new_hash(memory, cad_hash_strings);
+         assert(result->kinds != NULL);
+         pthread_mutex_init(&(result->kinds_lock), NULL);
+         for (i = 0; i < (int)readers_count; i++) {
+            result->readers_count++;
+            if (!open_reader(result, result->readers + i, config, path)) {
+               database_free_sqlite3(result);
+               return NULL;
+            }
+         }
+         log_info(log, "SQLite read connections = %lu", readers_count);
+      }
+   }
+
    return I(result);
 }
+
+circus_database_t *circus_database_sqlite3(cad_memory_t memory, circus_log_t *log, circus_config_t *config, const char *path) {
+   return open_database(memory, log, config, path, 0);
+}
+
+circus_database_t *circus_database_memory(cad_memory_t memory, circus_log_t *log, circus_config_t *config, const char *path) {
+   return open_database(memory, log, config, path, 1);
+}
@@ -28,6 +28,7 @@
 
 #include <circus_crypt.h>
 #include <circus_log.h>
+#include <circus_memory.h>
 #include <circus_message_impl.h>
 #include <circus_password.h>
 #include <circus_session.h>
@@ -51,6 +52,12 @@ typedef struct {
    int running;
    circus_message_t *reply;
 
+   // The pressure level the caches were last shrunk for; reset only
+   // once the usage falls back below the soft budget, so that a
+   // plateau over a budget does not empty the caches at every reply.
+   memory_pressure_t shrunk;
+   uint64_t warned; // loop time (ms) of the latest pressure warning
+
    // The two fields below manage the latest POST-Redirect-GET when
    // creating a new user, because the random password must be
    // displayed.  Risk mitigation: only for the random password; its
@@ -62,6 +69,33 @@ typedef struct {
    char *last_password;
 } impl_mh_t;
 
+static void visit_query_backup(circus_message_visitor_query_t *visitor, circus_message_query_backup_t *visited) {
+   impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
+   const char *sessionid = visited->sessionid(visited);
+   const char *token = visited->token(visited);
+   const char *error = "refused";
+
+   circus_session_data_t *data = this->session->get(this->session, sessionid, token);
+   if (data == NULL) {
+      log_error(this->log, "Backup query REFUSED, unknown session or invalid token");
+      token = "";
+   } else {
+      circus_user_t *user = data->user(data);
+      if (!user->is_admin(user)) {
+         log_error(this->log, "Backup query REFUSED, user %s not admin", user->name(user));
+      } else if (this->vault->backup(this->vault, NULL, NULL)) {
+         // the backup goes on in the background; its end is logged
+         error = "";
+      } else {
+         error = "failed";
+      }
+      token = data->set_token(data);
+   }
+
+   circus_message_reply_backup_t *reply = new_circus_message_reply_backup(this->memory, error, token);
+   this->reply = I(reply);
+}
+
 static void visit_query_change_master(circus_message_visitor_query_t *visitor, circus_message_query_change_master_t *visited) {
    impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
    // TODO
@@ -102,8 +136,27 @@ typedef struct fill_key_name_s {
    cad_array_t *data;
 } fill_key_name_t;
 
-static void fill_key_name(void *UNUSED(hash), int UNUSED(index), const char *key, circus_key_t *UNUSED(value), fill_key_name_t *data) {
-   data->data->insert(data->data, data->data->count(data->data), szprintf(data->memory, NULL, "%s", key));
+static void fill_key_name(fill_key_name_t *data, const char *key) {
+   char *name = szprintf(data->memory, NULL, "%s", key);
+   data->data->insert(data->data, data->data->count(data->data), &name);
+}
+
+static void free_names(cad_memory_t memory, cad_array_t *names) {
+   unsigned int i, n = names->count(names);
+   for (i = 0; i < n; i++) {
+      memory.free(*(char**)names->get(names, i));
+   }
+   names->free(names);
+}
+
+/*
+ * The key properties are its tags (see update_property())
+ */
+static void fill_properties(impl_mh_t *this, circus_key_t *key, cad_array_t *properties) {
+   fill_key_name_t filler = {this->memory, properties};
+   if (!key->get_tags(key, (circus_key_tags_fn)fill_key_name, &filler)) {
+      log_error(this->log, "Could not get the key properties");
+   }
 }
 
 static void visit_query_all_list(circus_message_visitor_query_t *visitor, circus_message_query_all_list_t *visited) {
@@ -118,20 +171,40 @@ static void visit_query_all_list(circus_message_visitor_query_t *visitor, circus
       list = new_circus_message_reply_list(this->memory, "Invalid credentials", "", keys);
    } else {
       circus_user_t *user = data->user(data);
-      cad_hash_t *keys_map = user->get_all(user);
       fill_key_name_t filler = {this->memory, keys};
-      keys_map->iterate(keys_map, (cad_hash_iterator_fn)fill_key_name, &filler);
-      keys->sort(keys, (comparator_fn)strcmp);
+      user->get_all(user, (circus_user_keys_fn)fill_key_name, &filler);
       list = new_circus_message_reply_list(this->memory, "", data->set_token(data), keys);
    }
+   free_names(this->memory, keys);
 
    this->reply = I(list);
 }
 
 static void visit_query_tag_list(circus_message_visitor_query_t *visitor, circus_message_query_tag_list_t *visited) {
    impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
-   // TODO
-   (void)visited; (void)this;
+   const char *sessionid = visited->sessionid(visited);
+   const char *token = visited->token(visited);
+   const char *tag = visited->tag(visited);
+   circus_message_reply_list_t *list;
+   circus_session_data_t *data = this->session->get(this->session, sessionid, token);
+   cad_array_t *keys = cad_new_array(this->memory, sizeof(char*));
+   if (data == NULL) {
+      log_warning(this->log, "Tag list: unknown session or invalid token");
+      list = new_circus_message_reply_list(this->memory, "Invalid credentials", "", keys);
+   } else if (tag == NULL || tag[0] == 0) {
+      list = new_circus_message_reply_list(this->memory, "Missing tag", data->set_token(data), keys);
+   } else {
+      circus_user_t *user = data->user(data);
+      fill_key_name_t filler = {this->memory, keys};
+      if (user->get_tagged(user, tag, (circus_user_keys_fn)fill_key_name, &filler)) {
+         list = new_circus_message_reply_list(this->memory, "", data->set_token(data), keys);
+      } else {
+         list = new_circus_message_reply_list(this->memory, "Could not list keys", data->set_token(data), keys);
+      }
+   }
+   free_names(this->memory, keys);
+
+   this->reply = I(list);
 }
 
 static void visit_query_login(circus_message_visitor_query_t *visitor, circus_message_query_login_t *visited) {
@@ -160,7 +233,7 @@ static void visit_query_logout(circus_message_visitor_query_t *visitor, circus_m
       log_warning(this->log, "Logout: unknown session or invalid token");
    } else {
       circus_user_t *user = data->user(data);
-      this->session->set(this->session, user); // force a new session i.e. invalidate the current one
+      this->session->close(this->session, user); // invalidate all the sessions of the user, on all their devices
       // data is now unusable (freed)
    }
 
@@ -175,6 +248,7 @@ static void visit_query_get_pass(circus_message_visitor_query_t *visitor, circus
    const char *keyname = visited->key(visited);
    char *password = NULL;
    int ok = 0;
+   cad_array_t *properties = cad_new_array(this->memory, sizeof(char*));
 
    circus_session_data_t *data = this->session->get(this->session, sessionid, token);
    if (data == NULL) {
@@ -192,6 +266,7 @@ static void visit_query_get_pass(circus_message_visitor_query_t *visitor, circus
                log_pii(this->log, "Key not found for user %s: %s", user->name(user), keyname);
             } else {
                log_pii(this->log, "Found key for user %s: %s => %s", user->name(user), keyname, password);
+               fill_properties(this, key, properties);
                ok = 1;
             }
          } else {
@@ -201,9 +276,8 @@ static void visit_query_get_pass(circus_message_visitor_query_t *visitor, circus
       token = data->set_token(data);
    }
 
-   cad_array_t *properties = cad_new_array(this->memory, sizeof(char*)); // TODO: fill in properties
    circus_message_reply_pass_t *reply = new_circus_message_reply_pass(this->memory, ok ? "" : "refused", token, keyname, password, properties);
-   properties->free(properties);
+   free_names(this->memory, properties);
    this->memory.free(password);
    this->reply = I(reply);
 }
@@ -218,6 +292,7 @@ static void visit_query_set_prompt_pass(circus_message_visitor_query_t *visitor,
    int ok = 0;
    char *pass = NULL;
    char *error = NULL;
+   cad_array_t *properties = cad_new_array(this->memory, sizeof(char*));
 
    circus_session_data_t *data = this->session->get(this->session, sessionid, token);
    if (data == NULL) {
@@ -238,7 +313,8 @@ static void visit_query_set_prompt_pass(circus_message_visitor_query_t *visitor,
             log_error(this->log, "set_prompt_pass query REFUSED, could not create key");
          } else {
             pass = szprintf(this->memory, NULL, "%s", prompt1);
-            if (key->set_password(key, pass)) {
+            if (key->set_password(key, pass) && this->vault->flush(this->vault)) {
+               fill_properties(this, key, properties);
                ok = 1;
             } else {
                log_error(this->log, "set_prompt_pass query REFUSED, could not set password");
@@ -248,9 +324,8 @@ static void visit_query_set_prompt_pass(circus_message_visitor_query_t *visitor,
       token = data->set_token(data);
    }
 
-   cad_array_t *properties = cad_new_array(this->memory, sizeof(char*)); // TODO: fill in properties
    circus_message_reply_pass_t *reply = new_circus_message_reply_pass(this->memory, ok ? "" : error ? error : "refused", token, keyname, pass, properties);
-   properties->free(properties);
+   free_names(this->memory, properties);
    this->memory.free(pass);
    this->memory.free(error);
    this->reply = I(reply);
@@ -265,6 +340,7 @@ static void visit_query_set_recipe_pass(circus_message_visitor_query_t *visitor,
    int ok = 0;
    char *pass = NULL;
    char *error = NULL;
+   cad_array_t *properties = cad_new_array(this->memory, sizeof(char*));
 
    circus_session_data_t *data = this->session->get(this->session, sessionid, token);
    if (data == NULL) {
@@ -286,7 +362,8 @@ static void visit_query_set_recipe_pass(circus_message_visitor_query_t *visitor,
             if (pass == NULL) {
                log_error(this->log, "Set_recipe_pass query REFUSED, could not generate pass");
             } else {
-               if (key->set_password(key, pass)) {
+               if (key->set_password(key, pass) && this->vault->flush(this->vault)) {
+                  fill_properties(this, key, properties);
                   ok = 1;
                } else {
                   log_error(this->log, "Set_recipe_pass query REFUSED, could not set password");
@@ -297,9 +374,8 @@ static void visit_query_set_recipe_pass(circus_message_visitor_query_t *visitor,
       token = data->set_token(data);
    }
 
-   cad_array_t *properties = cad_new_array(this->memory, sizeof(char*)); // TODO: fill in properties
    circus_message_reply_pass_t *reply = new_circus_message_reply_pass(this->memory, ok ? "" : error ? error : "refused", token, keyname, pass, properties);
-   properties->free(properties);
+   free_names(this->memory, properties);
    this->memory.free(pass);
    this->memory.free(error);
    this->reply = I(reply);
@@ -313,16 +389,53 @@ static void visit_query_ping(circus_message_visitor_query_t *visitor, circus_mes
    this->reply = I(ping);
 }
 
+/*
+ * The key properties are its tags: setting a property tags the key with
+ * the property name, unsetting it removes the tag, and the pass replies
+ * list them. Tags have no value (yet).
+ */
+static circus_message_reply_property_t *update_property(impl_mh_t *this, const char *what, const char *sessionid, const char *token,
+                                                        const char *keyname, const char *property, const char *value, int set) {
+   const char *error = "";
+   circus_session_data_t *data = this->session->get(this->session, sessionid, token);
+   if (data == NULL) {
+      log_warning(this->log, "%s property query REFUSED, unknown session or invalid token", what);
+      return new_circus_message_reply_property(this->memory, "Invalid credentials", "", keyname);
+   }
+
+   circus_user_t *user = data->user(data);
+   if (property == NULL || property[0] == 0) {
+      error = "Missing property";
+   } else if (value != NULL && value[0] != 0) {
+      error = "Property values are not supported";
+   } else if (user->is_admin(user)) {
+      log_error(this->log, "%s property query REFUSED, user %s is admin", what, user->name(user));
+      error = "refused";
+   } else {
+      circus_key_t *key = user->get(user, keyname);
+      if (key == NULL) {
+         log_pii(this->log, "Unknown key for user %s: %s", user->name(user), keyname);
+         error = "Unknown key";
+      } else if (!(set ? key->tag(key, property) : key->untag(key, property)) || !this->vault->flush(this->vault)) {
+         log_error(this->log, "%s property query failed for user %s", what, user->name(user));
+         error = "Could not update property";
+      }
+   }
+   return new_circus_message_reply_property(this->memory, error, data->set_token(data), keyname);
+}
+
 static void visit_query_set_property(circus_message_visitor_query_t *visitor, circus_message_query_set_property_t *visited) {
    impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
-   // TODO
-   (void)visited; (void)this;
+   circus_message_reply_property_t *reply = update_property(this, "Set", visited->sessionid(visited), visited->token(visited),
+                                                            visited->key(visited), visited->property(visited), visited->value(visited), 1);
+   this->reply = I(reply);
 }
 
 static void visit_query_unset_property(circus_message_visitor_query_t *visitor, circus_message_query_unset_property_t *visited) {
    impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
-   // TODO
-   (void)visited; (void)this;
+   circus_message_reply_property_t *reply = update_property(this, "Unset", visited->sessionid(visited), visited->token(visited),
+                                                            visited->key(visited), visited->property(visited), NULL, 0);
+   this->reply = I(reply);
 }
 
 static void stop_server(impl_mh_t *this, const char *reason) {
@@ -357,10 +470,68 @@ static void visit_query_stop(circus_message_visitor_query_t *visitor, circus_mes
    this->reply = I(stop);
 }
 
+typedef struct {
+   cad_memory_t memory;
+   cad_array_t *counters;
+} fill_counter_t;
+
+static void fill_counter(fill_counter_t *data, const char *name, unsigned long value) {
+   char *counter = szprintf(data->memory, NULL, "%s=%lu", name, value);
+   data->counters->insert(data->counters, data->counters->count(data->counters), &counter);
+}
+
+static void visit_query_stats(circus_message_visitor_query_t *visitor, circus_message_query_stats_t *visited) {
+   impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
+   const char *sessionid = visited->sessionid(visited);
+   const char *token = visited->token(visited);
+   int ok = 0;
+   cad_array_t *counters = cad_new_array(this->memory, sizeof(char*));
+
+   circus_session_data_t *data = this->session->get(this->session, sessionid, token);
+   if (data == NULL) {
+      log_error(this->log, "Stats query REFUSED, unknown session or invalid token");
+      token = "";
+   } else {
+      circus_user_t *user = data->user(data);
+      if (!user->is_admin(user)) {
+         log_error(this->log, "Stats query REFUSED, user %s not admin", user->name(user));
+      } else {
+         fill_counter_t filler = {this->memory, counters};
+         memory_stats((circus_stats_fn)fill_counter, &filler);
+         this->session->stats(this->session, (circus_stats_fn)fill_counter, &filler);
+         this->vault->stats(this->vault, (circus_stats_fn)fill_counter, &filler);
+         ok = 1;
+      }
+      token = data->set_token(data);
+   }
+
+   circus_message_reply_stats_t *stats = new_circus_message_reply_stats(this->memory, ok ? "" : "refused", token, counters);
+   free_names(this->memory, counters);
+   this->reply = I(stats);
+}
+
 static void visit_query_tags(circus_message_visitor_query_t *visitor, circus_message_query_tags_t *visited) {
    impl_mh_t *this = container_of(visitor, impl_mh_t, vfn);
-   // TODO
-   (void)visited; (void)this;
+   const char *sessionid = visited->sessionid(visited);
+   const char *token = visited->token(visited);
+   circus_message_reply_tags_t *reply;
+   circus_session_data_t *data = this->session->get(this->session, sessionid, token);
+   cad_array_t *tags = cad_new_array(this->memory, sizeof(char*));
+   if (data == NULL) {
+      log_warning(this->log, "Tags: unknown session or invalid token");
+      reply = new_circus_message_reply_tags(this->memory, "Invalid credentials", "", tags);
+   } else {
+      circus_user_t *user = data->user(data);
+      fill_key_name_t filler = {this->memory, tags};
+      if (user->get_tags(user, (circus_user_keys_fn)fill_key_name, &filler)) {
+         reply = new_circus_message_reply_tags(this->memory, "", data->set_token(data), tags);
+      } else {
+         reply = new_circus_message_reply_tags(this->memory, "Could not list tags", data->set_token(data), tags);
+      }
+   }
+   free_names(this->memory, tags);
+
+   this->reply = I(reply);
 }
 
 static void visit_query_unset(circus_message_visitor_query_t *visitor, circus_message_query_unset_t *visited) {
@@ -381,14 +552,14 @@ static char *strvalidity(cad_memory_t memory, const char *validity_format, uint6
    time_t v = (time_t)valid;
    gmtime_r(&v, &tm);
    size_t n = 64;
-   char *result = memory.malloc(n);
+   char *result = memory_malloc(memory, n);
    int again = 1;
    do {
       assert(result != NULL);
       size_t m = strftime(result, n, validity_format, &tm);
       if (m == 0) {
          n *= 2;
-         result = memory.realloc(result, n);
+         result = memory_realloc(memory, result, n);
       } else {
          again = 0;
       }
@@ -479,7 +650,7 @@ static void visit_query_create_user(circus_message_visitor_query_t *visitor, cir
                   }
                } else {
                   log_info(this->log, "Updating user: %s", username);
-                  this->session->set(this->session, new_user); // invalidates any currently running session for that user
+                  this->session->close(this->session, new_user); // invalidates all the currently running sessions for that user
                   if (new_user->set_password(new_user, password, valid)) {
                      ok = 1;
                   } else {
@@ -488,7 +659,7 @@ static void visit_query_create_user(circus_message_visitor_query_t *visitor, cir
                }
                if (ok) {
                   assert(new_user != NULL);
-                  if (new_user->set_email(new_user, email)) {
+                  if (new_user->set_email(new_user, email) && this->vault->flush(this->vault)) {
                      // TODO send email with the password
                   } else {
                      log_warning(this->log, "User error: could not set email.");
@@ -562,6 +733,7 @@ static void visit_query_version(circus_message_visitor_query_t *visitor, circus_
 }
 
 static circus_message_visitor_query_t visitor_fn = {
+   (circus_message_visitor_query_backup_fn)visit_query_backup,
    (circus_message_visitor_query_change_master_fn)visit_query_change_master,
    (circus_message_visitor_query_close_fn)visit_query_close,
    (circus_message_visitor_query_is_open_fn)visit_query_is_open,
@@ -575,6 +747,7 @@ static circus_message_visitor_query_t visitor_fn = {
    (circus_message_visitor_query_ping_fn)visit_query_ping,
    (circus_message_visitor_query_set_property_fn)visit_query_set_property,
    (circus_message_visitor_query_unset_property_fn)visit_query_unset_property,
+   (circus_message_visitor_query_stats_fn)visit_query_stats,
    (circus_message_visitor_query_stop_fn)visit_query_stop,
    (circus_message_visitor_query_tags_fn)visit_query_tags,
    (circus_message_visitor_query_unset_fn)visit_query_unset,
@@ -584,12 +757,27 @@ static circus_message_visitor_query_t visitor_fn = {
    (circus_message_visitor_query_version_fn)visit_query_version,
 };
 
+/*
+ * The queries are served one at a time (the channel is strictly
+ * query-reply), so no other write may join the group of the deferred
+ * writes of a query: they are committed before the reply, instead of
+ * waiting for the group delay. The handlers whose reply reports such a
+ * write flush the vault themselves, and check the result; here are
+ * committed the writes nobody reports, such as the password re-stretched
+ * by a login.
+ */
+static void flush_writes(impl_mh_t *this) {
+   if (this->vault != NULL && !this->vault->flush(this->vault)) {
+      log_warning(this->log, "Deferred vault writes lost while serving the query");
+   }
+}
+
 static void impl_mh_read(circus_channel_t *channel, impl_mh_t *this) {
    SET_CANARY();
    if (this->reply == NULL) {
       int buflen = 4096;
       int nbuf = 0;
-      char *buf = this->memory.malloc(buflen);
+      char *buf = memory_malloc(this->memory, buflen);
       assert(buf != NULL);
       int n;
       do {
@@ -597,7 +785,7 @@ static void impl_mh_read(circus_channel_t *channel, impl_mh_t *this) {
          if (n > 0) {
             if (n + nbuf == buflen) {
                size_t bl = buflen * 2;
-               buf = this->memory.realloc(buf, bl);
+               buf = memory_realloc(this->memory, buf, bl);
                buflen = bl;
             }
             nbuf += n;
@@ -620,6 +808,7 @@ static void impl_mh_read(circus_channel_t *channel, impl_mh_t *this) {
                log_info(this->log, "Received message: type: %s, command: %s", msg->type(msg), msg->command(msg));
                msg->accept(msg, (circus_message_visitor_t*)&(this->vfn));
                msg->free(msg);
+               flush_writes(this);
             }
             jmsg->accept(jmsg, json_kill());
          }
@@ -631,6 +820,53 @@ static void impl_mh_read(circus_channel_t *channel, impl_mh_t *this) {
    CHECK_CANARY();
 }
 
+#define MEMORY_WARNING_INTERVAL 60000 // ms
+
+/*
+ * Shrink the caches if the memory budgets are exceeded. Only done
+ * between two messages, when nobody holds references to users, keys,
+ * or sessions; and only once per pressure level: the caches are shrunk
+ * again only after the usage went back below the soft budget, or rose
+ * from the soft to the hard budget.
+ */
+static void check_memory(impl_mh_t *this) {
+   memory_pressure_t pressure = memory_pressure();
+   if (pressure == memory_pressure_none) {
+      this->shrunk = memory_pressure_none;
+      return;
+   }
+   if (pressure <= this->shrunk) {
+      return;
+   }
+   this->shrunk = pressure;
+
+   uint64_t t = uv_now(uv_default_loop());
+   int warn = this->warned == 0 || t - this->warned >= MEMORY_WARNING_INTERVAL;
+   if (warn) {
+      this->warned = t;
+   }
+
+   switch(pressure) {
+   case memory_pressure_none:
+      break;
+   case memory_pressure_soft:
+      if (warn) {
+         log_warning(this->log, "Memory soft budget exceeded: trimming session tokens");
+      }
+      this->session->shrink(this->session, 0);
+      break;
+   case memory_pressure_hard:
+      if (warn) {
+         log_warning(this->log, "Memory hard budget exceeded: closing sessions and dropping cached users");
+      }
+      this->session->shrink(this->session, 1);
+      if (this->vault != NULL) {
+         this->vault->shrink(this->vault);
+      }
+      break;
+   }
+}
+
 static void impl_mh_write(circus_channel_t *channel, impl_mh_t *this) {
    SET_CANARY();
    char *szout = NULL;
@@ -663,10 +899,16 @@ static void impl_mh_write(circus_channel_t *channel, impl_mh_t *this) {
 
       reply->accept(reply, json_kill());
       this->reply = NULL;
+
+      check_memory(this);
    }
    CHECK_CANARY();
 }
 
+static impl_mh_t *signal_mh = NULL;
+static uv_signal_t dump_signal;
+static int dump_signal_init = 0;
+
 static void impl_register_to(impl_mh_t *this, circus_channel_t *channel) {
    channel->on_read(channel, (circus_channel_on_read_cb)impl_mh_read, this);
    channel->on_write(channel, (circus_channel_on_write_cb)impl_mh_write, NULL, this);
@@ -674,10 +916,18 @@ static void impl_register_to(impl_mh_t *this, circus_channel_t *channel) {
 }
 
 static void impl_free(impl_mh_t *this) {
+   if (signal_mh == this) {
+      if (dump_signal_init) {
+         uv_close((uv_handle_t*)&dump_signal, NULL);
+         dump_signal_init = 0;
+      }
+   }
+   // the sessions unpin their users: free them before the vault
+   this->session->free(this->session);
    if (this->vault != NULL) {
       this->vault->free(this->vault);
    }
-   this->session->free(this->session);
+   circus_message_pool_clean();
    this->memory.free(this->validity_format);
    this->memory.free(this);
 }
@@ -687,7 +937,6 @@ static circus_server_message_handler_t impl_mh_fn = {
    (circus_server_message_handler_free_fn) impl_free,
 };
 
-static impl_mh_t *signal_mh = NULL;
 static void stop_signal(int signum) {
    const char *reason;
    switch(signum) {
@@ -706,6 +955,11 @@ static void stop_signal(int signum) {
    stop_server(signal_mh, reason);
 }
 
+static void dump_stats(uv_signal_t *UNUSED(handle), int UNUSED(signum)) {
+   log_info(signal_mh->log, "Received SIGUSR1, dumping memory statistics");
+   memory_report(signal_mh->log);
+}
+
 static void install_signals(impl_mh_t *mh) {
    if (signal_mh != NULL) {
       log_warning(mh->log, "Cannot install signal for more than one instance of message_handler: skipped.");
@@ -728,13 +982,25 @@ static void install_signals(impl_mh_t *mh) {
       if (n_term == -1) {
          log_warning(mh->log, "Could not install signal handler for SIGTERM: %s", strerror(errno));
       }
+
+      // not a plain sigaction: the dump must run in the loop, not in the middle of an allocation
+      int n_usr1 = uv_signal_init(uv_default_loop(), &dump_signal);
+      if (n_usr1 == 0) {
+         dump_signal_init = 1;
+         n_usr1 = uv_signal_start(&dump_signal, dump_stats, SIGUSR1);
+      }
+      if (n_usr1 != 0) {
+         log_warning(mh->log, "Could not install signal handler for SIGUSR1: %s", uv_strerror(n_usr1));
+      } else {
+         uv_unref((uv_handle_t*)&dump_signal);
+      }
    }
 }
 
 circus_server_message_handler_t *circus_message_handler(cad_memory_t memory, circus_log_t *log, circus_vault_t *vault, circus_config_t *config) {
    impl_mh_t *result;
 
-   result = memory.malloc(sizeof(impl_mh_t));
+   result = memory_malloc(memory, sizeof(impl_mh_t));
    assert(result != NULL);
 
    result->fn = impl_mh_fn;
@@ -742,8 +1008,10 @@ circus_server_message_handler_t *circus_message_handler(cad_memory_t memory, cir
    result->memory = memory;
    result->log = log;
    result->vault = vault;
-   result->session = circus_session(memory, log, config);
+   result->session = circus_session(memory, log, config, vault);
    result->reply = NULL;
+   result->shrunk = memory_pressure_none;
+   result->warned = 0;
 
    result->tmppwd_len = 15;
    result->tmppwd_validity = 900L;
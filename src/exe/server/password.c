@@ -20,6 +20,7 @@
 
 #include <cad_array.h>
 #include <circus_crypt.h>
+#include <circus_memory.h>
 #include <circus_password.h>
 
 /*
@@ -115,7 +116,7 @@ static void parse_quantity(buffer_t *buffer) {
 static void extend(cad_memory_t memory, char *string, char c, int l, int *n) {
    if (l == *n) {
       int m = *n * 2;
-      string = memory.realloc(string, m);
+      string = memory_realloc(memory, string, m);
       *n = m;
    }
    string[l] = c;
@@ -125,7 +126,7 @@ static char *parse_string(cad_memory_t memory, buffer_t *buffer) {
    char delim = buffer->string[buffer->index++];
    int s = 1, l = 0, n = 16;
    char c;
-   char *result = memory.malloc(n);
+   char *result = memory_malloc(memory, n);
    while (s > 0) {
       if (buffer->index < buffer->size) {
          c = buffer->string[buffer->index];
@@ -249,7 +250,7 @@ static void parse_mix(cad_memory_t memory, circus_log_t *log, buffer_t *buffer,
 }
 
 static pass_generator_t *parse_recipe(cad_memory_t memory, circus_log_t *log, const char *recipe, char **error) {
-   pass_generator_t *result = memory.malloc(sizeof(pass_generator_t));
+   pass_generator_t *result = memory_malloc(memory, sizeof(pass_generator_t));
    if (result != NULL) {
       result->mixes = cad_new_array(memory, sizeof(pass_generator_mix_t));
       buffer_t buffer = {recipe, 0, strlen(recipe), NULL, 0, NULL};
@@ -277,7 +278,7 @@ char *generate_pass(cad_memory_t memory, circus_log_t *log, const char *recipe,
       return NULL;
    }
    unsigned int passlen = 0, minlen = 0, maxlen = 0, n = generator->mixes->count(generator->mixes), i, j, l, p, index = 0;
-   unsigned int *mixlens = memory.malloc(n * sizeof(unsigned int));
+   unsigned int *mixlens = memory_malloc(memory, n * sizeof(unsigned int));
    char c;
 
    for (i = 0; i < n; i++) {
@@ -294,7 +295,7 @@ char *generate_pass(cad_memory_t memory, circus_log_t *log, const char *recipe,
    }
    log_debug(log, "Generator passlen[%d-%d]=%d, mix count=%d", minlen, maxlen, passlen, n);
 
-   char *result = memory.malloc(passlen + 1);
+   char *result = memory_malloc(memory, passlen + 1);
    if (result != NULL) {
       for (i = 0; i < n; i++) {
          pass_generator_mix_t *mix = generator->mixes->get(generator->mixes, i);
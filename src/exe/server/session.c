@@ -16,60 +16,140 @@
     Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
 */
 
-#include <cad_array.h>
 #include <cad_hash.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <unistd.h>
+#include <uv.h>
 
+#include <circus_base64.h>
 #include <circus_crypt.h>
+#include <circus_memory.h>
 #include <circus_session.h>
+#include <circus_time.h>
+
+#include "vault/vault_pass.h"
 
 #define SESSIONID_LENGTH 128
 #define TOKEN_LENGTH 128
 #define TOKEN_RETENTION 5
+#define IDLE_TIMEOUT 1800 // seconds
+#define MAX_LIFETIME 43200 // seconds
+#define MAX_PER_USER 8 // concurrent sessions
+
+/*
+ * The expiry timer wheel: WHEEL_SLOTS slots of WHEEL_TICK ms each. A
+ * session sits in the slot of its deadline, maybe some rounds ahead.
+ * Activity only updates the session timestamp; the session is moved
+ * when its slot comes up and it is not expired yet.
+ */
+#define WHEEL_SLOTS 512
+#define WHEEL_TICK 1000 // ms
+
+#define TABLE_CAPACITY 64
+
+/*
+ * The snapshot file has three lines: the salt of the keys, the HMAC of
+ * the third line, and the encrypted sessions. Once decrypted, the sessions start with a random
+ * nonce (the cipher IV is fixed, hence two snapshots never share their
+ * key stream), then the version, then one line per session:
+ *
+ * sessionid created used count token... username symmkey
+ *
+ * with the times in wall clock ms, the tokens from the latest, the
+ * username in base64, and "-" if the user symmetric key is locked.
+ */
+#define SNAPSHOT_INTERVAL 300 // seconds
+#define SNAPSHOT_NONCE 32
+#define SNAPSHOT_VERSION "circus-sessions 1"
+#define SNAPSHOT_SECRET_MIN 16 // characters
+
+typedef struct data_s data_t;
 
 typedef struct {
    circus_session_t fn;
    cad_memory_t memory;
    circus_log_t *log;
-   cad_hash_t *per_user;
-   cad_hash_t *per_sessionid;
+   cad_hash_t *per_user; // the most recently used session of each user
+   data_t **per_sessionid; // open addressing, linear probing
+   unsigned int table_capacity; // a power of 2
+   unsigned int table_count;
+   char *raw; // a decoded sessionid or token
+   char *b64_sessionid; // the encoded sessionid returned by data_sessionid()
+   char *b64_token; // the encoded token returned by data_token()
    unsigned int sessionid_length;
    unsigned int token_length;
    unsigned int token_retention;
+   uint64_t idle_timeout; // ms; 0 = never
+   uint64_t max_lifetime; // ms; 0 = never
+   unsigned long expired;
+   unsigned int max_per_user;
+   unsigned long evicted; // the least recently used sessions of users with too many
+   unsigned int pending; // restored sessions not resolved yet
+   uint64_t wheel_tick; // the next tick to process
+   data_t *wheel[WHEEL_SLOTS];
+   uv_timer_t timer;
+   circus_vault_t *vault; // resolves the restored sessions
+   char *snapshot_path; // NULL if no snapshot
+   char *snapshot_salt; // kept from one snapshot to the next
+   char *snapshot_key; // derived from the configured secret
+   char *snapshot_mac_key; // derived from the configured secret
+   unsigned long restored;
+   uv_timer_t snapshot_timer;
+   int closing; // handles being closed: the last close callback frees the session
 } session_impl_t;
 
-typedef struct {
+/*
+ * The sessionid and the tokens are kept raw; they are encoded only
+ * when going to or coming from the wire.
+ */
+struct data_s {
    circus_session_data_t fn;
-   cad_memory_t memory;
-   char *sessionid;
-   cad_array_t *tokens;
    circus_user_t *user;
    session_impl_t *session;
-} data_t;
+   uint64_t created; // ms, loop time
+   uint64_t used; // ms, loop time
+   data_t *wheel_prev;
+   data_t *wheel_next;
+   data_t *user_prev; // the sessions of the user, most recently used first
+   data_t *user_next;
+   unsigned int slot;
+   unsigned int tokens_count; // the valid tokens in the ring
+   unsigned int tokens_head; // the latest token in the ring
+   char *restored; // restored from the snapshot and not used yet: "username\0symmkey", else NULL
+   char raw[]; // the sessionid, then the ring of token_retention tokens
+};
 
-static const char *rotate_tokens(data_t *this) {
-   unsigned int n = this->tokens->count(this->tokens);
-   while (n -->= this->session->token_retention) {
-      char *stale_token = *((char**)this->tokens->del(this->tokens, n));
-      this->memory.free(stale_token);
+static char *ring_token(data_t *this, unsigned int index) {
+   session_impl_t *session = this->session;
+   return this->raw + session->sessionid_length + index * session->token_length;
+}
+
+static void rotate_tokens(data_t *this) {
+   session_impl_t *session = this->session;
+   this->tokens_head = (this->tokens_head + 1) % session->token_retention;
+   if (this->tokens_count < session->token_retention) {
+      this->tokens_count++;
    }
-   char *new_token = szrandom64(this->memory, this->session->token_length);
-   this->tokens->insert(this->tokens, 0, &new_token);
-   return new_token;
+   random_bytes(ring_token(this, this->tokens_head), session->token_length);
 }
 
 static const char *data_sessionid(data_t *this) {
-   return this->sessionid;
+   base64_to(this->session->b64_sessionid, this->raw, this->session->sessionid_length);
+   return this->session->b64_sessionid;
 }
 
 static const char *data_token(data_t *this) {
-   return *((char**)this->tokens->get(this->tokens, 0));
+   base64_to(this->session->b64_token, ring_token(this, this->tokens_head), this->session->token_length);
+   return this->session->b64_token;
 }
 
 static const char *data_set_token(data_t *this) {
-   return rotate_tokens(this);
+   rotate_tokens(this);
+   return data_token(this);
 }
 
 static circus_user_t *data_user(data_t *this) {
@@ -83,32 +163,217 @@ static circus_session_data_t data_fn = {
    (circus_session_data_user_fn)data_user,
 };
 
-static data_t *new_data(cad_memory_t memory, circus_user_t *user, session_impl_t *session) {
-   data_t *result = memory.malloc(sizeof(data_t));
+static int has_expiry(session_impl_t *this) {
+   return this->idle_timeout > 0 || this->max_lifetime > 0;
+}
+
+static uint64_t deadline(data_t *data) {
+   session_impl_t *session = data->session;
+   uint64_t result = UINT64_MAX;
+   if (session->idle_timeout > 0) {
+      result = data->used + session->idle_timeout;
+   }
+   if (session->max_lifetime > 0 && data->created + session->max_lifetime < result) {
+      result = data->created + session->max_lifetime;
+   }
+   return result;
+}
+
+static void wheel_insert(session_impl_t *this, data_t *data) {
+   uint64_t tick = deadline(data) / WHEEL_TICK;
+   if (tick < this->wheel_tick) {
+      tick = this->wheel_tick;
+   }
+   data->slot = (unsigned int)(tick % WHEEL_SLOTS);
+   data->wheel_prev = NULL;
+   data->wheel_next = this->wheel[data->slot];
+   if (data->wheel_next != NULL) {
+      data->wheel_next->wheel_prev = data;
+   }
+   this->wheel[data->slot] = data;
+}
+
+static void wheel_remove(session_impl_t *this, data_t *data) {
+   if (data->slot == WHEEL_SLOTS) {
+      // not in the wheel
+      return;
+   }
+   if (data->wheel_prev == NULL) {
+      this->wheel[data->slot] = data->wheel_next;
+   } else {
+      data->wheel_prev->wheel_next = data->wheel_next;
+   }
+   if (data->wheel_next != NULL) {
+      data->wheel_next->wheel_prev = data->wheel_prev;
+   }
+   data->wheel_prev = data->wheel_next = NULL;
+   data->slot = WHEEL_SLOTS;
+}
+
+static size_t raw_size(session_impl_t *session) {
+   return session->sessionid_length + session->token_retention * session->token_length;
+}
+
+static data_t *alloc_data(session_impl_t *session) {
+   data_t *result = memory_malloc(session->memory, sizeof(data_t) + raw_size(session));
    assert(result != NULL);
    result->fn = data_fn;
-   result->memory = memory;
-   result->sessionid = szrandom64(memory, session->sessionid_length);
-   result->tokens = cad_new_array(memory, sizeof(char*));
-   result->user = user;
+   result->tokens_count = 0;
+   result->tokens_head = session->token_retention - 1;
+   result->user = NULL;
    result->session = session;
+   result->wheel_prev = result->wheel_next = NULL;
+   result->user_prev = result->user_next = NULL;
+   result->slot = WHEEL_SLOTS;
+   result->restored = NULL;
+   return result;
+}
+
+static data_t *new_data(circus_user_t *user, session_impl_t *session) {
+   data_t *result = alloc_data(session);
+   random_bytes(result->raw, session->sessionid_length);
+   result->user = user;
+   result->created = result->used = uv_now(uv_default_loop());
+   user->pin(user);
+   if (has_expiry(session)) {
+      wheel_insert(session, result);
+   }
 
    rotate_tokens(result);
-   assert(result->sessionid != NULL);
-   assert(result->tokens->count(result->tokens) > 0);
+   assert(result->tokens_count == 1);
 
    return result;
 }
 
+static void free_restored(session_impl_t *session, data_t *data) {
+   size_t n = strlen(data->restored) + 1;
+   n += strlen(data->restored + n) + 1;
+   memset(data->restored, 0, n);
+   session->memory.free(data->restored);
+   data->restored = NULL;
+   session->pending--;
+}
+
 static void free_data(data_t *data) {
-   unsigned int n = data->tokens->count(data->tokens);
-   while (n --> 0) {
-      char *del_token = *((char**)data->tokens->del(data->tokens, n));
-      data->memory.free(del_token);
+   session_impl_t *session = data->session;
+   if (has_expiry(session)) {
+      wheel_remove(session, data);
+   }
+   memset(data->raw, 0, raw_size(session));
+   if (data->user != NULL) {
+      data->user->unpin(data->user);
    }
-   data->memory.free(data->sessionid);
-   data->tokens->free(data->tokens);
-   data->memory.free(data);
+   if (data->restored != NULL) {
+      free_restored(session, data);
+   }
+   session->memory.free(data);
+}
+
+// ----------------------------------------------------------------
+
+/*
+ * The sessionids are random: their first bytes are a good enough hash
+ */
+static unsigned int sessionid_hash(session_impl_t *this, const char *sessionid) {
+   unsigned int result = 0;
+   unsigned int i;
+   for (i = 0; i < this->sessionid_length && i < sizeof(unsigned int); i++) {
+      result = (result << 8) | (unsigned char)sessionid[i];
+   }
+   return result;
+}
+
+static data_t *table_get(session_impl_t *this, const char *sessionid) {
+   unsigned int mask = this->table_capacity - 1;
+   unsigned int i = sessionid_hash(this, sessionid) & mask;
+   data_t *data;
+   while ((data = this->per_sessionid[i]) != NULL) {
+      if (!memcmp(data->raw, sessionid, this->sessionid_length)) {
+         return data;
+      }
+      i = (i + 1) & mask;
+   }
+   return NULL;
+}
+
+static void table_put(session_impl_t *this, data_t *data) {
+   unsigned int mask = this->table_capacity - 1;
+   unsigned int i = sessionid_hash(this, data->raw) & mask;
+   while (this->per_sessionid[i] != NULL) {
+      i = (i + 1) & mask;
+   }
+   this->per_sessionid[i] = data;
+   this->table_count++;
+}
+
+static void table_set(session_impl_t *this, data_t *data) {
+   unsigned int i;
+   if ((this->table_count + 1) * 2 > this->table_capacity) {
+      data_t **old = this->per_sessionid;
+      unsigned int old_capacity = this->table_capacity;
+      this->table_capacity *= 2;
+      this->per_sessionid = memory_malloc(this->memory, this->table_capacity * sizeof(data_t*));
+      assert(this->per_sessionid != NULL);
+      memset(this->per_sessionid, 0, this->table_capacity * sizeof(data_t*));
+      this->table_count = 0;
+      for (i = 0; i < old_capacity; i++) {
+         if (old[i] != NULL) {
+            table_put(this, old[i]);
+         }
+      }
+      this->memory.free(old);
+   }
+   table_put(this, data);
+}
+
+/*
+ * No tombstones: the following entries are moved back into the hole
+ * if their probe sequence goes through it.
+ */
+static void table_del(session_impl_t *this, data_t *data) {
+   unsigned int mask = this->table_capacity - 1;
+   unsigned int i = sessionid_hash(this, data->raw) & mask;
+   unsigned int j, home;
+   data_t *next;
+   while (this->per_sessionid[i] != data) {
+      assert(this->per_sessionid[i] != NULL);
+      i = (i + 1) & mask;
+   }
+   this->per_sessionid[i] = NULL;
+   this->table_count--;
+   for (j = (i + 1) & mask; (next = this->per_sessionid[j]) != NULL; j = (j + 1) & mask) {
+      home = sessionid_hash(this, next->raw) & mask;
+      if (j > i ? (home <= i || home > j) : (home <= i && home > j)) {
+         this->per_sessionid[i] = next;
+         this->per_sessionid[j] = NULL;
+         i = j;
+      }
+   }
+}
+
+static void table_clear(session_impl_t *this) {
+   memset(this->per_sessionid, 0, this->table_capacity * sizeof(data_t*));
+   this->table_count = 0;
+}
+
+/*
+ * Decode a sessionid or a token from the wire into the raw buffer
+ */
+static int decode(session_impl_t *this, const char *b64, unsigned int length) {
+   size_t b64len = b64_size(length);
+   if (strnlen(b64, b64len + 1) != b64len) {
+      return 0;
+   }
+   return unbase64_to(this->raw, b64, b64len) == (int)length;
+}
+
+static int same_token(const char *token1, const char *token2, size_t length) {
+   unsigned char diff = 0;
+   size_t i;
+   for (i = 0; i < length; i++) {
+      diff |= (unsigned char)(token1[i] ^ token2[i]);
+   }
+   return diff == 0;
 }
 
 // ----------------------------------------------------------------
@@ -138,71 +403,685 @@ static cad_hash_keys_t hash_user_keys = {
 
 // ----------------------------------------------------------------
 
+static void user_unlink(session_impl_t *this, data_t *data) {
+   if (data->user_prev != NULL) {
+      data->user_prev->user_next = data->user_next;
+   } else if (data->user_next != NULL) {
+      this->per_user->set(this->per_user, data->user, data->user_next);
+   } else {
+      this->per_user->del(this->per_user, data->user);
+   }
+   if (data->user_next != NULL) {
+      data->user_next->user_prev = data->user_prev;
+   }
+   data->user_prev = data->user_next = NULL;
+}
+
+static void user_push(session_impl_t *this, data_t *data) {
+   data_t *head = this->per_user->get(this->per_user, data->user);
+   data->user_prev = NULL;
+   data->user_next = head;
+   if (head != NULL) {
+      head->user_prev = data;
+   }
+   this->per_user->set(this->per_user, data->user, data);
+}
+
+static void close_data(session_impl_t *this, data_t *data) {
+   table_del(this, data);
+   if (data->user != NULL) {
+      user_unlink(this, data);
+   }
+   free_data(data);
+}
+
+/*
+ * Keep at most max_per_user sessions for the user: the least recently
+ * used ones are closed
+ */
+static void user_cap(session_impl_t *this, circus_user_t *user) {
+   data_t *data = this->per_user->get(this->per_user, user);
+   unsigned int count = 0;
+   while (data != NULL && ++count < this->max_per_user) {
+      data = data->user_next;
+   }
+   if (data != NULL) {
+      while (data->user_next != NULL) {
+         close_data(this, data->user_next);
+         this->evicted++;
+      }
+   }
+}
+
+/*
+ * A restored session gets its user at its first use, when its token is
+ * known to be valid
+ */
+static int resolve(session_impl_t *this, data_t *data) {
+   const char *username = data->restored;
+   const char *symmkey = username + strlen(username) + 1;
+   circus_user_t *user = NULL;
+   if (this->vault != NULL) {
+      user = this->vault->restore(this->vault, username, symmkey[0] == 0 ? NULL : symmkey);
+   }
+   if (user == NULL) {
+      log_warning(this->log, "Dropping the restored session of user %s", username);
+      close_data(this, data);
+      return 0;
+   }
+   free_restored(this, data);
+   data->user = user;
+   user->pin(user);
+   user_push(this, data);
+   user_cap(this, user);
+   this->restored++;
+   return 1;
+}
+
 static circus_session_data_t *session_get(session_impl_t *this, const char *sessionid, const char *token) {
    unsigned int i;
-   data_t *data = this->per_sessionid->get(this->per_sessionid, sessionid);
+   int found = 0;
+   if (!decode(this, sessionid, this->sessionid_length)) {
+      return NULL;
+   }
+   data_t *data = table_get(this, this->raw);
    if (data != NULL) {
-      assert(strncmp(data->sessionid, sessionid, this->sessionid_length) == 0);
-      unsigned int n = data->tokens->count(data->tokens);
-      for (i = 0; i < n; i++) {
-         const char *check_token = *((char**)data->tokens->get(data->tokens, i));
-         if (!strncmp(token, check_token, this->token_length)) {
-            return I(data);
+      uint64_t now = uv_now(uv_default_loop());
+      if (deadline(data) <= now) {
+         // expired, but not yet reaped by the wheel
+         return NULL;
+      }
+      if (!decode(this, token, this->token_length)) {
+         return NULL;
+      }
+      // all the tokens are checked, in constant time
+      for (i = 0; i < data->tokens_count; i++) {
+         unsigned int index = (data->tokens_head + this->token_retention - i) % this->token_retention;
+         found |= same_token(this->raw, ring_token(data, index), this->token_length);
+      }
+      if (found && (data->restored == NULL || resolve(this, data))) {
+         data->used = now;
+         if (data->user_prev != NULL) {
+            user_unlink(this, data);
+            user_push(this, data);
          }
+         return I(data);
       }
    }
    return NULL;
 }
 
 static circus_session_data_t *session_set(session_impl_t *this, circus_user_t *user) {
-   data_t *data = this->per_user->del(this->per_user, user);
-   if (data != NULL) {
-      assert(data->user == user);
-      data_t *data2 = this->per_sessionid->del(this->per_sessionid, data->sessionid);
-      assert(data == data2);
+   data_t *data = new_data(user, this);
+   table_set(this, data);
+   user_push(this, data);
+   user_cap(this, user);
+   return I(data);
+}
+
+/*
+ * The restored sessions not resolved yet are not in the user list:
+ * they are looked for by name
+ */
+static void session_close(session_impl_t *this, circus_user_t *user) {
+   data_t *data;
+   unsigned int i;
+   while ((data = this->per_user->get(this->per_user, user)) != NULL) {
+      close_data(this, data);
+   }
+   if (this->pending > 0) {
+      const char *username = user->name(user);
+      i = 0;
+      while (i < this->table_capacity) {
+         data = this->per_sessionid[i];
+         if (data != NULL && data->restored != NULL && !strcmp(data->restored, username)) {
+            // the backward shift may move another session here
+            close_data(this, data);
+         } else {
+            i++;
+         }
+      }
+   }
+}
+
+static void shrink_tokens(session_impl_t *this, data_t *data) {
+   unsigned int i;
+   for (i = 0; i < this->token_retention; i++) {
+      if (i != data->tokens_head) {
+         memset(ring_token(data, i), 0, this->token_length);
+      }
+   }
+   data->tokens_count = 1;
+}
+
+static void clean_user(void *UNUSED(hash), int UNUSED(index), const circus_user_t *UNUSED(key), data_t *UNUSED(value), session_impl_t *UNUSED(this)) {
+   // freed from the table
+}
+
+/*
+ * The table has all the sessions, including the restored ones not
+ * used yet (which are not in the user lists)
+ */
+static void free_all(session_impl_t *this) {
+   unsigned int i;
+   for (i = 0; i < this->table_capacity; i++) {
+      if (this->per_sessionid[i] != NULL) {
+         free_data(this->per_sessionid[i]);
+      }
+   }
+   table_clear(this);
+   this->per_user->clean(this->per_user, (cad_hash_iterator_fn)clean_user, this);
+}
+
+static void session_shrink(session_impl_t *this, int all) {
+   unsigned int i;
+   if (all) {
+      log_warning(this->log, "Closing %u sessions", this->table_count);
+      free_all(this);
+   } else {
+      for (i = 0; i < this->table_capacity; i++) {
+         if (this->per_sessionid[i] != NULL) {
+            shrink_tokens(this, this->per_sessionid[i]);
+         }
+      }
+   }
+}
+
+static void expire_data(session_impl_t *this, data_t *data) {
+   close_data(this, data);
+   this->expired++;
+}
+
+/*
+ * Process the slots of the ticks elapsed since the previous run (at
+ * most one round): expire the sessions past their deadline, and move
+ * the others to the slot of their new deadline.
+ */
+static void on_expiry_timer(uv_timer_t *timer) {
+   session_impl_t *this = timer->data;
+   uint64_t now = uv_now(uv_default_loop());
+   uint64_t now_tick = now / WHEEL_TICK;
+   unsigned long expired = this->expired;
+   unsigned int steps = 0;
+   data_t *data, *next;
+
+   while (this->wheel_tick <= now_tick && steps++ < WHEEL_SLOTS) {
+      unsigned int slot = (unsigned int)(this->wheel_tick % WHEEL_SLOTS);
+      data = this->wheel[slot];
+      this->wheel[slot] = NULL;
+      this->wheel_tick++;
+      for (; data != NULL; data = next) {
+         next = data->wheel_next;
+         data->wheel_prev = data->wheel_next = NULL;
+         data->slot = WHEEL_SLOTS;
+         if (deadline(data) <= now) {
+            expire_data(this, data);
+         } else {
+            wheel_insert(this, data);
+         }
+      }
+   }
+   this->wheel_tick = now_tick + 1;
+
+   if (this->expired > expired) {
+      log_info(this->log, "Expired %lu idle sessions", this->expired - expired);
+   }
+}
+
+// ----------------------------------------------------------------
+
+typedef struct {
+   cad_memory_t memory;
+   char *text;
+   size_t size;
+   size_t capacity;
+} text_t;
+
+/*
+ * The text holds secrets: the old buffer is wiped when growing
+ */
+static void text_append(text_t *text, const char *string) {
+   size_t n = strlen(string);
+   if (text->size + n + 1 > text->capacity) {
+      size_t capacity = text->capacity == 0 ? 4096 : text->capacity * 2;
+      while (text->size + n + 1 > capacity) {
+         capacity *= 2;
+      }
+      char *grown = memory_malloc(text->memory, capacity);
+      assert(grown != NULL);
+      if (text->text != NULL) {
+         memcpy(grown, text->text, text->size);
+         memset(text->text, 0, text->capacity);
+         text->memory.free(text->text);
+      }
+      text->text = grown;
+      text->capacity = capacity;
+   }
+   memcpy(text->text + text->size, string, n + 1);
+   text->size += n;
+}
+
+static void text_append_free(text_t *text, char *string) {
+   text_append(text, string);
+   memset(string, 0, strlen(string));
+   text->memory.free(string);
+}
+
+static uint64_t wall_ms(void) {
+   struct timeval tv = now();
+   return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+}
+
+static void snapshot_session(session_impl_t *this, text_t *text, data_t *data, uint64_t wall, uint64_t loop) {
+   const char *username, *symmkey;
+   unsigned int i;
+   if (data->user != NULL) {
+      username = data->user->name(data->user);
+      symmkey = data->user->symmkey(data->user);
+   } else {
+      username = data->restored;
+      symmkey = username + strlen(username) + 1;
+   }
+   if (symmkey == NULL || symmkey[0] == 0) {
+      symmkey = "-";
+   }
+
+   text_append(text, data_sessionid(data));
+   text_append_free(text, szprintf(this->memory, NULL, " %"PRIu64" %"PRIu64" %u", wall - (loop - data->created),
+                                   wall - (loop - data->used), data->tokens_count));
+   for (i = 0; i < data->tokens_count; i++) {
+      unsigned int index = (data->tokens_head + this->token_retention - i) % this->token_retention;
+      base64_to(this->b64_token, ring_token(data, index), this->token_length);
+      text_append(text, " ");
+      text_append(text, this->b64_token);
+   }
+   text_append(text, " ");
+   text_append_free(text, base64(this->memory, username, strlen(username)));
+   text_append(text, " ");
+   text_append(text, symmkey);
+   text_append(text, "\n");
+}
+
+static int snapshot_save(session_impl_t *this, const char *mac, const char *enc) {
+   char *tmp_path = szprintf(this->memory, NULL, "%s.tmp", this->snapshot_path);
+   int ok = 0;
+   int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+   if (fd >= 0) {
+      FILE *file = fdopen(fd, "w");
+      if (file == NULL) {
+         close(fd);
+      } else {
+         ok = fprintf(file, "%s\n%s\n%s\n", this->snapshot_salt, mac, enc) > 0;
+         // on disk before it replaces the previous snapshot
+         ok = ok && fflush(file) == 0 && fsync(fd) == 0;
+         ok = (fclose(file) == 0) && ok;
+      }
+   }
+   if (ok && rename(tmp_path, this->snapshot_path) != 0) {
+      ok = 0;
+   }
+   if (!ok) {
+      log_error(this->log, "Could not write the session snapshot %s: %s", this->snapshot_path, strerror(errno));
+      unlink(tmp_path);
+   }
+   this->memory.free(tmp_path);
+   return ok;
+}
+
+static void snapshot_write(session_impl_t *this) {
+   text_t text = { this->memory, NULL, 0, 0 };
+   uint64_t wall = wall_ms();
+   uint64_t loop = uv_now(uv_default_loop());
+   unsigned int i, count = 0;
+
+   text_append_free(&text, szrandom64(this->memory, SNAPSHOT_NONCE));
+   text_append(&text, "\n" SNAPSHOT_VERSION "\n");
+   for (i = 0; i < this->table_capacity; i++) {
+      data_t *data = this->per_sessionid[i];
+      if (data != NULL && deadline(data) > loop) {
+         snapshot_session(this, &text, data, wall, loop);
+         count++;
+      }
+   }
+
+   char *enc = encrypted(this->memory, this->log, text.text, this->snapshot_key);
+   memset(text.text, 0, text.capacity);
+   this->memory.free(text.text);
+   if (enc == NULL) {
+      log_error(this->log, "Could not encrypt the session snapshot");
+      return;
+   }
+   char *mac = authenticated(this->memory, this->log, enc, this->snapshot_mac_key);
+   if (mac == NULL) {
+      log_error(this->log, "Could not authenticate the session snapshot");
+   } else {
+      if (snapshot_save(this, mac, enc)) {
+         log_info(this->log, "Saved %u sessions to %s", count, this->snapshot_path);
+      }
+      this->memory.free(mac);
+   }
+   this->memory.free(enc);
+}
+
+static void on_snapshot_timer(uv_timer_t *timer) {
+   snapshot_write(timer->data);
+}
+
+static int restore_session(session_impl_t *this, char *line, uint64_t wall, uint64_t loop) {
+   char *save = NULL;
+   char *sessionid = strtok_r(line, " ", &save);
+   char *created = strtok_r(NULL, " ", &save);
+   char *used = strtok_r(NULL, " ", &save);
+   char *count = strtok_r(NULL, " ", &save);
+   char *token, *username, *symmkey, *name;
+   unsigned long i, n;
+   size_t len;
+
+   if (count == NULL || !decode(this, sessionid, this->sessionid_length) || table_get(this, this->raw) != NULL) {
+      return 0;
+   }
+   n = strtoul(count, NULL, 10);
+   if (n == 0) {
+      return 0;
+   }
+
+   data_t *data = alloc_data(this);
+   memcpy(data->raw, this->raw, this->sessionid_length);
+   data->tokens_head = 0;
+   for (i = 0; i < n; i++) {
+      token = strtok_r(NULL, " ", &save);
+      if (token == NULL || !decode(this, token, this->token_length)) {
+         free_data(data);
+         return 0;
+      }
+      if (i < this->token_retention) {
+         memcpy(ring_token(data, (this->token_retention - i) % this->token_retention), this->raw, this->token_length);
+         data->tokens_count++;
+      }
+   }
+   username = strtok_r(NULL, " ", &save);
+   symmkey = strtok_r(NULL, " ", &save);
+   if (symmkey == NULL || strlen(username) % 4 != 0 || (name = unbase64(this->memory, username, &len)) == NULL) {
       free_data(data);
+      return 0;
    }
-   data = new_data(this->memory, user, this);
-   this->per_sessionid->set(this->per_sessionid, data->sessionid, data);
-   this->per_user->set(this->per_user, user, data);
-   return I(data);
+   if (!strcmp(symmkey, "-")) {
+      symmkey = "";
+   }
+   data->restored = szprintf(this->memory, NULL, "%s%c%s", name, 0, symmkey);
+   this->pending++;
+   memset(name, 0, len);
+   this->memory.free(name);
+
+   // the times are moved from the wall clock to the loop clock
+   uint64_t age = wall - strtoull(created, NULL, 10);
+   data->created = loop > age ? loop - age : 0;
+   age = wall - strtoull(used, NULL, 10);
+   data->used = loop > age ? loop - age : 0;
+   if (deadline(data) <= loop) {
+      free_data(data);
+      return 1;
+   }
+
+   if (has_expiry(this)) {
+      wheel_insert(this, data);
+   }
+   table_set(this, data);
+   return 1;
 }
 
-static void clean_sessionid(void *UNUSED(hash), int UNUSED(index), const char *UNUSED(key), data_t *UNUSED(value), session_impl_t *UNUSED(this)) {
-   // Avoid double free() by not doing it :-)
+static void restore_sessions(session_impl_t *this, char *text) {
+   uint64_t wall = wall_ms();
+   uint64_t loop = uv_now(uv_default_loop());
+   char *save = NULL;
+   char *line = strtok_r(text, "\n", &save); // the nonce
+   unsigned int invalid = 0;
+
+   line = strtok_r(NULL, "\n", &save);
+   if (line == NULL || strcmp(line, SNAPSHOT_VERSION)) {
+      log_error(this->log, "Unknown session snapshot version: ignored");
+      return;
+   }
+   while ((line = strtok_r(NULL, "\n", &save)) != NULL) {
+      if (!restore_session(this, line, wall, loop)) {
+         invalid++;
+      }
+   }
+   if (invalid > 0) {
+      log_warning(this->log, "Ignored %u invalid sessions in the snapshot", invalid);
+   }
+   log_info(this->log, "Restored %u sessions from %s", this->table_count, this->snapshot_path);
 }
 
-static void clean_user(void *UNUSED(hash), int UNUSED(index), const circus_user_t *UNUSED(key), data_t *value, session_impl_t *UNUSED(this)) {
-   free_data(value);
+static char *snapshot_load(session_impl_t *this) {
+   FILE *file = fopen(this->snapshot_path, "r");
+   if (file == NULL) {
+      if (errno != ENOENT) {
+         log_error(this->log, "Could not read the session snapshot %s: %s", this->snapshot_path, strerror(errno));
+      }
+      return NULL;
+   }
+   char *content = NULL;
+   long size = -1;
+   if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+      content = memory_malloc(this->memory, size + 1);
+      assert(content != NULL);
+      if (fread(content, 1, size, file) != (size_t)size) {
+         this->memory.free(content);
+         content = NULL;
+      } else {
+         content[size] = 0;
+      }
+   }
+   fclose(file);
+   if (content == NULL) {
+      log_error(this->log, "Could not read the session snapshot %s", this->snapshot_path);
+   }
+   return content;
+}
+
+/*
+ * The sessions are only loaded: their users are resolved at their
+ * first use
+ */
+static void snapshot_read(session_impl_t *this, const char *mac, const char *enc) {
+   char *check = mac == NULL || enc == NULL ? NULL : authenticated(this->memory, this->log, enc, this->snapshot_mac_key);
+   if (check == NULL || strlen(check) != strlen(mac) || !same_token(check, mac, strlen(mac))) {
+      log_error(this->log, "Invalid session snapshot %s: ignored", this->snapshot_path);
+   } else {
+      char *text = decrypted(this->memory, this->log, enc, this->snapshot_key);
+      if (text == NULL) {
+         log_error(this->log, "Could not decrypt the session snapshot %s", this->snapshot_path);
+      } else {
+         restore_sessions(this, text);
+         memset(text, 0, strlen(text));
+         this->memory.free(text);
+      }
+   }
+   if (check != NULL) {
+      this->memory.free(check);
+   }
+}
+
+static char *snapshot_key(session_impl_t *this, const char *purpose, const char *master) {
+   char *material = szprintf(this->memory, NULL, "%s:%s", purpose, master);
+   char *result = hashed(this->memory, this->log, material);
+   memset(material, 0, strlen(material));
+   this->memory.free(material);
+   return result;
+}
+
+/*
+ * The keys are derived from the configured secret, stretched with the
+ * snapshot salt like the vault passwords, and only live in the session
+ * memory
+ */
+static int snapshot_keys(session_impl_t *this, const char *secret) {
+   hashing_t hashing = { DEFAULT_STRETCH, (char*)secret, this->snapshot_salt, NULL };
+   if (!pass_stretch(this->memory, this->log, &hashing)) {
+      return 0;
+   }
+   this->snapshot_key = snapshot_key(this, "encryption", hashing.hashed);
+   this->snapshot_mac_key = snapshot_key(this, "authentication", hashing.hashed);
+   memset(hashing.hashed, 0, strlen(hashing.hashed));
+   this->memory.free(hashing.hashed);
+   return this->snapshot_key != NULL && this->snapshot_mac_key != NULL;
+}
+
+static void free_snapshot(session_impl_t *this) {
+   this->memory.free(this->snapshot_salt);
+   if (this->snapshot_key != NULL) {
+      memset(this->snapshot_key, 0, strlen(this->snapshot_key));
+      this->memory.free(this->snapshot_key);
+   }
+   if (this->snapshot_mac_key != NULL) {
+      memset(this->snapshot_mac_key, 0, strlen(this->snapshot_mac_key));
+      this->memory.free(this->snapshot_mac_key);
+   }
+   this->memory.free(this->snapshot_path);
+   this->snapshot_path = NULL;
+}
+
+static void init_snapshot(session_impl_t *this, circus_config_t *config) {
+   const char *path = config->get(config, "session", "snapshot");
+   const char *secret = config->get(config, "session", "snapshot_secret");
+   const char *sz_interval = config->get(config, "session", "snapshot_interval");
+   unsigned long interval = SNAPSHOT_INTERVAL;
+
+   this->snapshot_path = NULL;
+   this->snapshot_salt = NULL;
+   this->snapshot_key = NULL;
+   this->snapshot_mac_key = NULL;
+   if (path == NULL || path[0] == 0) {
+      return;
+   }
+   if (secret == NULL || secret[0] == 0) {
+      log_error(this->log, "Session snapshot disabled: missing snapshot_secret");
+      return;
+   }
+   if (strlen(secret) < SNAPSHOT_SECRET_MIN) {
+      log_error(this->log, "Session snapshot disabled: snapshot_secret is too short (at least %d characters)", SNAPSHOT_SECRET_MIN);
+      return;
+   }
+   if (this->vault == NULL) {
+      log_error(this->log, "Session snapshot disabled: no vault");
+      return;
+   }
+   if (sz_interval != NULL) {
+      errno = 0;
+      unsigned long int t = strtoul(sz_interval, NULL, 10);
+      if ((t != ULONG_MAX || errno != ERANGE) && errno != EINVAL && t > 0 && t < UINT_MAX) {
+         interval = t;
+      } else {
+         log_error(this->log, "Invalid snapshot_interval: %s", sz_interval);
+      }
+   }
+
+   this->snapshot_path = szprintf(this->memory, NULL, "%s", path);
+   char *content = snapshot_load(this);
+   char *save = NULL, *file_salt = NULL, *mac = NULL, *enc = NULL;
+   if (content != NULL) {
+      file_salt = strtok_r(content, "\n", &save);
+      mac = strtok_r(NULL, "\n", &save);
+      enc = strtok_r(NULL, "\n", &save);
+   }
+   if (file_salt == NULL) {
+      this->snapshot_salt = salt(this->memory, this->log);
+   } else {
+      this->snapshot_salt = szprintf(this->memory, NULL, "%s", file_salt);
+   }
+   if (this->snapshot_salt == NULL || !snapshot_keys(this, secret)) {
+      log_error(this->log, "Session snapshot disabled: could not derive the keys");
+      this->memory.free(content);
+      free_snapshot(this);
+      return;
+   }
+
+   if (content != NULL) {
+      snapshot_read(this, mac, enc);
+      this->memory.free(content);
+   }
+
+   uv_timer_init(uv_default_loop(), &(this->snapshot_timer));
+   this->snapshot_timer.data = this;
+   // the snapshot does not keep the loop alive by itself
+   uv_unref((uv_handle_t*)&(this->snapshot_timer));
+   uv_timer_start(&(this->snapshot_timer), on_snapshot_timer, interval * 1000, interval * 1000);
+}
+
+// ----------------------------------------------------------------
+
+static void session_stats(session_impl_t *this, circus_stats_fn fn, void *data) {
+   fn(data, "session.count", this->table_count);
+   fn(data, "session.expired", this->expired);
+   fn(data, "session.restored", this->restored);
+   fn(data, "session.evicted", this->evicted);
+}
+
+static void on_close(uv_handle_t *handle) {
+   session_impl_t *this = handle->data;
+   if (--(this->closing) == 0) {
+      this->memory.free(this);
+   }
 }
 
+/*
+ * The last snapshot is written here, while the users are still there
+ */
 static void session_free(session_impl_t *this) {
-   this->per_sessionid->clean(this->per_sessionid, (cad_hash_iterator_fn)clean_sessionid, this);
-   this->per_user->clean(this->per_user, (cad_hash_iterator_fn)clean_user, this);
-   this->per_sessionid->free(this->per_sessionid);
+   // the loop keeps pointers to the timers until they are closed
+   if (has_expiry(this)) {
+      this->closing++;
+      uv_close((uv_handle_t*)&(this->timer), on_close);
+   }
+   if (this->snapshot_path != NULL) {
+      this->closing++;
+      uv_close((uv_handle_t*)&(this->snapshot_timer), on_close);
+      snapshot_write(this);
+      free_snapshot(this);
+   }
+   free_all(this);
    this->per_user->free(this->per_user);
-   this->memory.free(this);
+   this->memory.free(this->per_sessionid);
+   this->memory.free(this->raw);
+   this->memory.free(this->b64_sessionid);
+   this->memory.free(this->b64_token);
+   if (this->closing == 0) {
+      this->memory.free(this);
+   }
 }
 
 static circus_session_t session_fn = {
    (circus_session_get_fn)session_get,
    (circus_session_set_fn)session_set,
+   (circus_session_close_fn)session_close,
+   (circus_session_shrink_fn)session_shrink,
+   (circus_session_stats_fn)session_stats,
    (circus_session_free_fn)session_free,
 };
 
-circus_session_t *circus_session(cad_memory_t memory, circus_log_t *log, circus_config_t *config) {
-   session_impl_t *result = memory.malloc(sizeof(session_impl_t));
+circus_session_t *circus_session(cad_memory_t memory, circus_log_t *log, circus_config_t *config, circus_vault_t *vault) {
+   session_impl_t *result = memory_malloc(memory, sizeof(session_impl_t));
    assert(result != NULL);
 
    result->fn = session_fn;
    result->memory = memory;
    result->log = log;
    result->per_user = cad_new_hash(memory, hash_user_keys);
-   result->per_sessionid = cad_new_hash(memory, cad_hash_strings);
 
    result->sessionid_length = SESSIONID_LENGTH;
    result->token_length = TOKEN_LENGTH;
    result->token_retention = TOKEN_RETENTION;
+   result->idle_timeout = (uint64_t)IDLE_TIMEOUT * 1000;
+   result->max_lifetime = (uint64_t)MAX_LIFETIME * 1000;
+   result->expired = 0;
+   result->restored = 0;
+   result->max_per_user = MAX_PER_USER;
+   result->evicted = 0;
+   result->pending = 0;
+   result->vault = vault;
+   result->wheel_tick = uv_now(uv_default_loop()) / WHEEL_TICK;
+   memset(result->wheel, 0, sizeof(result->wheel));
 
    const char *sz_sessionid_length = config->get(config, "session", "sessionid_length");
    if (sz_sessionid_length != NULL) {
@@ -237,8 +1116,63 @@ circus_session_t *circus_session(cad_memory_t memory, circus_log_t *log, circus_
       }
    }
 
+   const char *sz_idle_timeout = config->get(config, "session", "idle_timeout");
+   if (sz_idle_timeout != NULL) {
+      errno = 0;
+      unsigned long int t = strtoul(sz_idle_timeout, NULL, 10);
+      if ((t != ULONG_MAX || errno != ERANGE) && errno != EINVAL && t < UINT_MAX) {
+         result->idle_timeout = (uint64_t)t * 1000;
+      } else {
+         log_error(log, "Invalid idle_timeout: %s", sz_idle_timeout);
+      }
+   }
+
+   const char *sz_max_lifetime = config->get(config, "session", "max_lifetime");
+   if (sz_max_lifetime != NULL) {
+      errno = 0;
+      unsigned long int t = strtoul(sz_max_lifetime, NULL, 10);
+      if ((t != ULONG_MAX || errno != ERANGE) && errno != EINVAL && t < UINT_MAX) {
+         result->max_lifetime = (uint64_t)t * 1000;
+      } else {
+         log_error(log, "Invalid max_lifetime: %s", sz_max_lifetime);
+      }
+   }
+
+   const char *sz_max_per_user = config->get(config, "session", "max_per_user");
+   if (sz_max_per_user != NULL) {
+      errno = 0;
+      unsigned long int t = strtoul(sz_max_per_user, NULL, 10);
+      if ((t != ULONG_MAX || errno != ERANGE) && errno != EINVAL && t > 0 && t < UINT_MAX) {
+         result->max_per_user = (unsigned int)t;
+      } else {
+         log_error(log, "Invalid max_per_user: %s", sz_max_per_user);
+      }
+   }
+
+   result->table_capacity = TABLE_CAPACITY;
+   result->table_count = 0;
+   result->per_sessionid = memory_malloc(memory, TABLE_CAPACITY * sizeof(data_t*));
+   memset(result->per_sessionid, 0, TABLE_CAPACITY * sizeof(data_t*));
+   size_t b64_max = b64_size(result->sessionid_length > result->token_length ? result->sessionid_length : result->token_length);
+   result->raw = memory_malloc(memory, b64_max / 4 * 3);
+   result->b64_sessionid = memory_malloc(memory, b64_size(result->sessionid_length) + 1);
+   result->b64_token = memory_malloc(memory, b64_size(result->token_length) + 1);
+
    assert(result->per_user != NULL);
    assert(result->per_sessionid != NULL);
+   assert(result->raw != NULL);
+   assert(result->b64_sessionid != NULL);
+   assert(result->b64_token != NULL);
+
+   init_snapshot(result, config);
+
+   if (has_expiry(result)) {
+      uv_timer_init(uv_default_loop(), &(result->timer));
+      result->timer.data = result;
+      // the expiry does not keep the loop alive by itself
+      uv_unref((uv_handle_t*)&(result->timer));
+      uv_timer_start(&(result->timer), on_expiry_timer, WHEEL_TICK, WHEEL_TICK);
+   }
 
    return I(result);
 }
@@ -22,6 +22,7 @@
 #include <circus_base32.h>
 #include <circus_base64.h>
 #include <circus_crypt.h>
+#include <circus_memory.h>
 
 #define SALT_SIZE 16
 #define KEY_SIZE 32 // 256 bits
@@ -40,7 +41,7 @@
 
 char *salt(cad_memory_t memory, circus_log_t *log) {
    char *result = NULL;
-   char *raw = memory.malloc(SALT_SIZE);
+   char *raw = memory_malloc(memory, SALT_SIZE);
    if (raw == NULL) {
       log_error(log, "Could not allocate memory for salt");
    } else {
@@ -74,7 +75,7 @@ char *unsalted(cad_memory_t memory, circus_log_t *log, const char *salt, const c
    int n = strlen(value) - saltlen; /* - 1 (for ':') + 1 (for '\0') */
 
    if (n > 1 && value[saltlen] == ':' && memcmp(value, salt, saltlen) == 0) {
-      result = memory.malloc(n);
+      result = memory_malloc(memory, n);
       memcpy(result, value + saltlen + 1, n);
    } else {
       log_error(log, "Tampered salted value!!");
@@ -106,8 +107,35 @@ char *hashed(cad_memory_t memory, circus_log_t *log, const char *value) {
    return result;
 }
 
+char *authenticated(cad_memory_t memory, circus_log_t *log, const char *value, const char *key) {
+   assert(value != NULL);
+   assert(key != NULL);
+   assert(key[0] != 0);
+
+   gcry_md_hd_t hd;
+   gcry_error_t e = gcrypt(md_open(&hd, GCRY_MD_SHA512, GCRY_MD_FLAG_SECURE | GCRY_MD_FLAG_HMAC));
+   if (e != 0) {
+      log_error(log, "Could not open HMAC algorithm");
+      return NULL;
+   }
+
+   char *result = NULL;
+   e = gcrypt(md_setkey(hd, key, strlen(key)));
+   if (e == 0) {
+      gcry_md_write(hd, value, strlen(value));
+      gcry_md_final(hd);
+      char *hash = (char*)gcry_md_read(hd, 0);
+      if (hash != NULL) {
+         result = base64(memory, hash, HASH_SIZE);
+      }
+   }
+   gcry_md_close(hd);
+
+   return result;
+}
+
 char *new_symmetric_key(cad_memory_t memory, circus_log_t *log) {
-   char *raw = memory.malloc(KEY_SIZE);
+   char *raw = memory_malloc(memory, KEY_SIZE);
    if (raw == NULL) {
       log_error(log, "Could not allocate memory for symmetric key");
    } else {
@@ -133,7 +161,7 @@ char *encrypted(cad_memory_t memory, circus_log_t *log, const char *value, const
    }
    int len = strlen(value) + 1; // be sure to encrypt the '\0' at the end of the string, for correct decryption
    int n = len + KEY_SIZE - (len % KEY_SIZE);
-   char *enc = memory.malloc(n);
+   char *enc = memory_malloc(memory, n);
    size_t key_size;
    key = unbase64(memory, b64key, &key_size);
    if (key == NULL) {
@@ -144,7 +172,7 @@ char *encrypted(cad_memory_t memory, circus_log_t *log, const char *value, const
       e = gcrypt(cipher_setkey(hd, key, KEY_SIZE));
       if (e == 0) {
          size_t blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER_AES256);
-         char *blk = memory.malloc(blklen);
+         char *blk = memory_malloc(memory, blklen);
          if (blk == NULL) {
             log_error(log, "could not allocate initialization vector");
          } else {
@@ -174,10 +202,15 @@ char *encrypted(cad_memory_t memory, circus_log_t *log, const char *value, const
 
 char *decrypted(cad_memory_t memory, circus_log_t *log, const char *b64value, const char *b64key) {
    assert(b64value != NULL);
-   assert(b64value[0] != 0);
+   return decrypted_len(memory, log, b64value, strlen(b64value), b64key);
+}
+
+char *decrypted_len(cad_memory_t memory, circus_log_t *log, const char *b64value, size_t b64len, const char *b64key) {
+   assert(b64value != NULL);
+   assert(b64len != 0);
 
    size_t len;
-   char *value = unbase64(memory, b64value, &len);
+   char *value = unbase64_len(memory, b64value, b64len, &len);
    if (value == NULL) {
       return NULL;
    }
@@ -198,7 +231,7 @@ char *decrypted(cad_memory_t memory, circus_log_t *log, const char *b64value, co
       e = gcrypt(cipher_setkey(hd, key, KEY_SIZE));
       if (e == 0) {
          size_t blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER_AES256);
-         char *blk = memory.malloc(blklen);
+         char *blk = memory_malloc(memory, blklen);
          if (blk == NULL) {
             log_error(log, "could not allocate initialization vector");
          } else {
@@ -233,7 +266,7 @@ unsigned int irandom(unsigned int max) {
 
 static char *szrandom_level(cad_memory_t memory, size_t len, enum gcry_random_level level, char *(*encode)(cad_memory_t, const char*, size_t)) {
    assert(len > 0);
-   char *raw = memory.malloc(len + 1);
+   char *raw = memory_malloc(memory, len + 1);
    if (raw == NULL) return NULL;
    gcry_randomize(raw, len, level);
    char *result = encode(memory, raw, len);
@@ -241,6 +274,10 @@ static char *szrandom_level(cad_memory_t memory, size_t len, enum gcry_random_le
    return result;
 }
 
+void random_bytes(char *buffer, size_t len) {
+   gcry_randomize(buffer, len, GCRY_STRONG_RANDOM);
+}
+
 char *szrandom32(cad_memory_t memory, size_t len) {
    return szrandom_level(memory, len, GCRY_STRONG_RANDOM, base32);
 }
@@ -257,10 +294,42 @@ char *szrandom64_strong(cad_memory_t memory, size_t len) {
    return szrandom_level(memory, len, GCRY_VERY_STRONG_RANDOM, base64);
 }
 
+static void *crypt_alloc(size_t n) {
+   return UNLOCKED_MEMORY.malloc(n);
+}
+
+static void *crypt_alloc_secure(size_t n) {
+   return MEMORY.malloc(n > 0 ? n : 1);
+}
+
+static int crypt_is_secure(const void *p) {
+   return is_locked(p);
+}
+
+static void *crypt_realloc(void *p, size_t n) {
+   if (is_locked(p)) {
+      return MEMORY.realloc(p, n > 0 ? n : 1);
+   }
+   return UNLOCKED_MEMORY.realloc(p, n);
+}
+
+static void crypt_free(void *p) {
+   if (is_locked(p)) {
+      MEMORY.free(p);
+   } else {
+      UNLOCKED_MEMORY.free(p);
+   }
+}
+
 int init_crypt(circus_log_t *log) {
    static int init = 0;
    gcry_error_t e;
    if (!init) {
+      // libgcrypt secure memory is taken from the same locked memory as MEMORY (see memory.c); the
+      // handlers are installed before any other libgcrypt call, so that libgcrypt never hands back a
+      // pointer from the system allocator
+      gcry_set_allocation_handler(crypt_alloc, crypt_alloc_secure, crypt_is_secure, crypt_realloc, crypt_free);
+
       const char *ver = gcry_check_version(GCRYPT_VERSION);
       if (ver == NULL) {
          log_error(log, "gcrypt version mismatch");
@@ -269,25 +338,13 @@ int init_crypt(circus_log_t *log) {
          log_info(log, "gcrypt version: %s", ver);
       }
 
-      e = gcrypt(control(GCRYCTL_SUSPEND_SECMEM_WARN, 0));
-      if (e != 0) {
-         log_warning(log, "gcrypt suspend secmen warn failed");
-      }
-      e = gcrypt(control(GCRYCTL_INIT_SECMEM, 16384, 0));
-      if (e != 0) {
-         log_error(log, "gcrypt init secmen failed");
-         return 0;
-      }
-      e = gcrypt(control(GCRYCTL_RESUME_SECMEM_WARN, 0));
-      if (e != 0) {
-         log_warning(log, "gcrypt resume secmen warn failed");
-      }
-
       e = gcrypt(control(GCRYCTL_INITIALIZATION_FINISHED, 0));
       if (e != 0) {
          log_error(log, "gcrypt init failed");
          return 0;
       }
+
+      init = 1;
    }
 
    e = gcrypt(control(GCRYCTL_SELFTEST, 0));
@@ -16,11 +16,16 @@
     Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
 */
 
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <uv.h>
 
 #include <circus.h>
 #include <circus_crypt.h>
 #include <circus_log.h>
+#include <circus_memory.h>
 #include <circus_vault.h>
 #include <circus_xdg.h>
 
@@ -33,63 +38,146 @@
  * - stretch user keys
  */
 
-static void get_symmetric_key(user_impl_t *user, const char *password) {
-   assert(password != NULL && password[0] != 0);
+static void wipe_user_row(user_row_t *row) {
+   if (row->size > 0) {
+      memset(row->buffer, 0, row->size);
+      row->size = 0;
+   }
+}
 
-   static const char *sql = "SELECT KEYSALT, HASHKEY FROM USERS WHERE USERID=?";
-   circus_database_query_t *q = user->vault->database->query(user->vault->database, sql);
-   int ok;
+#define ROW_NULL ((size_t)-1)
+
+/*
+ * Append a column value to the row buffer, and return its offset
+ * (ROW_NULL for NULL values). Offsets, not pointers: the buffer may
+ * move while the row is being loaded.
+ */
+static size_t row_string(vault_impl_t *this, circus_database_resultset_t *rs, int index, size_t *len) {
+   user_row_t *row = &(this->row);
+   const char *value = rs->get_string_len(rs, index, len);
+   if (value == NULL) {
+      return ROW_NULL;
+   }
+   if (row->size + *len + 1 > row->capacity) {
+      size_t capacity = row->capacity == 0 ? 1024 : row->capacity;
+      while (row->size + *len + 1 > capacity) {
+         capacity *= 2;
+      }
+      // not realloc: the old buffer holds secrets and must be wiped
+      char *buffer = memory_malloc(this->memory, capacity);
+      assert(buffer != NULL);
+      if (row->buffer != NULL) {
+         memcpy(buffer, row->buffer, row->size);
+         memset(row->buffer, 0, row->size);
+         this->memory.free(row->buffer);
+      }
+      row->buffer = buffer;
+      row->capacity = capacity;
+   }
+   size_t result = row->size;
+   memcpy(row->buffer + result, value, *len);
+   row->buffer[result + *len] = 0;
+   row->size += *len + 1;
+   return result;
+}
 
+static const char *row_pointer(user_row_t *row, size_t offset) {
+   return offset == ROW_NULL ? NULL : row->buffer + offset;
+}
+
+/*
+ * Returns 1 if found, 0 if not found, and -1 on error
+ */
+static int load_user_row(vault_impl_t *this, const char *username) {
+   static const char *sql = "SELECT USERID, PERMISSIONS, EMAIL, PWDVALID, STRETCH, PWDSALT, HASHPWD, KEYSALT, HASHKEY FROM USERS WHERE USERNAME=?";
+   user_row_t *row = &(this->row);
+   int result = -1;
+   size_t len, email = ROW_NULL, pwdsalt = ROW_NULL, hashpwd = ROW_NULL, keysalt = ROW_NULL, hashkey = ROW_NULL;
+
+   wipe_user_row(row);
+
+   circus_database_query_t *q = this->database->query(this->database, sql);
    if (q != NULL) {
-      ok = q->set_int(q, 0, user->userid);
-      if (ok) {
+      if (q->set_string_static(q, 0, username, -1)) {
          circus_database_resultset_t *rs = q->run(q);
          if (rs != NULL) {
-            if (!rs->has_next(rs)) {
-               log_error(user->log, "Error user not found: %"PRId64, user->userid);
-               ok = 0;
-            } else {
+            result = 0;
+            while (result >= 0 && rs->has_next(rs)) {
                rs->next(rs);
-
-               const char *keysalt = rs->get_string(rs, 0);
-               const char *hashkey = rs->get_string(rs, 1);
-
-               if (hashkey == NULL || strlen(hashkey) == 0) {
-                  log_error(user->log, "Error user: %"PRId64" -- HASHKEY is NULL", user->userid);
-               } else if (keysalt == NULL || strlen(keysalt) == 0) {
-                  log_error(user->log, "Error user: %"PRId64" -- KEYSALT is NULL", user->userid);
+               if (result) {
+                  log_error(this->log, "Error: multiple entries for user %s", username);
+                  result = -1;
                } else {
-                  char *passslt = NULL;
-                  char *passkey = NULL;
-                  passslt = salted(user->memory, user->log, keysalt, password);
-                  if (passslt == NULL) {
-                     log_error(user->log, "Error user: %"PRId64" -- could not salt password", user->userid);
-                  } else {
-                     passkey = hashed(user->memory, user->log, passslt);
-                     if (passkey == NULL) {
-                        log_error(user->log, "Error user: %"PRId64" -- could not hash password", user->userid);
-                     } else {
-                        char *saltedkey = decrypted(user->memory, user->log, hashkey, passkey);
-                        if (saltedkey == NULL) {
-                           log_error(user->log, "Error user: %"PRId64" -- could not decrypt", user->userid);
-                        } else {
-                           user->symmkey = unsalted(user->memory, user->log, keysalt, saltedkey);
-                           if (user->symmkey == NULL) {
-                              log_error(user->log, "Error user: %"PRId64" -- could not unsalt", user->userid);
-                           }
-                           user->memory.free(saltedkey);
-                        }
-                        user->memory.free(passkey);
-                     }
-                     user->memory.free(passslt);
-                  }
+                  row->userid = rs->get_int(rs, 0);
+                  row->permissions = (int)rs->get_int(rs, 1);
+                  row->validity = (uint64_t)rs->get_int(rs, 3);
+                  row->stretch = (uint64_t)rs->get_int(rs, 4);
+                  email = row_string(this, rs, 2, &len);
+                  pwdsalt = row_string(this, rs, 5, &len);
+                  hashpwd = row_string(this, rs, 6, &len);
+                  keysalt = row_string(this, rs, 7, &(row->keysalt_len));
+                  hashkey = row_string(this, rs, 8, &(row->hashkey_len));
+                  result = 1;
                }
             }
+            if (rs->has_error(rs)) {
+               log_error(this->log, "Could not read user %s", username);
+               result = -1;
+            }
             rs->free(rs);
          }
       }
       q->free(q);
    }
+
+   if (result == 1) {
+      row->email = row_pointer(row, email);
+      row->pwdsalt = row_pointer(row, pwdsalt);
+      row->hashpwd = row_pointer(row, hashpwd);
+      row->keysalt = row_pointer(row, keysalt);
+      row->hashkey = row_pointer(row, hashkey);
+   } else {
+      wipe_user_row(row);
+   }
+   return result;
+}
+
+static void get_symmetric_key(user_impl_t *user, user_row_t *row, const char *password) {
+   assert(password != NULL && password[0] != 0);
+
+   const char *keysalt = row->keysalt;
+   const char *hashkey = row->hashkey;
+
+   if (hashkey == NULL || row->hashkey_len == 0) {
+      log_error(user->log, "Error user: %"PRId64" -- HASHKEY is NULL", user->userid);
+   } else if (keysalt == NULL || row->keysalt_len == 0) {
+      log_error(user->log, "Error user: %"PRId64" -- KEYSALT is NULL", user->userid);
+   } else {
+      char *passslt = NULL;
+      char *passkey = NULL;
+      passslt = salted(user->memory, user->log, keysalt, password);
+      if (passslt == NULL) {
+         log_error(user->log, "Error user: %"PRId64" -- could not salt password", user->userid);
+      } else {
+         passkey = hashed(user->memory, user->log, passslt);
+         if (passkey == NULL) {
+            log_error(user->log, "Error user: %"PRId64" -- could not hash password", user->userid);
+         } else {
+            char *saltedkey = decrypted_len(user->memory, user->log, hashkey, row->hashkey_len, passkey);
+            if (saltedkey == NULL) {
+               log_error(user->log, "Error user: %"PRId64" -- could not decrypt", user->userid);
+            } else {
+               user->symmkey = unsalted(user->memory, user->log, keysalt, saltedkey);
+               if (user->symmkey == NULL) {
+                  log_error(user->log, "Error user: %"PRId64" -- could not unsalt", user->userid);
+               }
+               user->memory.free(saltedkey);
+            }
+            user->memory.free(passkey);
+         }
+         user->memory.free(passslt);
+      }
+   }
 }
 
 int set_symmetric_key(user_impl_t *user, const char *password) {
@@ -108,7 +196,7 @@ int set_symmetric_key(user_impl_t *user, const char *password) {
          if (keysalt == NULL) {
             ok = 0;
          } else {
-            ok = q->set_string(q, 0, keysalt);
+            ok = q->set_string_static(q, 0, keysalt, -1);
          }
       }
 
@@ -142,7 +230,7 @@ int set_symmetric_key(user_impl_t *user, const char *password) {
                      if (hashkey == NULL) {
                         ok = 0;
                      } else {
-                        ok = q->set_string(q, 1, hashkey);
+                        ok = q->set_string_static(q, 1, hashkey, -1);
                      }
                   }
                }
@@ -175,63 +263,216 @@ int set_symmetric_key(user_impl_t *user, const char *password) {
    return result;
 }
 
+/*
+ * The users cache is a bounded LRU. The users pinned by a session are
+ * out of the list and never evicted. The others are evicted, oldest
+ * first, when there are more than cache_size of them or when they have
+ * been idle for cache_ttl. Eviction only happens in vault_get_() and
+ * vault_new_(), so that the user just unpinned by a session that is
+ * being replaced is not freed under its feet.
+ */
+static void lru_unlink(vault_impl_t *this, user_impl_t *user) {
+   if (user->lru_prev == NULL) {
+      this->lru_head = user->lru_next;
+   } else {
+      user->lru_prev->lru_next = user->lru_next;
+   }
+   if (user->lru_next == NULL) {
+      this->lru_tail = user->lru_prev;
+   } else {
+      user->lru_next->lru_prev = user->lru_prev;
+   }
+   user->lru_prev = user->lru_next = NULL;
+   this->lru_count--;
+}
+
+static void lru_push(vault_impl_t *this, user_impl_t *user) {
+   user->last_used = uv_now(uv_default_loop());
+   user->lru_prev = NULL;
+   user->lru_next = this->lru_head;
+   if (this->lru_head == NULL) {
+      this->lru_tail = user;
+   } else {
+      this->lru_head->lru_prev = user;
+   }
+   this->lru_head = user;
+   this->lru_count++;
+}
+
+static void cache_touch(vault_impl_t *this, user_impl_t *user) {
+   if (user->pins == 0) {
+      lru_unlink(this, user);
+      lru_push(this, user);
+   }
+}
+
+static void cache_drop(vault_impl_t *this, user_impl_t *user) {
+   if (user->pins == 0) {
+      lru_unlink(this, user);
+   }
+   this->users->del(this->users, user->name);
+   user->fn.free(&(user->fn));
+}
+
+/*
+ * The negative cache: the usernames not found in the directory are
+ * remembered for unknown_ttl, so that guessing non-existent accounts
+ * does not cost a query each time. The entries are evicted oldest
+ * first; vault_new_() marks them known (expiry 0) rather than removing
+ * them, so that the ring stays their only owner.
+ */
+struct unknown_s {
+   uint64_t expiry; // ms, loop time; 0 = not unknown anymore
+   char name[];
+};
+
+static int is_unknown(vault_impl_t *this, const char *username) {
+   if (this->unknown_size == 0) {
+      return 0;
+   }
+   unknown_t *entry = this->unknown->get(this->unknown, username);
+   if (entry == NULL || entry->expiry <= uv_now(uv_default_loop())) {
+      return 0;
+   }
+   this->unknown_hits++;
+   return 1;
+}
+
+static void set_unknown(vault_impl_t *this, const char *username) {
+   if (this->unknown_size == 0) {
+      return;
+   }
+   unknown_t *entry = this->unknown->get(this->unknown, username);
+   if (entry == NULL) {
+      entry = this->unknown_ring[this->unknown_next];
+      if (entry != NULL) {
+         this->unknown->del(this->unknown, entry->name);
+         this->memory.free(entry);
+      }
+      size_t len = strlen(username) + 1;
+      entry = memory_malloc(this->memory, sizeof(unknown_t) + len);
+      assert(entry != NULL);
+      memcpy(entry->name, username, len);
+      this->unknown_ring[this->unknown_next] = entry;
+      this->unknown_next = (this->unknown_next + 1) % this->unknown_size;
+      this->unknown->set(this->unknown, entry->name, entry);
+   }
+   entry->expiry = uv_now(uv_default_loop()) + this->unknown_ttl;
+}
+
+static void set_known(vault_impl_t *this, const char *username) {
+   if (this->unknown_size == 0) {
+      return;
+   }
+   unknown_t *entry = this->unknown->get(this->unknown, username);
+   if (entry != NULL) {
+      entry->expiry = 0;
+   }
+}
+
+static void clean_unknown(cad_hash_t *UNUSED(hash), int UNUSED(index), const char *UNUSED(name), unknown_t *UNUSED(entry), vault_impl_t *UNUSED(vault)) {
+   // freed from the ring
+}
+
+static void clear_unknown(vault_impl_t *this) {
+   unsigned int i;
+   this->unknown->clean(this->unknown, (cad_hash_iterator_fn)clean_unknown, this);
+   for (i = 0; i < this->unknown_size; i++) {
+      this->memory.free(this->unknown_ring[i]);
+      this->unknown_ring[i] = NULL;
+   }
+   this->unknown_next = 0;
+}
+
+static void cache_evict(vault_impl_t *this, user_impl_t *keep) {
+   uint64_t now = uv_now(uv_default_loop());
+   unsigned int evicted = 0;
+   user_impl_t *user;
+   while ((user = this->lru_tail) != NULL && user != keep
+          && (this->lru_count > this->cache_size || (this->cache_ttl > 0 && now - user->last_used >= this->cache_ttl))) {
+      cache_drop(this, user);
+      evicted++;
+   }
+   if (evicted > 0) {
+      log_debug(this->log, "Evicted %u cached users", evicted);
+   }
+}
+
+void vault_pin_user(vault_impl_t *vault, user_impl_t *user) {
+   if (user->pins++ == 0) {
+      lru_unlink(vault, user);
+   }
+}
+
+void vault_unpin_user(vault_impl_t *vault, user_impl_t *user) {
+   assert(user->pins > 0);
+   if (--user->pins == 0) {
+      lru_push(vault, user);
+   }
+}
+
+/*
+ * The user row is loaded only once, and only if needed: to create the
+ * user, to unlock their symmetric key, or to check their password.
+ */
 static user_impl_t *vault_get_(vault_impl_t *this, const char *username, const char *password, int with_symmkey) {
    log_info(this->log, "Getting user %s%s%s", username,
             with_symmkey ? " with their symmetric key" : "",
             password == NULL ? (with_symmkey ? " BUT MISSING PASSWORD" : "") : ", and checking password");
 
+   int has_password = password != NULL && password[0] != 0;
+   int loaded = 0, found;
    user_impl_t *result = this->users->get(this->users, username);
-   if (result == NULL) {
-      log_debug(this->log, "User %s not found in dict, loading from database", username);
-      static const char *sql = "SELECT USERID, PERMISSIONS, EMAIL, PWDVALID FROM USERS WHERE USERNAME=?";
-      circus_database_query_t *q = this->database->query(this->database, sql);
-      int ok;
-      if (q != NULL) {
-         ok = q->set_string(q, 0, username);
-         if (ok) {
-            circus_database_resultset_t *rs = q->run(q);
-            if (rs != NULL) {
-               while (rs->has_next(rs)) {
-                  rs->next(rs);
-                  if (result != NULL) {
-                     log_error(this->log, "Error: multiple entries for user %s", username);
-                     result->fn.free(&(result->fn));
-                     result = NULL;
-                  } else {
-                     int64_t userid = rs->get_int(rs, 0);
-                     int permissions = (int)rs->get_int(rs, 1);
-                     const char *email = rs->get_string(rs, 2);
-                     uint64_t validity = (uint64_t)rs->get_int(rs, 3);
-                     result = new_vault_user(this->memory, this->log, userid, validity, permissions, email, username, this);
-                  }
-               }
-               rs->free(rs);
-            }
-         }
-         q->free(q);
-      }
-      if (result != NULL) {
-         log_debug(this->log, "Updating users cache");
-         this->users->set(this->users, username, result);
-         if (with_symmkey && password != NULL && password[0] != 0) {
-            log_debug(this->log, "Getting user symmetric key");
-            get_symmetric_key(result, password);
+   int need_symmkey = with_symmkey && has_password && (result == NULL || result->symmkey == NULL);
+
+   if (result == NULL && is_unknown(this, username)) {
+      log_debug(this->log, "User %s recently not found, not loading from database", username);
+   } else if (result == NULL || need_symmkey || has_password) {
+      if (result == NULL) {
+         log_debug(this->log, "User %s not found in dict, loading from database", username);
+      }
+      found = load_user_row(this, username);
+      loaded = found == 1;
+      if (found == 0 && result == NULL) {
+         set_unknown(this, username);
+      }
+      if (loaded && result == NULL) {
+         result = new_vault_user(this->memory, this->log, this->row.userid, this->row.validity, this->row.permissions,
+                                 this->row.email, username, this);
+         if (result != NULL) {
+            log_debug(this->log, "Updating users cache");
+            this->users->set(this->users, username, result);
+            lru_push(this, result);
          }
       }
-   } else if (with_symmkey && result->symmkey == NULL && password != NULL && password[0] != 0) {
+   }
+
+   if (result != NULL) {
+      cache_touch(this, result);
+   }
+   cache_evict(this, result);
+
+   if (result != NULL && loaded && need_symmkey) {
       log_debug(this->log, "Getting user symmetric key");
-      get_symmetric_key(result, password);
+      get_symmetric_key(result, &(this->row), password);
    }
 
    if (result == NULL) {
       log_error(this->log, "Could not find user %s", username);
    } else {
       log_pii(this->log, "User %s has userid %"PRId64, username, result->userid);
-      if (password != NULL && password[0] != 0) {
+      if (has_password) {
          log_debug(this->log, "Checking user password");
-         result = check_user_password(result, password);
+         if (loaded) {
+            result = check_user_password(result, &(this->row), password);
+         } else {
+            log_error(this->log, "Error user not found: %"PRId64, result->userid);
+            result = NULL;
+         }
       }
    }
+
+   wipe_user_row(&(this->row));
    return result;
 }
 
@@ -245,6 +486,21 @@ static user_impl_t *vault_get(vault_impl_t *this, const char *username, const ch
    return result;
 }
 
+static user_impl_t *vault_restore(vault_impl_t *this, const char *username, const char *symmkey) {
+   assert(username != NULL);
+   assert(username[0] != 0);
+   user_impl_t *result = vault_get_(this, username, NULL, 0);
+   if (result != NULL) {
+      if (result->permissions == PERMISSION_REVOKED) {
+         log_warning(this->log, "Not restoring the session of revoked user %s", username);
+         result = NULL;
+      } else if (result->symmkey == NULL && symmkey != NULL) {
+         result->symmkey = szprintf(result->memory, NULL, "%s", symmkey);
+      }
+   }
+   return result;
+}
+
 static user_impl_t *vault_new_(vault_impl_t *this, const char *username, const char *password, uint64_t validity, int permissions) {
    assert(password != NULL && password[0] != 0);
    log_info(this->log, "Creating new user %s", username);
@@ -253,9 +509,15 @@ static user_impl_t *vault_new_(vault_impl_t *this, const char *username, const c
    log_info(this->log, "stretch_threshold=%"PRIu64, stretch_threshold);
 
    user_impl_t *result = NULL;
+   if (!this->database->begin(this->database)) {
+      log_error(this->log, "Could not start user creation transaction");
+      return NULL;
+   }
+
    static const char *sql = "INSERT INTO USERS (USERNAME, PERMISSIONS, STRETCH, PWDSALT, HASHPWD, PWDVALID, KEYSALT, HASHKEY) "
       "values (?, ?, ?, ?, ?, ?, 'invalid', 'invalid')";
    circus_database_query_t *q = this->database->query(this->database, sql);
+   int ok = 0;
 
    if (q != NULL) {
       hashing_t h_pass;
@@ -263,9 +525,9 @@ static user_impl_t *vault_new_(vault_impl_t *this, const char *username, const c
       h_pass.clear = (char*)password;
       h_pass.salt = NULL;
       h_pass.hashed = NULL;
-      int ok = pass_hash(this->memory, this->log, &h_pass);
+      ok = pass_hash(this->memory, this->log, &h_pass);
       if (ok) {
-         ok = q->set_string(q, 0, username);
+         ok = q->set_string_static(q, 0, username, -1);
       }
       if (ok) {
          ok = q->set_int(q, 1, permissions);
@@ -274,10 +536,10 @@ static user_impl_t *vault_new_(vault_impl_t *this, const char *username, const c
          ok = q->set_int(q, 2, (int64_t)stretch_threshold);
       }
       if (ok) {
-         ok = q->set_string(q, 3, h_pass.salt);
+         ok = q->set_string_static(q, 3, h_pass.salt, -1);
       }
       if (ok) {
-         ok = q->set_string(q, 4, h_pass.hashed);
+         ok = q->set_string_static(q, 4, h_pass.hashed, -1);
       }
       if (ok) {
          ok = q->set_int(q, 5, validity);
@@ -285,7 +547,13 @@ static user_impl_t *vault_new_(vault_impl_t *this, const char *username, const c
 
       if (ok) {
          circus_database_resultset_t *rs = q->run(q);
-         if (rs != NULL) {
+         if (rs == NULL) {
+            ok = 0;
+         } else {
+            if (rs->has_error(rs)) {
+               log_error(this->log, "Could not insert user %s", username);
+               ok = 0;
+            }
             rs->free(rs);
          }
       }
@@ -296,6 +564,7 @@ static user_impl_t *vault_new_(vault_impl_t *this, const char *username, const c
       q->free(q);
 
       if (ok) {
+         set_known(this, username);
          result = vault_get_(this, username, password, 0);
          if (result == NULL) {
             log_error(this->log, "Error getting the just-created user from the database");
@@ -304,12 +573,23 @@ static user_impl_t *vault_new_(vault_impl_t *this, const char *username, const c
             log_debug(this->log, "Creating user symmetric key");
             ok = set_symmetric_key(result, password);
             if (!ok) {
-               log_error(this->log, "Symmetric key encryption creation failed. The user %"PRId64" may need help.", result->userid);
+               log_error(this->log, "Symmetric key encryption creation failed for user %"PRId64, result->userid);
             }
          }
       }
    }
 
+   if (ok) {
+      ok = this->database->commit(this->database);
+   } else {
+      this->database->rollback(this->database);
+   }
+   if (!ok && result != NULL) {
+      // the user does not exist anymore
+      cache_drop(this, result);
+      result = NULL;
+   }
+
    return result;
 }
 
@@ -319,42 +599,105 @@ static user_impl_t *vault_new(vault_impl_t *this, const char *username, const ch
    return vault_new_(this, username, password, validity, PERMISSION_USER);
 }
 
+/*
+ * An existing vault older than since does not get the item from the
+ * install: its migration creates it (e.g. TAGS_IX needs TAGS.USERID)
+ */
+static struct {
+   const char *sql;
+   const char *what;
+   int sharded; // in the shards, if any; otherwise in the directory
+   int since;
+} schema[] = {
+   { META_SCHEMA,  "META table",  0, 1 },
+   { USERS_SCHEMA, "USERS table", 0, 1 },
+   { USERS_INDEX,  "USERS index", 0, NAMES_VERSION },
+   { USERS_PWDVALID_INDEX, "USERS password validity index", 0, 3 },
+   { KEYS_SCHEMA,  "KEYS table",  1, 1 },
+   { KEYS_INDEX,   "KEYS index",  1, NAMES_VERSION },
+   { TAGS_SCHEMA,  "TAGS table",  1, 1 },
+   { TAGS_INDEX,   "TAGS index",  1, TAGS_VERSION },
+   { NULL, NULL, 0, 0 },
+};
+
+static int in_install(int i, int version) {
+   return version == 0 || schema[i].since <= version;
+}
+
+/*
+ * Creates the shard tables in a transaction left open: vault_install
+ * commits all the shards, or rolls them all back, with the directory
+ */
+static int install_shard(vault_impl_t *this, int shard, int version) {
+   circus_database_t *database = this->shards[shard];
+   int status = 0;
+   int i;
+
+   if (!database->begin(database)) {
+      log_error(this->log, "Could not start shard %d install transaction", shard);
+      return -1;
+   }
+   for (i = 0; schema[i].sql != NULL; i++) {
+      if (schema[i].sharded && in_install(i, version) && !database_exec(this->log, database, schema[i].sql)) {
+         log_error(this->log, "Error creating %s in shard %d", schema[i].what, shard);
+         status = 1;
+      }
+   }
+
+   return status;
+}
+
 static int vault_install(vault_impl_t *this, const char *admin_username, const char *admin_password) {
    assert(admin_password != NULL && admin_password[0] != 0);
 
    int status = 0;
    int ok;
+   int i;
 
-   ok = database_exec(this->log, this->database, META_SCHEMA);
-   if (!ok) {
-      log_error(this->log, "Error creating META table");
-      status = 1;
+   if (!this->database->begin(this->database)) {
+      log_error(this->log, "Could not start install transaction");
+      return 1;
    }
 
-   ok = database_exec(this->log, this->database, USERS_SCHEMA);
-   if (!ok) {
-      log_error(this->log, "Error creating USERS table");
+   // 0 if not installed yet
+   int version = vault_version(this);
+   if (version < 0) {
       status = 1;
    }
 
-   ok = database_exec(this->log, this->database, KEYS_SCHEMA);
-   if (!ok) {
-      log_error(this->log, "Error creating KEYS table");
-      status = 1;
+   for (i = 0; status == 0 && schema[i].sql != NULL; i++) {
+      if ((!schema[i].sharded || this->shards_count == 0) && in_install(i, version)) {
+         ok = database_exec(this->log, this->database, schema[i].sql);
+         if (!ok) {
+            log_error(this->log, "Error creating %s", schema[i].what);
+            status = 1;
+         }
+      }
    }
-
-   ok = database_exec(this->log, this->database, TAGS_SCHEMA);
-   if (!ok) {
-      log_error(this->log, "Error creating TAGS table");
+   // the shards with an open transaction
+   int shards = 0;
+   while (status == 0 && shards < this->shards_count) {
+      int shard_status = install_shard(this, shards, version);
+      if (shard_status < 0) {
+         status = 1;
+         break;
+      }
+      shards++;
+      if (shard_status != 0) {
+         status = 1;
+      }
+   }
+   if (!check_shards(this->log, this->database, this->shards_count, 1)) {
       status = 1;
    }
 
-   static const char *sql = "INSERT INTO META (KEY, VALUE) VALUES ('VERSION', ?)";
+   // an existing vault keeps its version, and is migrated at the next start
+   static const char *sql = "INSERT OR IGNORE INTO META (KEY, VALUE) VALUES ('VERSION', ?)";
    circus_database_query_t *q = this->database->query(this->database, sql);
    if (q == NULL) {
       status = 1;
    } else {
-      ok = q->set_string(q, 0, DB_VERSION);
+      ok = q->set_string_static(q, 0, DB_VERSION, -1);
       if (!ok) {
          status = 1;
       } else {
@@ -362,7 +705,9 @@ static int vault_install(vault_impl_t *this, const char *admin_username, const c
          if (rs == NULL) {
             status = 1;
          } else {
-            status = !!rs->has_error(rs);
+            if (rs->has_error(rs)) {
+               status = 1;
+            }
             rs->free(rs);
          }
       }
@@ -370,12 +715,40 @@ static int vault_install(vault_impl_t *this, const char *admin_username, const c
    }
 
    user_impl_t *admin = vault_get_(this, admin_username, NULL, 1);
+   user_impl_t *created = NULL;
    if (admin == NULL) {
-      admin = vault_new_(this, admin_username, admin_password, 0, PERMISSION_ADMIN);
+      admin = created = vault_new_(this, admin_username, admin_password, 0, PERMISSION_ADMIN);
+      if (admin == NULL) {
+         status = 1;
+      }
    } else {
       log_warning(this->log, "User %s already exists, ignoring password change", admin_username);
    }
 
+   // the shards are committed first: a shard committed alone only has
+   // empty tables, the next install completes it (a failed commit is
+   // rolled back)
+   for (i = 0; status == 0 && i < shards; i++) {
+      if (!this->shards[i]->commit(this->shards[i])) {
+         log_error(this->log, "Could not commit shard %d install transaction", i);
+         status = 1;
+      }
+   }
+   if (status != 0) {
+      log_error(this->log, "Install failed, rolling back");
+      for (; i < shards; i++) {
+         this->shards[i]->rollback(this->shards[i]);
+      }
+      this->database->rollback(this->database);
+   } else if (!this->database->commit(this->database)) {
+      log_error(this->log, "Could not commit install transaction");
+      status = 1;
+   }
+   if (status != 0 && created != NULL) {
+      // the admin does not exist anymore
+      cache_drop(this, created);
+   }
+
    return status;
 }
 
@@ -383,10 +756,167 @@ static void vault_clean(cad_hash_t *UNUSED(hash), int UNUSED(index), const char
    user->fn.free(&(user->fn));
 }
 
+static void vault_shrink(vault_impl_t *this) {
+   log_warning(this->log, "Dropping %u cached users (%u pinned by sessions are kept)", this->lru_count,
+               this->users->count(this->users) - this->lru_count);
+   while (this->lru_tail != NULL) {
+      cache_drop(this, this->lru_tail);
+   }
+   if (this->unknown_size > 0) {
+      clear_unknown(this);
+   }
+}
+
+/*
+ * The directory and all the shards are copied at the same time; done
+ * is called when the last copy ends.
+ */
+typedef struct {
+   cad_memory_t memory;
+   circus_database_done_fn done;
+   void *data;
+   int pending;
+   int status;
+} vault_backup_t;
+
+static void vault_backup_done(vault_backup_t *backup, int status) {
+   if (!status) {
+      backup->status = 0;
+   }
+   if (--backup->pending == 0) {
+      if (backup->done != NULL) {
+         backup->done(backup->data, backup->status);
+      }
+      backup->memory.free(backup);
+   }
+}
+
+static int vault_backup(vault_impl_t *this, circus_database_done_fn done, void *data) {
+   if (this->backup_path == NULL) {
+      log_error(this->log, "No backup path configured (vault.backup)");
+      return 0;
+   }
+   if (this->shards_count == 0) {
+      return this->database->backup(this->database, this->backup_path, done, data);
+   }
+
+   vault_backup_t *backup = memory_malloc(this->memory, sizeof(vault_backup_t));
+   assert(backup != NULL);
+   backup->memory = this->memory;
+   backup->done = done;
+   backup->data = data;
+   backup->pending = 1; // held until all the copies are started
+   backup->status = 1;
+
+   int started = 0;
+   int i;
+   for (i = -1; i < this->shards_count; i++) {
+      circus_database_t *database = i < 0 ? this->database : this->shards[i];
+      char *path = i < 0 ? szprintf(this->memory, NULL, "%s", this->backup_path) : szprintf(this->memory, NULL, "%s.%d", this->backup_path, i);
+      backup->pending++;
+      if (database->backup(database, path, (circus_database_done_fn)vault_backup_done, backup)) {
+         started++;
+      } else {
+         backup->pending--;
+         backup->status = 0;
+      }
+      this->memory.free(path);
+   }
+
+   if (started == 0) {
+      this->memory.free(backup);
+      return 0;
+   }
+   vault_backup_done(backup, 1);
+   return 1;
+}
+
+typedef struct {
+   circus_stats_fn fn;
+   void *data;
+   const char *prefix;
+} vault_stats_t;
+
+static void vault_stat(vault_stats_t *stats, const char *name, unsigned long value) {
+   char prefixed[128];
+   snprintf(prefixed, sizeof(prefixed), "%s.%s", stats->prefix, name);
+   stats->fn(stats->data, prefixed, value);
+}
+
+static void vault_stats(vault_impl_t *this, circus_stats_fn fn, void *data) {
+   vault_stats_t stats = { fn, data, "vault" };
+   char prefix[32];
+   int i;
+   fn(data, "vault.users.cached", this->users->count(this->users));
+   fn(data, "vault.users.pinned", this->users->count(this->users) - this->lru_count);
+   fn(data, "vault.users.unknown", this->unknown->count(this->unknown));
+   fn(data, "vault.users.unknown_hits", this->unknown_hits);
+   this->database->stats(this->database, (circus_stats_fn)vault_stat, &stats);
+   for (i = 0; i < this->shards_count; i++) {
+      snprintf(prefix, sizeof(prefix), "vault.shard%d", i);
+      stats.prefix = prefix;
+      this->shards[i]->stats(this->shards[i], (circus_stats_fn)vault_stat, &stats);
+   }
+}
+
+circus_database_t *vault_shard(vault_impl_t *vault, int64_t userid) {
+   if (vault->shards_count == 0) {
+      return vault->database;
+   }
+   return vault->shards[userid % vault->shards_count];
+}
+
+/*
+ * Called when a deferred write (see begin_deferred() and
+ * commit_deferred()) is durable, or lost
+ */
+void deferred_write_done(vault_impl_t *vault, int status) {
+   if (!status) {
+      log_error(vault->log, "Deferred vault write lost: the write group was rolled back");
+      vault->lost++;
+   }
+}
+
+static int vault_flush(vault_impl_t *this) {
+   int i;
+   // a failed commit rolls the group back: its writes are counted as lost
+   this->database->flush(this->database);
+   for (i = 0; i < this->shards_count; i++) {
+      this->shards[i]->flush(this->shards[i]);
+   }
+   int result = this->lost == 0;
+   this->lost = 0;
+   return result;
+}
+
 static void vault_free(vault_impl_t *this) {
+   int i;
+   stop_migrations(this);
    this->users->clean(this->users, (cad_hash_iterator_fn)vault_clean, this);
+   wipe_user_row(&(this->row));
+   if (this->row.buffer != NULL) {
+      this->memory.free(this->row.buffer);
+   }
    this->users->free(this->users);
-   this->database->free(this->database);
+   if (this->unknown_size > 0) {
+      clear_unknown(this);
+      this->memory.free(this->unknown_ring);
+   }
+   this->unknown->free(this->unknown);
+   for (i = 0; i < this->shards_count; i++) {
+      if (this->shards[i] != NULL) {
+         this->shards[i]->free(this->shards[i]);
+      }
+   }
+   if (this->shards != NULL) {
+      this->memory.free(this->shards);
+   }
+   if (this->database != NULL) {
+      this->database->free(this->database);
+   }
+   if (this->backup_path != NULL) {
+      this->memory.free(this->backup_path);
+   }
    this->memory.free(this);
 }
 
@@ -394,37 +924,168 @@ static circus_vault_t vault_fn = {
    (circus_vault_get_fn)vault_get,
    (circus_vault_new_fn)vault_new,
    (circus_vault_install_fn)vault_install,
+   (circus_vault_restore_fn)vault_restore,
+   (circus_vault_shrink_fn)vault_shrink,
+   (circus_vault_backup_fn)vault_backup,
+   (circus_vault_flush_fn)vault_flush,
+   (circus_vault_stats_fn)vault_stats,
    (circus_vault_free_fn)vault_free,
 };
 
-circus_vault_t *circus_vault(cad_memory_t memory, circus_log_t *log, circus_config_t *config, database_factory_fn db_factory) {
+/*
+ * Absolute paths are kept; relative paths are looked up in the XDG
+ * data directories.
+ */
+static char *vault_path(cad_memory_t memory, const char *filename) {
+   char *result;
+   if (filename[0] == '/') {
+      result = szprintf(memory, NULL, "%s", filename);
+   } else {
+      read_t read = read_xdg_file_from_dirs(memory, filename, xdg_data_dirs());
+      result = read.path;
+      if (read.file != NULL) {
+         int n = fclose(read.file);
+         assert(n == 0);
+      }
+   }
+   return result;
+}
+
+circus_vault_t *circus_vault(cad_memory_t memory, circus_log_t *log, circus_config_t *config, database_factory_fn db_factory, int migrate) {
    vault_impl_t *result = NULL;
    char *path;
    const char *filename = config->get(config, "vault", "filename");
+   const char *backup = config->get(config, "vault", "backup");
+   const char *shards = config->get(config, "vault", "shards");
+   const char *cache_size = config->get(config, "vault", "cache_size");
+   const char *cache_ttl = config->get(config, "vault", "cache_ttl");
+   const char *unknown_size = config->get(config, "vault", "unknown_cache_size");
+   const char *unknown_ttl = config->get(config, "vault", "unknown_cache_ttl");
+   unsigned long shards_count = 0, cache_size_count = CACHE_SIZE, cache_ttl_seconds = CACHE_TTL;
+   unsigned long unknown_size_count = UNKNOWN_CACHE_SIZE, unknown_ttl_seconds = UNKNOWN_CACHE_TTL;
+   int i, ok;
 
-   result = memory.malloc(sizeof(vault_impl_t));
+   if (shards != NULL && shards[0] != 0) {
+      char *end;
+      errno = 0;
+      shards_count = strtoul(shards, &end, 10);
+      if (errno != 0 || *end != 0 || shards_count > SHARDS_MAX) {
+         log_error(log, "Invalid vault shards: %s (max %d)", shards, SHARDS_MAX);
+         return NULL;
+      }
+   }
+   if (cache_size != NULL && cache_size[0] != 0) {
+      char *end;
+      errno = 0;
+      cache_size_count = strtoul(cache_size, &end, 10);
+      if (errno != 0 || *end != 0 || cache_size_count == 0 || cache_size_count > UINT_MAX) {
+         log_error(log, "Invalid vault cache_size: %s", cache_size);
+         return NULL;
+      }
+   }
+   if (cache_ttl != NULL && cache_ttl[0] != 0) {
+      char *end;
+      errno = 0;
+      cache_ttl_seconds = strtoul(cache_ttl, &end, 10);
+      if (errno != 0 || *end != 0 || cache_ttl_seconds > UINT64_MAX / 1000) {
+         log_error(log, "Invalid vault cache_ttl: %s", cache_ttl);
+         return NULL;
+      }
+   }
+   if (unknown_size != NULL && unknown_size[0] != 0) {
+      char *end;
+      errno = 0;
+      unknown_size_count = strtoul(unknown_size, &end, 10);
+      if (errno != 0 || *end != 0 || unknown_size_count > UINT_MAX) {
+         log_error(log, "Invalid vault unknown_cache_size: %s", unknown_size);
+         return NULL;
+      }
+   }
+   if (unknown_ttl != NULL && unknown_ttl[0] != 0) {
+      char *end;
+      errno = 0;
+      unknown_ttl_seconds = strtoul(unknown_ttl, &end, 10);
+      if (errno != 0 || *end != 0 || unknown_ttl_seconds > UINT64_MAX / 1000) {
+         log_error(log, "Invalid vault unknown_cache_ttl: %s", unknown_ttl);
+         return NULL;
+      }
+   }
+   if (unknown_ttl_seconds == 0) {
+      // nothing would be remembered
+      unknown_size_count = 0;
+   }
+
+   result = memory_malloc(memory, sizeof(vault_impl_t));
    assert(result != NULL);
    result->fn = vault_fn;
    result->memory = memory;
    result->log = log;
    result->users = cad_new_hash(memory, cad_hash_strings);
+   result->lru_head = NULL;
+   result->lru_tail = NULL;
+   result->lru_count = 0;
+   result->cache_size = (unsigned int)cache_size_count;
+   result->cache_ttl = (uint64_t)cache_ttl_seconds * 1000;
+   result->unknown = cad_new_hash(memory, cad_hash_strings);
+   result->unknown_size = (unsigned int)unknown_size_count;
+   result->unknown_ttl = (uint64_t)unknown_ttl_seconds * 1000;
+   result->unknown_next = 0;
+   result->unknown_hits = 0;
+   result->lost = 0;
+   result->unknown_ring = NULL;
+   if (result->unknown_size > 0) {
+      result->unknown_ring = memory_malloc(memory, result->unknown_size * sizeof(unknown_t*));
+      assert(result->unknown_ring != NULL);
+      memset(result->unknown_ring, 0, result->unknown_size * sizeof(unknown_t*));
+   }
+   memset(&(result->row), 0, sizeof(user_row_t));
+   result->shards_count = (int)shards_count;
+   result->shards = NULL;
+   result->migrator = NULL;
 
    if (filename == NULL || filename[0] == 0) {
       filename = "vault";
    }
-   if (filename[0] == '/') {
-      path = szprintf(memory, NULL, "%s", filename);
-   } else {
-      read_t read = read_xdg_file_from_dirs(memory, filename, xdg_data_dirs());
-      path = read.path;
-      if (read.file != NULL) {
-         int n = fclose(read.file);
-         assert(n == 0);
+   path = vault_path(memory, filename);
+   log_info(log, "Vault path is %s", path);
+   result->database = db_factory(memory, log, config, path);
+   ok = result->database != NULL;
+
+   if (shards_count > 0) {
+      // each shard has its own file, hence its own writer lock
+      result->shards = memory_malloc(memory, shards_count * sizeof(circus_database_t*));
+      assert(result->shards != NULL);
+      for (i = 0; i < (int)shards_count; i++) {
+         result->shards[i] = NULL;
+         if (ok) {
+            char *shard_path = szprintf(memory, NULL, "%s.%d", path, i);
+            result->shards[i] = db_factory(memory, log, config, shard_path);
+            memory.free(shard_path);
+            ok = result->shards[i] != NULL;
+         }
       }
+      log_info(log, "Vault has %lu shards", shards_count);
    }
-   log_info(log, "Vault path is %s", path);
-   result->database = db_factory(memory, log, path);
    memory.free(path);
 
+   if (backup == NULL || backup[0] == 0) {
+      result->backup_path = NULL;
+   } else {
+      result->backup_path = vault_path(memory, backup);
+      log_info(log, "Vault backup path is %s", result->backup_path);
+   }
+
+   if (ok) {
+      ok = check_shards(log, result->database, result->shards_count, 0);
+   }
+   if (ok && migrate) {
+      ok = start_migrations(result);
+   }
+
+   if (!ok) {
+      vault_free(result);
+      return NULL;
+   }
+
    return I(result);
 }
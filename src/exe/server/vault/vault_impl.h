@@ -29,12 +29,23 @@
  * #include <circus_vault.h>
  */
 
-#define DB_VERSION "1"
+/*
+ * Older vaults are migrated at startup, see vault_migration.c
+ */
+#define DB_VERSION "4"
 
 #define PERMISSION_REVOKED  0
 #define PERMISSION_USER     1
 #define PERMISSION_ADMIN    2
 
+#define SHARDS_MAX 64
+
+#define CACHE_SIZE 1024 // users
+#define CACHE_TTL  3600 // seconds
+
+#define UNKNOWN_CACHE_SIZE 4096 // usernames
+#define UNKNOWN_CACHE_TTL  300  // seconds
+
 #define META_SCHEMA                                          \
    "CREATE TABLE IF NOT EXISTS META (\n"                     \
    "  KEY           TEXT PRIMARY KEY,\n"                     \
@@ -53,11 +64,23 @@
    "  PWDVALID      INTEGER,\n"                              \
    "  KEYSALT       TEXT NOT NULL,\n"                        \
    "  HASHKEY       TEST NOT NULL\n"                         \
-   ");\n"                                                    \
+   ");"
+
+/*
+ * USERS_IX and KEYS_IX exist in all the vaults since version
+ * NAMES_VERSION
+ */
+#define NAMES_VERSION 4
+#define USERS_INDEX                                          \
    "CREATE UNIQUE INDEX IF NOT EXISTS USERS_IX ON USERS (\n" \
    "  USERNAME\n"                                            \
    ");"
 
+#define USERS_PWDVALID_INDEX                                 \
+   "CREATE INDEX IF NOT EXISTS USERS_PWDVALID_IX ON USERS (\n" \
+   "  PWDVALID\n"                                            \
+   ");"
+
 #define KEYS_SCHEMA                                          \
    "CREATE TABLE IF NOT EXISTS KEYS (\n"                     \
    "  KEYID         INTEGER PRIMARY KEY AUTOINCREMENT,\n"    \
@@ -66,32 +89,116 @@
    "  SALT          TEXT NOT NULL,\n"                        \
    "  STRETCH       INTEGER NOT NULL,\n"                     \
    "  VALUE         TEXT NOT NULL\n"                         \
-   ");\n"                                                    \
+   ");"
+
+#define KEYS_INDEX                                           \
    "CREATE UNIQUE INDEX IF NOT EXISTS KEYS_IX ON KEYS (\n"   \
    "  USERID,\n"                                             \
    "  KEYNAME\n"                                             \
    ");"
 
+/*
+ * USERID is denormalized from KEYS, so that the tags of a user can be
+ * found by a range scan of TAGS_IX (since version TAGS_VERSION)
+ */
+#define TAGS_VERSION 2
 #define TAGS_SCHEMA                                          \
    "CREATE TABLE IF NOT EXISTS TAGS (\n"                     \
    "  TAGID         INTEGER PRIMARY KEY AUTOINCREMENT,\n"    \
    "  KEYID         INTEGER NOT NULL,\n"                     \
+   "  USERID        INTEGER NOT NULL,\n"                     \
    "  NAME          TEXT NOT NULL,\n"                        \
    "  VALUE         TEXT NOT NULL\n"                         \
-   ");\n"                                                    \
+   ");"
+
+#define TAGS_INDEX                                           \
    "CREATE UNIQUE INDEX IF NOT EXISTS TAGS_IX ON TAGS (\n"   \
+   "  USERID,\n"                                             \
+   "  NAME,\n"                                               \
    "  KEYID\n"                                               \
    ");"
 
+/*
+ * A USERS row, with everything needed to authenticate a user and to
+ * unlock their symmetric key. The strings point into a buffer reused
+ * from one load to the next, and wiped after use.
+ */
+typedef struct {
+   int64_t userid;
+   int permissions;
+   uint64_t validity;
+   uint64_t stretch;
+   const char *email; // may be NULL
+   const char *pwdsalt;
+   const char *hashpwd;
+   const char *keysalt;
+   size_t keysalt_len;
+   const char *hashkey;
+   size_t hashkey_len;
+   char *buffer;
+   size_t size;
+   size_t capacity;
+} user_row_t;
+
+typedef struct migrator_s migrator_t;
+typedef struct user_impl_s user_impl_t;
+typedef struct unknown_s unknown_t;
+
 typedef struct {
    circus_vault_t fn;
    cad_memory_t memory;
    circus_log_t *log;
-   circus_database_t *database;
-   cad_hash_t *users;
+   circus_database_t *database; // the directory: META and USERS, and also KEYS and TAGS if not sharded
+   circus_database_t **shards; // KEYS and TAGS, by USERID modulo shards_count
+   int shards_count; // 0 = not sharded
+   cad_hash_t *users; // all the cached users, by name
+   user_impl_t *lru_head; // the unpinned users, most recently used first
+   user_impl_t *lru_tail;
+   unsigned int lru_count;
+   unsigned int cache_size; // max unpinned users
+   uint64_t cache_ttl; // ms; 0 = no idle eviction
+   cad_hash_t *unknown; // the usernames recently not found, by name
+   unknown_t **unknown_ring; // the same, in insertion order from unknown_next (oldest evicted first)
+   unsigned int unknown_size; // max unknown usernames; 0 = no negative cache
+   unsigned int unknown_next;
+   uint64_t unknown_ttl; // ms
+   unsigned long unknown_hits;
+   int lost; // deferred writes lost since the previous flush
+   user_row_t row;
+   char *backup_path;
+   migrator_t *migrator; // NULL if no migration is running
 } vault_impl_t;
 
 typedef struct {
+   circus_key_t fn;
+   cad_memory_t memory;
+   circus_log_t *log;
+   int64_t keyid;
+   user_impl_t *user;
+   uint64_t stretch;
+} key_impl_t;
+
+/*
+ * The known keys of a user: entries sorted by name, the names being
+ * stored one after the other in a single pool. Once complete (all the
+ * user keys preloaded), the index is authoritative.
+ */
+typedef struct {
+   int64_t keyid;
+   size_t name; // offset in the names pool
+} key_entry_t;
+
+typedef struct {
+   key_entry_t *entries;
+   unsigned int count;
+   unsigned int capacity;
+   char *names;
+   size_t names_size;
+   size_t names_capacity;
+   int complete;
+} key_index_t;
+
+struct user_impl_s {
    circus_user_t fn;
    cad_memory_t memory;
    circus_log_t *log;
@@ -102,27 +209,49 @@ typedef struct {
    char *email;
    char *symmkey;
    vault_impl_t *vault;
-   cad_hash_t *keys;
-   uint64_t stretch;
-} user_impl_t;
-
-typedef struct {
-   circus_key_t fn;
-   cad_memory_t memory;
-   circus_log_t *log;
-   int64_t keyid;
-   user_impl_t *user;
+   circus_database_t *database; // where the user KEYS and TAGS are
+   key_index_t keys;
+   key_impl_t key; // the key returned by get() and new(), valid until the next call
    uint64_t stretch;
-} key_impl_t;
+   unsigned int pins; // the sessions using the user; pinned users are not in the LRU
+   user_impl_t *lru_prev;
+   user_impl_t *lru_next;
+   uint64_t last_used; // ms, loop time
+};
 
 user_impl_t *new_vault_user(cad_memory_t memory, circus_log_t *log, int64_t userid, uint64_t validity, int permissions,
                             const char *email, const char *name, vault_impl_t *vault);
-key_impl_t *new_vault_key(cad_memory_t memory, circus_log_t *log, int64_t keyid, user_impl_t *user);
+void init_vault_key(key_impl_t *key, cad_memory_t memory, circus_log_t *log, user_impl_t *user);
 
-user_impl_t *check_user_password(user_impl_t *user, const char *password);
+user_impl_t *check_user_password(user_impl_t *user, user_row_t *row, const char *password);
 int set_symmetric_key(user_impl_t *user, const char *password);
 
+void deferred_write_done(vault_impl_t *vault, int status);
+circus_database_t *vault_shard(vault_impl_t *vault, int64_t userid);
+void vault_pin_user(vault_impl_t *vault, user_impl_t *user);
+void vault_unpin_user(vault_impl_t *vault, user_impl_t *user);
+
 uint64_t get_stretch_threshold(circus_log_t *log, circus_database_t *database);
 int set_stretch_threshold(circus_log_t *log, circus_database_t *database, uint64_t stretch_threshold);
+/*
+ * Check that the vault was installed with the given number of shards
+ * (recorded in META at install time; vaults without it are not
+ * sharded)
+ */
+int check_shards(circus_log_t *log, circus_database_t *database, int shards, int install);
+int has_meta(circus_database_t *database);
+
+int start_migrations(vault_impl_t *vault);
+void stop_migrations(vault_impl_t *vault);
+/*
+ * The version recorded in META, not changed by the background
+ * migration until it is done; 0 if not installed, -1 on error
+ */
+int vault_version(vault_impl_t *vault);
+/*
+ * True if the vault is at least at the given version, i.e. not
+ * migrating to it (or beyond) in the background. Logs an error if not.
+ */
+int vault_migrated(vault_impl_t *vault, int version, const char *what);
 
 #endif /* __CIRCUS_VAULT_IMPL_H */
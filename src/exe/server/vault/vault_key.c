@@ -29,7 +29,7 @@ static char *vault_key_get_password(key_impl_t *this) {
    char *enckey = this->user->symmkey;
    if (enckey != NULL) {
       static const char *sql = "SELECT SALT, VALUE FROM KEYS WHERE KEYID=?";
-      circus_database_query_t *q = this->user->vault->database->query(this->user->vault->database, sql);
+      circus_database_query_t *q = this->user->database->query(this->user->database, sql);
       int ok;
       if (q != NULL) {
          ok = q->set_int(q, 0, this->keyid);
@@ -39,9 +39,10 @@ static char *vault_key_get_password(key_impl_t *this) {
                while (rs->has_next(rs)) {
                   rs->next(rs);
                   if (result == NULL) {
+                     size_t value_len;
                      const char *salt = rs->get_string(rs, 0);
-                     const char *value = rs->get_string(rs, 1);
-                     char *decvalue = decrypted(this->memory, this->log, value, enckey);
+                     const char *value = rs->get_string_len(rs, 1, &value_len);
+                     char *decvalue = value_len == 0 ? NULL : decrypted_len(this->memory, this->log, value, value_len, enckey);
                      if (decvalue != NULL) {
                         result = unsalted(this->memory, this->log, salt, decvalue);
                         this->memory.free(decvalue);
@@ -86,14 +87,21 @@ static int vault_key_set_password(key_impl_t *this, const char *password) {
    } else {
       assert(keysalt != NULL);
       static const char *sql = "UPDATE KEYS SET SALT=?, VALUE=? WHERE KEYID=?";
-      circus_database_query_t *q = this->user->vault->database->query(this->user->vault->database, sql);
+      circus_database_t *database = this->user->database;
+      circus_database_query_t *q = NULL;
+      if (database->begin_deferred(database)) {
+         q = database->query(database, sql);
+         if (q == NULL) {
+            database->rollback(database);
+         }
+      }
       if (q != NULL) {
          int ok = 1;
          if (ok) {
-            ok = q->set_string(q, 0, keysalt);
+            ok = q->set_string_static(q, 0, keysalt, -1);
          }
          if (ok) {
-            ok = q->set_string(q, 1, encpwd);
+            ok = q->set_string_static(q, 1, encpwd, -1);
          }
          if (ok) {
             ok = q->set_int(q, 2, this->keyid);
@@ -107,33 +115,113 @@ static int vault_key_set_password(key_impl_t *this, const char *password) {
             }
          }
 
-         this->memory.free(encpwd);
-         this->memory.free(keysalt);
-
          q->free(q);
+
+         if (result) {
+            result = database->commit_deferred(database, (circus_database_done_fn)deferred_write_done, this->user->vault);
+         } else {
+            database->rollback(database);
+         }
+      }
+      this->memory.free(encpwd);
+      this->memory.free(keysalt);
+   }
+   return result;
+}
+
+static int update_tag(key_impl_t *this, const char *sql, const char *tag) {
+   int result = 0;
+   circus_database_t *database = this->user->database;
+   if (!vault_migrated(this->user->vault, TAGS_VERSION, "tags")) {
+      return 0;
+   }
+   if (!database->begin_deferred(database)) {
+      return 0;
+   }
+   circus_database_query_t *q = database->query(database, sql);
+   if (q != NULL) {
+      int ok = q->set_int(q, 0, this->user->userid);
+      if (ok) {
+         ok = q->set_string_static(q, 1, tag, -1);
+      }
+      if (ok) {
+         ok = q->set_int(q, 2, this->keyid);
+      }
+      if (ok) {
+         circus_database_resultset_t *rs = q->run(q);
+         if (rs != NULL) {
+            result = !rs->has_error(rs);
+            rs->free(rs);
+         }
+      }
+      q->free(q);
+   }
+   if (result) {
+      result = database->commit_deferred(database, (circus_database_done_fn)deferred_write_done, this->user->vault);
+   } else {
+      database->rollback(database);
+   }
+   return result;
+}
+
+static int vault_key_tag(key_impl_t *this, const char *tag) {
+   assert(tag != NULL && tag[0] != 0);
+   static const char *sql = "INSERT OR IGNORE INTO TAGS (USERID, NAME, KEYID, VALUE) VALUES (?, ?, ?, '')";
+   return update_tag(this, sql, tag);
+}
+
+static int vault_key_untag(key_impl_t *this, const char *tag) {
+   assert(tag != NULL && tag[0] != 0);
+   static const char *sql = "DELETE FROM TAGS WHERE USERID=? AND NAME=? AND KEYID=?";
+   return update_tag(this, sql, tag);
+}
+
+static int vault_key_get_tags(key_impl_t *this, circus_key_tags_fn fn, void *data) {
+   int result = 0;
+   circus_database_t *database = this->user->database;
+   if (!vault_migrated(this->user->vault, TAGS_VERSION, "tags")) {
+      return 0;
+   }
+   static const char *sql = "SELECT NAME FROM TAGS WHERE USERID=? AND KEYID=? ORDER BY NAME";
+   circus_database_query_t *q = database->query(database, sql);
+   if (q != NULL) {
+      if (q->set_int(q, 0, this->user->userid) && q->set_int(q, 1, this->keyid)) {
+         circus_database_resultset_t *rs = q->run(q);
+         if (rs != NULL) {
+            while (rs->has_next(rs)) {
+               rs->next(rs);
+               fn(data, rs->get_string(rs, 0));
+            }
+            result = !rs->has_error(rs);
+            if (!result) {
+               log_error(this->log, "Could not list the tags of key %"PRId64, this->keyid);
+            }
+            rs->free(rs);
+         }
       }
+      q->free(q);
    }
    return result;
 }
 
-static void vault_key_free(key_impl_t *this) {
-   this->memory.free(this);
+static void vault_key_free(key_impl_t *UNUSED(this)) {
+   // do nothing: the key belongs to its user
 }
 
 static circus_key_t vault_key_fn = {
    (circus_key_get_password_fn)vault_key_get_password,
    (circus_key_set_password_fn)vault_key_set_password,
+   (circus_key_tag_fn)vault_key_tag,
+   (circus_key_untag_fn)vault_key_untag,
+   (circus_key_get_tags_fn)vault_key_get_tags,
    (circus_key_free_fn)vault_key_free,
 };
 
-key_impl_t *new_vault_key(cad_memory_t memory, circus_log_t *log, int64_t keyid, user_impl_t *user) {
-   key_impl_t *result = memory.malloc(sizeof(key_impl_t));
-   if (result != NULL) {
-      result->fn = vault_key_fn;
-      result->memory = memory;
-      result->log = log;
-      result->keyid = keyid;
-      result->user = user;
-   }
-   return result;
+void init_vault_key(key_impl_t *key, cad_memory_t memory, circus_log_t *log, user_impl_t *user) {
+   key->fn = vault_key_fn;
+   key->memory = memory;
+   key->log = log;
+   key->keyid = 0;
+   key->user = user;
+   key->stretch = 0;
 }
@@ -31,7 +31,7 @@ uint64_t get_stretch_threshold(circus_log_t *log, circus_database_t *database) {
    uint64_t result = DEFAULT_STRETCH;
 
    if (q != NULL) {
-      ok = q->set_string(q, 0, "STRETCH");
+      ok = q->set_string_static(q, 0, "STRETCH", -1);
       if (ok) {
          circus_database_resultset_t *rs = q->run(q);
          if (rs != NULL) {
@@ -68,7 +68,7 @@ int set_stretch_threshold(circus_log_t *log, circus_database_t *database, uint64
    if (q == NULL) {
       ok = 0;
    } else {
-      ok = q->set_string(q, 0, "STRETCH");
+      ok = q->set_string_static(q, 0, "STRETCH", -1);
       if (ok) {
          ok = q->set_int(q, 1, (int64_t)stretch_threshold);
          if (ok) {
@@ -89,3 +89,90 @@ int set_stretch_threshold(circus_log_t *log, circus_database_t *database, uint64
 
    return ok;
 }
+
+static int get_shards(circus_log_t *log, circus_database_t *database, int64_t *shards) {
+   static const char *sql = "SELECT VALUE FROM META WHERE KEY='SHARDS'";
+   circus_database_query_t *q = database->query(database, sql);
+   int result = -1;
+
+   if (q != NULL) {
+      circus_database_resultset_t *rs = q->run(q);
+      if (rs != NULL) {
+         if (rs->has_next(rs)) {
+            rs->next(rs);
+            *shards = rs->get_int(rs, 0);
+            result = 1;
+         } else if (!rs->has_error(rs)) {
+            result = 0;
+         }
+         rs->free(rs);
+      }
+      q->free(q);
+   }
+
+   if (result < 0) {
+      log_error(log, "Could not read SHARDS from META");
+   }
+   return result;
+}
+
+int has_meta(circus_database_t *database) {
+   static const char *sql = "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='META'";
+   circus_database_query_t *q = database->query(database, sql);
+   int result = 0;
+
+   if (q != NULL) {
+      circus_database_resultset_t *rs = q->run(q);
+      if (rs != NULL) {
+         if (rs->has_next(rs)) {
+            rs->next(rs);
+            result = rs->get_int(rs, 0) > 0;
+         }
+         rs->free(rs);
+      }
+      q->free(q);
+   }
+
+   return result;
+}
+
+int check_shards(circus_log_t *log, circus_database_t *database, int shards, int install) {
+   int64_t expected = 0;
+   int found;
+
+   if (!install && !has_meta(database)) {
+      // not installed yet
+      return 1;
+   }
+
+   found = get_shards(log, database, &expected);
+   if (found < 0) {
+      return 0;
+   }
+   if (!found && install) {
+      static const char *sql = "INSERT INTO META (KEY, VALUE) VALUES ('SHARDS', ?)";
+      circus_database_query_t *q = database->query(database, sql);
+      int ok = 0;
+      if (q != NULL) {
+         if (q->set_int(q, 0, shards)) {
+            circus_database_resultset_t *rs = q->run(q);
+            if (rs != NULL) {
+               ok = !rs->has_error(rs);
+               rs->free(rs);
+            }
+         }
+         q->free(q);
+      }
+      if (!ok) {
+         log_error(log, "Could not set SHARDS in META");
+         return 0;
+      }
+      expected = shards;
+   }
+
+   if (expected != shards) {
+      log_error(log, "The vault has %"PRId64" shards but %d are configured", expected, shards);
+      return 0;
+   }
+   return 1;
+}
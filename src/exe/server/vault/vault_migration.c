@@ -0,0 +1,398 @@
+/*
+    This file is part of Circus.
+
+    Circus is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License.
+
+    Circus is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Circus.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include <circus.h>
+#include <circus_log.h>
+#include <circus_memory.h>
+#include <circus_vault.h>
+
+#include "vault_impl.h"
+
+#define MIGRATION_BATCH 256
+#define MIGRATION_INTERVAL 10 // ms between two steps
+
+/*
+ * A migration brings the vault from one version to the next, in
+ * steps, each one in its own transaction:
+ * - ddl: run once, first
+ * - batch: run while pending returns a row; each run rewrites at most
+ *   MIGRATION_BATCH rows (bound to the only parameter). Batches are
+ *   resumable: the pending rows are found from the data itself.
+ * - check: run before finish, each one returns the rows that prevent
+ *   it (name and count); the migration stops if there are any
+ * - finish: run once, last, together with the version bump
+ *
+ * The ddl step is recorded in META (KEY 'MIGRATION') so that it is
+ * not run twice if the server stops in the middle of a migration.
+ *
+ * Sharded migrations touch KEYS or TAGS. Shards exist only in vaults
+ * installed at a version that has none left to run.
+ */
+typedef struct {
+   const char *what;
+   const char *ddl;
+   const char *pending;
+   const char *batch;
+   const char *check[3];
+   const char *finish[4];
+   int sharded;
+} migration_t;
+
+static const migration_t migrations[] = {
+   // 1 -> 2
+   {
+      "user tags",
+      "ALTER TABLE TAGS ADD COLUMN USERID INTEGER NOT NULL DEFAULT 0",
+      "SELECT 1 FROM TAGS WHERE USERID=0 LIMIT 1",
+      "UPDATE TAGS SET USERID=COALESCE((SELECT USERID FROM KEYS WHERE KEYS.KEYID=TAGS.KEYID), -1) "
+      "WHERE TAGID IN (SELECT TAGID FROM TAGS WHERE USERID=0 LIMIT ?)",
+      {
+         NULL,
+      },
+      {
+         "DROP INDEX IF EXISTS TAGS_IX",
+         // the same tag twice on a key is only noise
+         "DELETE FROM TAGS WHERE TAGID NOT IN (SELECT MIN(TAGID) FROM TAGS GROUP BY USERID, NAME, KEYID)",
+         TAGS_INDEX,
+         NULL,
+      },
+      1,
+   },
+   // 2 -> 3
+   {
+      "password validity index",
+      NULL,
+      NULL,
+      NULL,
+      {
+         NULL,
+      },
+      {
+         USERS_PWDVALID_INDEX,
+         NULL,
+      },
+      0,
+   },
+   // 3 -> 4: version 1 vaults were installed without USERS_IX nor
+   // KEYS_IX (only the first statement of each schema was run). The
+   // duplicates are not merged: each one may hold its own passwords.
+   {
+      "unique user and key names",
+      NULL,
+      NULL,
+      NULL,
+      {
+         "SELECT 'user ' || USERNAME, COUNT(*) FROM USERS GROUP BY USERNAME HAVING COUNT(*) > 1",
+         "SELECT 'key ' || KEYNAME || ' of user ' || USERID, COUNT(*) FROM KEYS GROUP BY USERID, KEYNAME HAVING COUNT(*) > 1",
+         NULL,
+      },
+      {
+         USERS_INDEX,
+         KEYS_INDEX,
+         NULL,
+      },
+      1,
+   },
+};
+
+#define MIGRATIONS_COUNT ((int)(sizeof(migrations) / sizeof(migration_t)))
+
+struct migrator_s {
+   cad_memory_t memory; // the vault may be gone when the timer is closed
+   vault_impl_t *vault;
+   int version;
+   int ddl_done;
+   uint64_t start;
+   uv_timer_t timer;
+};
+
+static int get_version(circus_log_t *log, circus_database_t *database, int *version, int *ddl_done) {
+   static const char *sql = "SELECT KEY, VALUE FROM META WHERE KEY IN ('VERSION', 'MIGRATION')";
+   circus_database_query_t *q = database->query(database, sql);
+   int result = 0;
+
+   *version = 0;
+   *ddl_done = 0;
+   if (q != NULL) {
+      circus_database_resultset_t *rs = q->run(q);
+      if (rs != NULL) {
+         while (rs->has_next(rs)) {
+            rs->next(rs);
+            if (!strcmp(rs->get_string(rs, 0), "VERSION")) {
+               *version = (int)rs->get_int(rs, 1);
+            } else {
+               *ddl_done = 1;
+            }
+         }
+         result = !rs->has_error(rs);
+         rs->free(rs);
+      }
+      q->free(q);
+   }
+
+   if (!result) {
+      log_error(log, "Could not read the vault version");
+   } else if (*version == 0) {
+      log_error(log, "Missing VERSION in META");
+      result = 0;
+   }
+   return result;
+}
+
+static int has_pending(circus_database_t *database, const char *sql, int *pending) {
+   circus_database_query_t *q = database->query(database, sql);
+   int result = 0;
+   if (q != NULL) {
+      circus_database_resultset_t *rs = q->run(q);
+      if (rs != NULL) {
+         *pending = rs->has_next(rs);
+         result = !rs->has_error(rs);
+         rs->free(rs);
+      }
+      q->free(q);
+   }
+   return result;
+}
+
+static int run_batch(circus_database_t *database, const char *sql) {
+   circus_database_query_t *q = database->query(database, sql);
+   int result = 0;
+   if (q != NULL) {
+      if (q->set_int(q, 0, MIGRATION_BATCH)) {
+         circus_database_resultset_t *rs = q->run(q);
+         if (rs != NULL) {
+            result = !rs->has_error(rs);
+            rs->free(rs);
+         }
+      }
+      q->free(q);
+   }
+   return result;
+}
+
+static int check_duplicates(circus_log_t *log, circus_database_t *database, const char *sql, int version) {
+   circus_database_query_t *q = database->query(database, sql);
+   int result = 0;
+   if (q != NULL) {
+      circus_database_resultset_t *rs = q->run(q);
+      if (rs != NULL) {
+         result = 1;
+         while (rs->has_next(rs)) {
+            rs->next(rs);
+            log_pii(log, "Duplicate %s (%"PRId64" rows)", rs->get_string(rs, 0), rs->get_int(rs, 1));
+            result = 0;
+         }
+         if (rs->has_error(rs)) {
+            result = 0;
+         } else if (!result) {
+            log_error(log, "Vault migration to version %d: duplicate rows must be removed by hand first", version);
+         }
+         rs->free(rs);
+      }
+      q->free(q);
+   }
+   return result;
+}
+
+static int set_version(circus_database_t *database, int version) {
+   static const char *sql = "UPDATE META SET VALUE=? WHERE KEY='VERSION'";
+   circus_database_query_t *q = database->query(database, sql);
+   int result = 0;
+   if (q != NULL) {
+      if (q->set_int(q, 0, version)) {
+         circus_database_resultset_t *rs = q->run(q);
+         if (rs != NULL) {
+            result = !rs->has_error(rs);
+            rs->free(rs);
+         }
+      }
+      q->free(q);
+   }
+   return result;
+}
+
+/*
+ * One step per tick, so that requests are served in between.
+ */
+static int migration_step(migrator_t *this) {
+   circus_log_t *log = this->vault->log;
+   circus_database_t *database = this->vault->database;
+   const migration_t *migration = &(migrations[this->version - 1]);
+   int ok, pending = 0, i;
+
+   if (!this->ddl_done && migration->ddl == NULL) {
+      this->ddl_done = 1;
+   }
+   if (!this->ddl_done) {
+      if (!database->begin(database)) {
+         return 0;
+      }
+      ok = database_exec(log, database, migration->ddl);
+      if (ok) {
+         ok = database_exec(log, database, "INSERT OR REPLACE INTO META (KEY, VALUE) VALUES ('MIGRATION', 'ddl')");
+      }
+      if (ok) {
+         ok = database->commit(database);
+         this->ddl_done = ok;
+      } else {
+         database->rollback(database);
+      }
+      return ok;
+   }
+
+   if (migration->pending != NULL) {
+      ok = has_pending(database, migration->pending, &pending);
+      if (ok && pending) {
+         if (!database->begin(database)) {
+            return 0;
+         }
+         ok = run_batch(database, migration->batch);
+         if (ok) {
+            ok = database->commit(database);
+         } else {
+            database->rollback(database);
+         }
+      }
+      if (!ok || pending) {
+         return ok;
+      }
+   }
+
+   for (i = 0; migration->check[i] != NULL; i++) {
+      if (!check_duplicates(log, database, migration->check[i], this->version + 1)) {
+         return 0;
+      }
+   }
+
+   if (!database->begin(database)) {
+      return 0;
+   }
+   ok = 1;
+   for (i = 0; ok && migration->finish[i] != NULL; i++) {
+      ok = database_exec(log, database, migration->finish[i]);
+   }
+   if (ok) {
+      ok = set_version(database, this->version + 1);
+   }
+   if (ok) {
+      ok = database_exec(log, database, "DELETE FROM META WHERE KEY='MIGRATION'");
+   }
+   if (ok) {
+      ok = database->commit(database);
+   } else {
+      database->rollback(database);
+   }
+   if (ok) {
+      this->version++;
+      this->ddl_done = 0;
+      log_info(log, "Vault migrated to version %d (%s) after %"PRIu64" ms", this->version, migration->what,
+               (uv_hrtime() - this->start) / 1000000);
+   }
+   return ok;
+}
+
+static void on_migration_timer(uv_timer_t *timer) {
+   migrator_t *this = timer->data;
+   if (!migration_step(this)) {
+      log_error(this->vault->log, "Vault migration to version %d failed; it will be resumed at the next start", this->version + 1);
+      uv_timer_stop(timer);
+   } else if (this->version > MIGRATIONS_COUNT) {
+      log_info(this->vault->log, "Vault migration done");
+      uv_timer_stop(timer);
+   }
+}
+
+int start_migrations(vault_impl_t *this) {
+   int version, ddl_done, i;
+
+   this->migrator = NULL;
+   assert(atoi(DB_VERSION) == MIGRATIONS_COUNT + 1);
+
+   if (!has_meta(this->database)) {
+      // not installed yet
+      return 1;
+   }
+   if (!get_version(this->log, this->database, &version, &ddl_done)) {
+      return 0;
+   }
+   if (version > MIGRATIONS_COUNT + 1) {
+      log_error(this->log, "Vault version %d is newer than the supported version %s", version, DB_VERSION);
+      return 0;
+   }
+   if (version == MIGRATIONS_COUNT + 1) {
+      return 1;
+   }
+   if (this->shards_count > 0) {
+      for (i = version - 1; i < MIGRATIONS_COUNT; i++) {
+         if (migrations[i].sharded) {
+            log_error(this->log, "Vault version %d: cannot migrate the shards (%s)", version, migrations[i].what);
+            return 0;
+         }
+      }
+   }
+
+   migrator_t *migrator = memory_malloc(this->memory, sizeof(migrator_t));
+   assert(migrator != NULL);
+   migrator->memory = this->memory;
+   migrator->vault = this;
+   migrator->version = version;
+   migrator->ddl_done = ddl_done;
+   migrator->start = uv_hrtime();
+   uv_timer_init(uv_default_loop(), &(migrator->timer));
+   migrator->timer.data = migrator;
+   // the migration does not keep the loop alive by itself (--install command line)
+   uv_unref((uv_handle_t*)&(migrator->timer));
+   uv_timer_start(&(migrator->timer), on_migration_timer, 0, MIGRATION_INTERVAL);
+   this->migrator = migrator;
+
+   log_warning(this->log, "Vault version %d: migrating to version %s in the background", version, DB_VERSION);
+   return 1;
+}
+
+int vault_version(vault_impl_t *this) {
+   int version, ddl_done;
+   if (!has_meta(this->database)) {
+      return 0;
+   }
+   return get_version(this->log, this->database, &version, &ddl_done) ? version : -1;
+}
+
+int vault_migrated(vault_impl_t *this, int version, const char *what) {
+   if (this->migrator == NULL || this->migrator->version >= version) {
+      return 1;
+   }
+   log_error(this->log, "Vault version %d: %s not available before version %d", this->migrator->version, what, version);
+   return 0;
+}
+
+static void on_close(uv_handle_t *handle) {
+   migrator_t *migrator = handle->data;
+   migrator->memory.free(migrator);
+}
+
+void stop_migrations(vault_impl_t *this) {
+   if (this->migrator != NULL) {
+      // the loop keeps a pointer to the timer until it is closed
+      uv_close((uv_handle_t*)&(this->migrator->timer), on_close);
+      this->migrator = NULL;
+   }
+}
@@ -20,10 +20,11 @@
 
 #include <circus.h>
 #include <circus_crypt.h>
+#include <circus_vault.h>
 
 #include "vault_pass.h"
 
-static int pass_stretch(cad_memory_t memory, circus_log_t *log, hashing_t *hashing) {
+int pass_stretch(cad_memory_t memory, circus_log_t *log, hashing_t *hashing) {
    assert(hashing != NULL);
    assert(hashing->stretch >= DEFAULT_STRETCH);
    assert(hashing->clear != NULL && hashing->clear[0] != '\0');
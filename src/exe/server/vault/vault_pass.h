@@ -37,6 +37,11 @@ typedef struct {
    char *hashed;
 } hashing_t;
 
+/*
+ * Stretch the clear value with the given salt into hashed, which must
+ * be NULL
+ */
+int pass_stretch(cad_memory_t memory, circus_log_t *log, hashing_t *hashing);
 int pass_hash(cad_memory_t memory, circus_log_t *log, hashing_t *hashing);
 int pass_compare(cad_memory_t memory, circus_log_t *log, hashing_t *hashing, uint64_t min_stretch);
 
@@ -20,12 +20,144 @@
 
 #include <circus_crypt.h>
 #include <circus_log.h>
+#include <circus_memory.h>
 #include <circus_time.h>
 #include <circus_vault.h>
 
 #include "vault_impl.h"
 #include "vault_pass.h"
 
+/*
+ * Binary search in the key index.
+ * Returns true if found; in all cases, *pos is the position of the key
+ * (or where it should be inserted).
+ */
+static int key_index_find(key_index_t *index, const char *keyname, unsigned int *pos) {
+   unsigned int lo = 0, hi = index->count;
+   while (lo < hi) {
+      unsigned int mid = lo + (hi - lo) / 2;
+      int cmp = strcmp(index->names + index->entries[mid].name, keyname);
+      if (cmp == 0) {
+         *pos = mid;
+         return 1;
+      }
+      if (cmp < 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   *pos = lo;
+   return 0;
+}
+
+static void key_index_insert(cad_memory_t memory, key_index_t *index, unsigned int pos, int64_t keyid, const char *keyname, size_t len) {
+   size_t n = len + 1;
+   if (index->names_size + n > index->names_capacity) {
+      size_t capacity = index->names_capacity == 0 ? 256 : index->names_capacity * 2;
+      while (index->names_size + n > capacity) {
+         capacity *= 2;
+      }
+      index->names = memory_realloc(memory, index->names, capacity);
+      assert(index->names != NULL);
+      index->names_capacity = capacity;
+   }
+   if (index->count == index->capacity) {
+      unsigned int capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+      index->entries = memory_realloc(memory, index->entries, capacity * sizeof(key_entry_t));
+      assert(index->entries != NULL);
+      index->capacity = capacity;
+   }
+   memmove(index->entries + pos + 1, index->entries + pos, (index->count - pos) * sizeof(key_entry_t));
+   index->entries[pos].keyid = keyid;
+   index->entries[pos].name = index->names_size;
+   index->count++;
+   memcpy(index->names + index->names_size, keyname, len);
+   index->names[index->names_size + len] = 0;
+   index->names_size += n;
+}
+
+/*
+ * Load all the user key names at once (a single scan of KEYS_IX)
+ */
+static int key_index_preload(user_impl_t *this) {
+   static const char *sql = "SELECT KEYID, KEYNAME FROM KEYS WHERE USERID=? ORDER BY KEYNAME";
+   int result = 0;
+   unsigned int pos;
+   size_t len;
+   circus_database_query_t *q = this->database->query(this->database, sql);
+   if (q != NULL) {
+      if (q->set_int(q, 0, this->userid)) {
+         circus_database_resultset_t *rs = q->run(q);
+         if (rs != NULL) {
+            while (rs->has_next(rs)) {
+               rs->next(rs);
+               int64_t keyid = rs->get_int(rs, 0);
+               const char *keyname = rs->get_string_len(rs, 1, &len);
+               if (!key_index_find(&(this->keys), keyname, &pos)) {
+                  key_index_insert(this->memory, &(this->keys), pos, keyid, keyname, len);
+               }
+            }
+            result = !rs->has_error(rs);
+            rs->free(rs);
+         }
+      }
+      q->free(q);
+   }
+   if (result) {
+      this->keys.complete = 1;
+   } else {
+      log_error(this->log, "Could not load the keys of user %"PRId64, this->userid);
+   }
+   return result;
+}
+
+static key_impl_t *vault_user_key(user_impl_t *this, int64_t keyid) {
+   this->key.keyid = keyid;
+   this->key.stretch = 0;
+   return &(this->key);
+}
+
+/*
+ * Look for the key in the database, and add it to the index if found
+ */
+static key_impl_t *load_key(user_impl_t *this, const char *keyname, unsigned int pos) {
+   key_impl_t *result = NULL;
+   int64_t keyid = 0;
+   int found = 0;
+   static const char *sql = "SELECT KEYID FROM KEYS WHERE USERID=? AND KEYNAME=?";
+   circus_database_query_t *q = this->database->query(this->database, sql);
+   int ok;
+   if (q != NULL) {
+      ok = q->set_int(q, 0, this->userid);
+      if (ok) {
+         ok = q->set_string_static(q, 1, keyname, -1);
+         if (ok) {
+            circus_database_resultset_t *rs = q->run(q);
+            if (rs != NULL) {
+               while (rs->has_next(rs)) {
+                  rs->next(rs);
+                  if (found) {
+                     log_error(this->log, "Error: multiple entries for user %"PRId64" key %s", this->userid, keyname);
+                     found = -1;
+                  } else if (found == 0) {
+                     keyid = rs->get_int(rs, 0);
+                     found = 1;
+                  }
+               }
+               rs->free(rs);
+            }
+         }
+      }
+      q->free(q);
+   }
+   if (found == 1) {
+      key_index_insert(this->memory, &(this->keys), pos, keyid, keyname, strlen(keyname));
+      result = vault_user_key(this, keyid);
+   }
+   return result;
+}
+
 static key_impl_t *vault_user_get(user_impl_t *this, const char *keyname) {
    assert(keyname != NULL);
    assert(keyname[0] != 0);
@@ -35,49 +167,94 @@ static key_impl_t *vault_user_get(user_impl_t *this, const char *keyname) {
       return NULL;
    }
 
-   key_impl_t *result = this->keys->get(this->keys, keyname);
-   if (result == NULL) {
-      static const char *sql = "SELECT KEYID FROM KEYS WHERE USERID=? AND KEYNAME=?";
-      circus_database_query_t *q = this->vault->database->query(this->vault->database, sql);
-      int ok;
-      if (q != NULL) {
-         ok = q->set_int(q, 0, this->userid);
-         if (ok) {
-            ok = q->set_string(q, 1, keyname);
-            if (ok) {
-               circus_database_resultset_t *rs = q->run(q);
-               if (rs != NULL) {
-                  while (rs->has_next(rs)) {
-                     rs->next(rs);
-                     if (result != NULL) {
-                        log_error(this->log, "Error: multiple entries for user %"PRId64" key %s", this->userid, keyname);
-                        result->fn.free(&(result->fn));
-                        result = NULL;
-                     } else {
-                        int64_t keyid = rs->get_int(rs, 0);
-                        result = new_vault_key(this->memory, this->log, keyid, this);
-                     }
-                  }
-                  rs->free(rs);
-               }
-            }
-         }
-         q->free(q);
+   unsigned int pos;
+   if (key_index_find(&(this->keys), keyname, &pos)) {
+      return vault_user_key(this, this->keys.entries[pos].keyid);
+   }
+   if (this->keys.complete) {
+      return NULL;
+   }
+   return load_key(this, keyname, pos);
+}
+
+static int vault_user_get_all(user_impl_t *this, circus_user_keys_fn fn, void *data) {
+   if (((this->permissions) & PERMISSION_USER) == 0) {
+      log_error(this->log, "User %"PRId64" does not have permission to get keys", this->userid);
+      return 0;
+   }
+
+   if (!this->keys.complete && !key_index_preload(this)) {
+      return 0;
+   }
+
+   unsigned int i;
+   for (i = 0; i < this->keys.count; i++) {
+      fn(data, this->keys.names + this->keys.entries[i].name);
+   }
+   return 1;
+}
+
+/*
+ * Visit the names found in the first column of the query results
+ */
+static int visit_names(user_impl_t *this, circus_database_query_t *q, circus_user_keys_fn fn, void *data) {
+   int result = 0;
+   circus_database_resultset_t *rs = q->run(q);
+   if (rs != NULL) {
+      while (rs->has_next(rs)) {
+         rs->next(rs);
+         fn(data, rs->get_string(rs, 0));
       }
-      if (result != NULL) {
-         this->keys->set(this->keys, keyname, result);
+      result = !rs->has_error(rs);
+      if (!result) {
+         log_error(this->log, "Could not list the tags of user %"PRId64, this->userid);
       }
+      rs->free(rs);
    }
    return result;
 }
 
-static cad_hash_t *vault_user_get_all(user_impl_t *this) {
+static int vault_user_get_tagged(user_impl_t *this, const char *tag, circus_user_keys_fn fn, void *data) {
    if (((this->permissions) & PERMISSION_USER) == 0) {
       log_error(this->log, "User %"PRId64" does not have permission to get keys", this->userid);
-      return NULL;
+      return 0;
+   }
+   if (!vault_migrated(this->vault, TAGS_VERSION, "tags")) {
+      return 0;
    }
 
-   return this->keys;
+   int result = 0;
+   static const char *sql = "SELECT KEYS.KEYNAME FROM TAGS JOIN KEYS ON KEYS.KEYID=TAGS.KEYID "
+      "WHERE TAGS.USERID=? AND TAGS.NAME=? ORDER BY KEYS.KEYNAME";
+   circus_database_query_t *q = this->database->query(this->database, sql);
+   if (q != NULL) {
+      if (q->set_int(q, 0, this->userid) && q->set_string_static(q, 1, tag, -1)) {
+         result = visit_names(this, q, fn, data);
+      }
+      q->free(q);
+   }
+   return result;
+}
+
+static int vault_user_get_tags(user_impl_t *this, circus_user_keys_fn fn, void *data) {
+   if (((this->permissions) & PERMISSION_USER) == 0) {
+      log_error(this->log, "User %"PRId64" does not have permission to get keys", this->userid);
+      return 0;
+   }
+   if (!vault_migrated(this->vault, TAGS_VERSION, "tags")) {
+      return 0;
+   }
+
+   int result = 0;
+   static const char *sql = "SELECT DISTINCT NAME FROM TAGS WHERE USERID=? ORDER BY NAME";
+   circus_database_query_t *q = this->database->query(this->database, sql);
+   if (q != NULL) {
+      if (q->set_int(q, 0, this->userid)) {
+         result = visit_names(this, q, fn, data);
+      }
+      q->free(q);
+   }
+   return result;
 }
 
 static key_impl_t *vault_user_new(user_impl_t *this, const char *keyname) {
@@ -89,19 +266,19 @@ static key_impl_t *vault_user_new(user_impl_t *this, const char *keyname) {
    }
 
    key_impl_t *result = NULL;
+   unsigned int pos;
+   int inserted = 0;
    static const char *sql = "INSERT INTO KEYS (USERID, KEYNAME, SALT, STRETCH, VALUE) VALUES (?, ?, \"\", 0, \"\")";
-   circus_database_query_t *q = this->vault->database->query(this->vault->database, sql);
+   circus_database_query_t *q = this->database->query(this->database, sql);
    int ok;
    if (q != NULL) {
       ok = q->set_int(q, 0, this->userid);
       if (ok) {
-         ok = q->set_string(q, 1, keyname);
+         ok = q->set_string_static(q, 1, keyname, -1);
          if (ok) {
             circus_database_resultset_t *rs = q->run(q);
             if (rs != NULL) {
-               if (!rs->has_error(rs)) {
-                  result = vault_user_get(this, keyname);
-               }
+               inserted = !rs->has_error(rs);
                rs->free(rs);
             }
          }
@@ -109,6 +286,12 @@ static key_impl_t *vault_user_new(user_impl_t *this, const char *keyname) {
       q->free(q);
    }
 
+   if (inserted) {
+      // also when the index is complete: it must stay so
+      key_index_find(&(this->keys), keyname, &pos);
+      result = load_key(this, keyname, pos);
+   }
+
    return result;
 }
 
@@ -121,6 +304,11 @@ static int vault_user_set_password(user_impl_t *this, const char *password, uint
    uint64_t stretch_threshold = get_stretch_threshold(this->log, this->vault->database);
    log_info(this->log, "stretch_threshold=%"PRIu64, stretch_threshold);
 
+   if (!this->vault->database->begin(this->vault->database)) {
+      log_error(this->log, "Could not start password change transaction");
+      return 0;
+   }
+
    static const char *sql = "UPDATE USERS SET PWDSALT=?, HASHPWD=?, PWDVALID=?, STRETCH=? WHERE USERID=?";
    circus_database_query_t *q = this->vault->database->query(this->vault->database, sql);
    int result = 0;
@@ -134,10 +322,10 @@ static int vault_user_set_password(user_impl_t *this, const char *password, uint
       int ok = pass_hash(this->memory, this->log, &h_pass);
 
       if (ok) {
-         ok = q->set_string(q, 0, h_pass.salt);
+         ok = q->set_string_static(q, 0, h_pass.salt, -1);
       }
       if (ok) {
-         ok = q->set_string(q, 1, h_pass.hashed);
+         ok = q->set_string_static(q, 1, h_pass.hashed, -1);
       }
       if (ok) {
          ok = q->set_int(q, 2, validity);
@@ -153,7 +341,6 @@ static int vault_user_set_password(user_impl_t *this, const char *password, uint
          circus_database_resultset_t *rs = q->run(q);
          if (rs != NULL) {
             if (!rs->has_error(rs)) {
-               this->validity = validity;
                result = 1;
             }
             rs->free(rs);
@@ -165,25 +352,63 @@ static int vault_user_set_password(user_impl_t *this, const char *password, uint
 
       q->free(q);
 
-      if (ok) {
-         ok = set_symmetric_key(this, password);
-         if (!ok) {
-            log_error(this->log, "Symmetric key encryption update failed. The user %"PRId64" may need help.", this->userid);
+      if (result) {
+         result = set_symmetric_key(this, password);
+         if (!result) {
+            log_error(this->log, "Symmetric key encryption update failed for user %"PRId64, this->userid);
          }
       }
    }
 
+   if (result) {
+      result = this->vault->database->commit(this->vault->database);
+   } else {
+      this->vault->database->rollback(this->vault->database);
+   }
+   if (result) {
+      this->validity = validity;
+   }
+
    return result;
 }
 
+/*
+ * The cached email changes only when the new one is durable. The user
+ * is looked up again by name: it may have been evicted meanwhile.
+ */
+typedef struct {
+   vault_impl_t *vault;
+   char *email;
+   char name[];
+} email_write_t;
+
+static void email_written(email_write_t *write, int status) {
+   vault_impl_t *vault = write->vault;
+   deferred_write_done(vault, status);
+   if (status) {
+      user_impl_t *user = vault->users->get(vault->users, write->name);
+      if (user != NULL) {
+         vault->memory.free(user->email);
+         user->email = write->email;
+         write->email = NULL;
+      }
+   }
+   vault->memory.free(write->email);
+   vault->memory.free(write);
+}
+
 static int vault_user_set_email(user_impl_t *this, const char *email) {
    static const char *sql = "UPDATE USERS SET EMAIL=? WHERE USERID=?";
    int result = 0;
 
+   if (!this->vault->database->begin_deferred(this->vault->database)) {
+      return 0;
+   }
+
    circus_database_query_t *q = this->vault->database->query(this->vault->database, sql);
    int ok;
    if (q != NULL) {
-      ok = q->set_string(q, 0, email);
+      ok = q->set_string_static(q, 0, email, -1);
       if (ok) {
          ok = q->set_int(q, 1, this->userid);
          if (ok) {
@@ -193,8 +418,6 @@ static int vault_user_set_email(user_impl_t *this, const char *email) {
                   rs->next(rs);
                }
                if (!rs->has_error(rs)) {
-                  this->memory.free(this->email);
-                  this->email = email == NULL ? NULL : szprintf(this->memory, NULL, "%s", email);
                   result = 1;
                }
                rs->free(rs);
@@ -205,6 +428,17 @@ static int vault_user_set_email(user_impl_t *this, const char *email) {
       q->free(q);
    }
 
+   if (result) {
+      email_write_t *write = memory_malloc(this->memory, sizeof(email_write_t) + strlen(this->name) + 1);
+      assert(write != NULL);
+      write->vault = this->vault;
+      write->email = email == NULL ? NULL : szprintf(this->memory, NULL, "%s", email);
+      strcpy(write->name, this->name);
+      result = this->vault->database->commit_deferred(this->vault->database, (circus_database_done_fn)email_written, write);
+   } else {
+      this->vault->database->rollback(this->vault->database);
+   }
+
    return result;
 }
 
@@ -216,31 +450,59 @@ static time_t vault_user_validity(user_impl_t *this) {
    return (time_t)this->validity;
 }
 
-static void user_clean(cad_hash_t *UNUSED(hash), int UNUSED(index), const char *UNUSED(name), key_impl_t *key, user_impl_t *UNUSED(user)) {
-   key->fn.free(&(key->fn));
+static void vault_user_pin(user_impl_t *this) {
+   vault_pin_user(this->vault, this);
 }
 
+static void vault_user_unpin(user_impl_t *this) {
+   vault_unpin_user(this->vault, this);
+}
+
+static const char *vault_user_symmkey(user_impl_t *this) {
+   return this->symmkey;
+}
+
+/*
+ * Also called when the user is evicted from the vault cache: wipe the
+ * unlocked symmetric key, and the key index
+ */
 static void vault_user_free(user_impl_t *this) {
-   this->keys->clean(this->keys, (cad_hash_iterator_fn)user_clean, this);
-   this->keys->free(this->keys);
+   if (this->symmkey != NULL) {
+      memset(this->symmkey, 0, strlen(this->symmkey));
+   }
+   if (this->keys.entries != NULL) {
+      memset(this->keys.entries, 0, this->keys.capacity * sizeof(key_entry_t));
+   }
+   if (this->keys.names != NULL) {
+      memset(this->keys.names, 0, this->keys.names_capacity);
+   }
+   this->memory.free(this->keys.entries);
+   this->memory.free(this->keys.names);
+   this->memory.free(this->email);
+   this->memory.free(this->symmkey);
    this->memory.free(this);
 }
 
 static circus_user_t vault_user_fn = {
    (circus_user_get_fn)vault_user_get,
    (circus_user_get_all_fn)vault_user_get_all,
+   (circus_user_get_tagged_fn)vault_user_get_tagged,
+   (circus_user_get_tags_fn)vault_user_get_tags,
    (circus_user_new_fn)vault_user_new,
    (circus_user_name_fn)vault_user_name,
    (circus_user_set_password_fn)vault_user_set_password,
    (circus_user_set_email_fn)vault_user_set_email,
    (circus_user_is_admin_fn)vault_user_is_admin,
    (circus_user_validity_fn)vault_user_validity,
+   (circus_user_pin_fn)vault_user_pin,
+   (circus_user_unpin_fn)vault_user_unpin,
+   (circus_user_symmkey_fn)vault_user_symmkey,
    (circus_user_free_fn)vault_user_free,
 };
 
 user_impl_t *new_vault_user(cad_memory_t memory, circus_log_t *log, int64_t userid, uint64_t validity, int permissions,
                             const char *email, const char *name, vault_impl_t *vault) {
-   user_impl_t *result = memory.malloc(sizeof(user_impl_t) + strlen(name) + 1);
+   user_impl_t *result = memory_malloc(memory, sizeof(user_impl_t) + strlen(name) + 1);
    if (result != NULL) {
       result->fn = vault_user_fn;
       result->memory = memory;
@@ -249,10 +511,16 @@ user_impl_t *new_vault_user(cad_memory_t memory, circus_log_t *log, int64_t user
       result->permissions = permissions;
       result->name = (char*)(result + 1);
       result->vault = vault;
-      result->keys = cad_new_hash(memory, cad_hash_strings);
+      result->database = vault_shard(vault, userid);
+      memset(&(result->keys), 0, sizeof(key_index_t));
+      init_vault_key(&(result->key), memory, log, result);
       result->email = email == NULL ? NULL : szprintf(memory, NULL, "%s", email);
       result->symmkey = NULL;
       result->validity = validity;
+      result->pins = 0;
+      result->lru_prev = NULL;
+      result->lru_next = NULL;
+      result->last_used = 0;
       strcpy(result->name, name);
    }
    return result;
@@ -260,13 +528,16 @@ user_impl_t *new_vault_user(cad_memory_t memory, circus_log_t *log, int64_t user
 
 static int update_stretched_password(user_impl_t *user, hashing_t *hashing) {
    static const char *sql = "UPDATE USERS SET STRETCH=?, HASHPWD=? WHERE USERID=?";
+   if (!user->vault->database->begin_deferred(user->vault->database)) {
+      return 0;
+   }
    circus_database_query_t *q = user->vault->database->query(user->vault->database, sql);
    int ok;
    int result = 0;
    if (q != NULL) {
       ok = q->set_int(q, 0, (int64_t)hashing->stretch);
       if (ok) {
-         ok = q->set_string(q, 1, hashing->hashed);
+         ok = q->set_string_static(q, 1, hashing->hashed, -1);
       }
       if (ok) {
          ok = q->set_int(q, 2, user->userid);
@@ -281,65 +552,43 @@ static int update_stretched_password(user_impl_t *user, hashing_t *hashing) {
       q->free(q);
    }
 
+   if (result) {
+      result = user->vault->database->commit_deferred(user->vault->database, (circus_database_done_fn)deferred_write_done, user->vault);
+   } else {
+      user->vault->database->rollback(user->vault->database);
+   }
+
    return result;
 }
 
-user_impl_t *check_user_password(user_impl_t *user, const char *password) {
+user_impl_t *check_user_password(user_impl_t *user, user_row_t *row, const char *password) {
    log_debug(user->log, "Checking user %"PRId64" password", user->userid);
+   assert(row->userid == user->userid);
 
    uint64_t stretch_threshold = get_stretch_threshold(user->log, user->vault->database);
    log_info(user->log, "stretch_threshold=%"PRIu64, stretch_threshold);
 
-   static const char *sql = "SELECT USERNAME, PWDSALT, HASHPWD, PWDVALID, STRETCH FROM USERS WHERE USERID=?";
    user_impl_t *result = NULL;
-   circus_database_query_t *q = user->vault->database->query(user->vault->database, sql);
-   int ok;
-
    hashing_t h_pass;
    int update = 0;
 
-   if (q != NULL) {
-      ok = q->set_int(q, 0, user->userid);
-      if (ok) {
-         circus_database_resultset_t *rs = q->run(q);
-         if (rs == NULL) {
-            log_error(user->log, "Error user not found: %"PRId64, user->userid);
-         } else if (!rs->has_next(rs)) {
-            log_error(user->log, "Error user not found: %"PRId64, user->userid);
-            rs->free(rs);
-         } else {
-            rs->next(rs);
-
-            const char *pwdsalt = rs->get_string(rs, 1);
-            const char *hashpwd = rs->get_string(rs, 2);
-            uint64_t validity = (uint64_t)rs->get_int(rs, 3);
-            uint64_t stretch = (uint64_t)rs->get_int(rs, 4);
-            if ((validity == 0) || ((time_t)validity > now().tv_sec)) {
-               h_pass.stretch = stretch;
-               h_pass.clear = (char*)password;
-               h_pass.salt = (char*)pwdsalt;
-               h_pass.hashed = (char*)hashpwd;
-
-               int cmp = pass_compare(user->memory, user->log, &h_pass, stretch_threshold);
-               if (cmp) {
-                  if (h_pass.stretch > stretch) {
-                     update = 1;
-                  }
-                  result = user;
-               } else {
-                  log_warning(user->log, "Invalid password for user %s", rs->get_string(rs, 0));
-               }
-            } else {
-               log_warning(user->log, "Stale password for user %s", rs->get_string(rs, 0));
-            }
-            if (rs->has_next(rs)) {
-               log_error(user->log, "Error multiple users found for userid: %"PRId64, user->userid);
-               result = NULL;
-            }
-            rs->free(rs);
+   if ((row->validity == 0) || ((time_t)row->validity > now().tv_sec)) {
+      h_pass.stretch = row->stretch;
+      h_pass.clear = (char*)password;
+      h_pass.salt = (char*)row->pwdsalt;
+      h_pass.hashed = (char*)row->hashpwd;
+
+      int cmp = pass_compare(user->memory, user->log, &h_pass, stretch_threshold);
+      if (cmp) {
+         if (h_pass.stretch > row->stretch) {
+            update = 1;
          }
+         result = user;
+      } else {
+         log_warning(user->log, "Invalid password for user %s", user->name);
       }
-      q->free(q);
+   } else {
+      log_warning(user->log, "Stale password for user %s", user->name);
    }
 
    if (update) {
@@ -105,6 +105,16 @@ char *szprintf(cad_memory_t memory, int *size, const char *format, ...) __attrib
  */
 char *vszprintf(cad_memory_t memory, int *size, const char *format, va_list args);
 
+/**
+ * Statistics visitor, called once per counter by the modules that
+ * expose statistics.
+ *
+ * @param[in] data the visitor data
+ * @param[in] name the counter name (dot-separated path)
+ * @param[in] value the counter value
+ */
+typedef void (*circus_stats_fn)(void *data, const char *name, unsigned long value);
+
 // ----------------------------------------------------------------
 // Debugging guards
 
@@ -53,6 +53,15 @@ size_t b64_size(size_t len);
  */
 char *base64(cad_memory_t memory, const char *raw, size_t len);
 
+/**
+ * Encode a byte array into a base64 string, in place.
+ *
+ * @param[out] b64 the string, at least `b64_size(len) + 1` bytes
+ * @param[in] raw the byte array to encode
+ * @param[in] len the size of the byte array
+ */
+void base64_to(char *b64, const char *raw, size_t len);
+
 /**
  * Decode a base64 string into a byte array. Even though not strictly
  * necessary the returned byte array is 0-terminated.
@@ -64,6 +73,30 @@ char *base64(cad_memory_t memory, const char *raw, size_t len);
  */
 char *unbase64(cad_memory_t memory, const char *b64, size_t *len);
 
+/**
+ * Decode a base64 string of known length into a byte array. The
+ * string does not need to be 0-terminated.
+ *
+ * @param[in] memory the memory allocator
+ * @param[in] b64 the base64 string to decode
+ * @param[in] b64len the length of the base64 string
+ * @param[out] len the size of the resulting byte array; may be NULL
+ * @return the byte array, zero-terminated
+ */
+char *unbase64_len(cad_memory_t memory, const char *b64, size_t b64len, size_t *len);
+
+/**
+ * Decode an untrusted base64 string of known length into a byte
+ * array, in place. The byte array is not 0-terminated.
+ *
+ * @param[out] raw the byte array, at least `b64len / 4 * 3` bytes
+ * @param[in] b64 the base64 string to decode
+ * @param[in] b64len the length of the base64 string
+ * @return the size of the byte array, or -1 if the string is not valid
+ * base64
+ */
+int unbase64_to(char *raw, const char *b64, size_t b64len);
+
 /**
  * @}
  */
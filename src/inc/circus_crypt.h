@@ -76,6 +76,16 @@ char *unsalted(cad_memory_t memory, circus_log_t *log, const char *salt, const c
  */
 char *hashed(cad_memory_t memory, circus_log_t *log, const char *value);
 
+/**
+ * Authenticate a string (HMAC).
+ * @param[in] memory the memory allocator
+ * @param[in] log the logger
+ * @param[in] value the string to authenticate
+ * @param[in] key the secret key
+ * @return the authentication code of the value, in base64
+ */
+char *authenticated(cad_memory_t memory, circus_log_t *log, const char *value, const char *key);
+
 /**
  * Create a random symmetric key.
  *
@@ -107,12 +117,32 @@ char *encrypted(cad_memory_t memory, circus_log_t *log, const char *value, const
  */
 char *decrypted(cad_memory_t memory, circus_log_t *log, const char *b64value, const char *key);
 
+/**
+ * Decrypt a string, of which the base64 length is already known.
+ *
+ * @param[in] memory the memory allocator
+ * @param[in] log the logger
+ * @param[in] b64value the bytes to decrypt, in base64
+ * @param[in] b64len the length of b64value
+ * @param[in] b64key the symmetric key returned by @ref new_symmetric_key
+ * @return the decrypted string
+ */
+char *decrypted_len(cad_memory_t memory, circus_log_t *log, const char *b64value, size_t b64len, const char *key);
+
 /**
  * NOTE!!! szrandom() and co produce longer buffers than len because
  * they are base32/64-encoded
  * @{
  */
 
+/**
+ * Fill a buffer with a random sequence of bytes.
+ *
+ * @param[out] buffer the bytes array
+ * @param[in] len the length of the bytes array
+ */
+void random_bytes(char *buffer, size_t len);
+
 /**
  * Generate a random sequence of bytes.
  *
@@ -162,7 +192,9 @@ char *szrandom64_strong(cad_memory_t memory, size_t len);
 unsigned int irandom(unsigned int max);
 
 /**
- * Initialize the cryptography module
+ * Initialize the cryptography module. Must be called before any other
+ * libgcrypt call: libgcrypt is given the @ref MEMORY and @ref
+ * UNLOCKED_MEMORY allocators first.
  *
  * @param[in] log the logger
  */
@@ -30,21 +30,75 @@ typedef struct circus_database_query_s circus_database_query_t;
 typedef struct circus_database_resultset_s circus_database_resultset_t;
 
 typedef circus_database_query_t *(*circus_database_query_fn)(circus_database_t *this, const char *sql);
+/*
+ * Transactions: begin() starts a transaction, or a savepoint if a
+ * transaction is already running; commit() and rollback() end the
+ * innermost one. Only the outermost commit() is durable.
+ */
+typedef int (*circus_database_begin_fn)(circus_database_t *this);
+typedef int (*circus_database_commit_fn)(circus_database_t *this);
+typedef int (*circus_database_rollback_fn)(circus_database_t *this);
+/*
+ * Group commit: begin_deferred() starts a part of the pending write
+ * group (starting the group if needed); commit_deferred() ends that
+ * part, but the group itself is only committed after enough parts, or
+ * after a delay, or by flush(). The done callback is called once the
+ * transaction that holds the part is durably committed (status 1) or
+ * rolled back (status 0). A part may be rolled back with rollback().
+ * Without group configuration, they behave like begin() and commit().
+ * State derived from the write must be updated by done, not after
+ * commit_deferred() returns, and nothing that depends on the write may
+ * be reported before done. Reads outside the group parts run on the
+ * read connections, if any, and do not see the pending group. Writes
+ * outside a transaction never join the group: they commit it first.
+ */
+typedef void (*circus_database_done_fn)(void *data, int status);
+typedef int (*circus_database_begin_deferred_fn)(circus_database_t *this);
+typedef int (*circus_database_commit_deferred_fn)(circus_database_t *this, circus_database_done_fn done, void *data);
+typedef int (*circus_database_flush_fn)(circus_database_t *this);
+/*
+ * Online backup to the given path, copied in small batches from the
+ * loop so that requests are still served. The file appears at the
+ * given path only once complete. done (may be NULL) is called at the
+ * end with the status. Only one backup may run at a time.
+ */
+typedef int (*circus_database_backup_fn)(circus_database_t *this, const char *path, circus_database_done_fn done, void *data);
+/*
+ * The statement profiles (if profiling is enabled), per statement id:
+ * calls, total and max time, rows, and prepares
+ */
+typedef void (*circus_database_stats_fn)(circus_database_t *this, circus_stats_fn fn, void *data);
 typedef void (*circus_database_free_fn)(circus_database_t *this);
 
 struct circus_database_s {
    circus_database_query_fn query;
+   circus_database_begin_fn begin;
+   circus_database_commit_fn commit;
+   circus_database_rollback_fn rollback;
+   circus_database_begin_deferred_fn begin_deferred;
+   circus_database_commit_deferred_fn commit_deferred;
+   circus_database_flush_fn flush;
+   circus_database_backup_fn backup;
+   circus_database_stats_fn stats;
    circus_database_free_fn free;
 };
 
 typedef int (*circus_database_query_set_int_fn)(circus_database_query_t *this, int index, int64_t value);
 typedef int (*circus_database_query_set_string_fn)(circus_database_query_t *this, int index, const char *value);
+/*
+ * Static binds are not copied: the value must stay valid until the
+ * resultset is freed. A negative len means a NUL-terminated string.
+ */
+typedef int (*circus_database_query_set_string_static_fn)(circus_database_query_t *this, int index, const char *value, int len);
+typedef int (*circus_database_query_set_blob_static_fn)(circus_database_query_t *this, int index, const void *value, size_t len);
 typedef circus_database_resultset_t *(*circus_database_query_run_fn)(circus_database_query_t *this);
 typedef void (*circus_database_query_free_fn)(circus_database_query_t *this);
 
 struct circus_database_query_s {
    circus_database_query_set_int_fn set_int;
    circus_database_query_set_string_fn set_string;
+   circus_database_query_set_string_static_fn set_string_static;
+   circus_database_query_set_blob_static_fn set_blob_static;
    circus_database_query_run_fn run;
    circus_database_query_free_fn free;
 };
@@ -54,6 +108,13 @@ typedef int (*circus_database_resultset_has_next_fn)(circus_database_resultset_t
 typedef int (*circus_database_resultset_next_fn)(circus_database_resultset_t *this);
 typedef int64_t (*circus_database_resultset_get_int_fn)(circus_database_resultset_t *this, int index);
 typedef const char *(*circus_database_resultset_get_string_fn)(circus_database_resultset_t *this, int index);
+/*
+ * The returned pointers are valid until the next call to next() or
+ * free(); len is the size in bytes (not counting the terminating NUL
+ * of strings)
+ */
+typedef const char *(*circus_database_resultset_get_string_len_fn)(circus_database_resultset_t *this, int index, size_t *len);
+typedef const void *(*circus_database_resultset_get_blob_fn)(circus_database_resultset_t *this, int index, size_t *len);
 typedef void (*circus_database_resultset_free_fn)(circus_database_resultset_t *this);
 
 struct circus_database_resultset_s {
@@ -62,10 +123,22 @@ struct circus_database_resultset_s {
    circus_database_resultset_next_fn next;
    circus_database_resultset_get_int_fn get_int;
    circus_database_resultset_get_string_fn get_string;
+   circus_database_resultset_get_string_len_fn get_string_len;
+   circus_database_resultset_get_blob_fn get_blob;
    circus_database_resultset_free_fn free;
 };
 
-__PUBLIC__ circus_database_t *circus_database_sqlite3(cad_memory_t memory, circus_log_t *log, const char *path);
+/*
+ * The config (optional) gives the SQLite tuning pragmas, the read
+ * connections and the group commit parameters
+ */
+__PUBLIC__ circus_database_t *circus_database_sqlite3(cad_memory_t memory, circus_log_t *log, circus_config_t *config, const char *path);
+/*
+ * In-memory SQLite database, for tests and benchmarks: no fsync. It
+ * is seeded from path if the file exists, and dumped back to path
+ * when freed if "vault.memory"/"dump" is "true".
+ */
+__PUBLIC__ circus_database_t *circus_database_memory(cad_memory_t memory, circus_log_t *log, circus_config_t *config, const char *path);
 __PUBLIC__ int database_exec(circus_log_t *log, circus_database_t *database, const char *sql);
 
 #endif /* __CIRCUS_DATABASE_H */
@@ -21,8 +21,102 @@
 
 #include <cad_shared.h>
 
+#include <circus.h>
+#include <circus_log.h>
+
+/**
+ * Locked memory: never swapped, wiped on free.
+ */
 extern cad_memory_t MEMORY;
 
+/**
+ * Unlocked memory, tagged so that @ref is_locked can tell it from
+ * @ref MEMORY allocations.
+ */
+extern cad_memory_t UNLOCKED_MEMORY;
+
+/**
+ * Allocate from the given allocator; if it is @ref MEMORY, the
+ * allocation is accounted to the given call site (see @ref
+ * memory_stats). Use the @ref memory_malloc and @ref memory_realloc
+ * macros.
+ */
+void *circus_malloc_at(cad_memory_t memory, size_t size, const char *file, int line);
+void *circus_realloc_at(cad_memory_t memory, void *ptr, size_t size, const char *file, int line);
+
+#define memory_malloc(memory, size) circus_malloc_at((memory), (size), __FILE__, __LINE__)
+#define memory_realloc(memory, ptr, size) circus_realloc_at((memory), (ptr), (size), __FILE__, __LINE__)
+
+/**
+ * @param[in] ptr any pointer; only its address is looked at
+ * @return true if the pointer is in a block allocated by @ref MEMORY,
+ * false otherwise (@ref UNLOCKED_MEMORY, system allocator, stack...)
+ */
+int is_locked(const void *ptr);
+
+/**
+ * Reserve and lock a pool of the given size, from which @ref MEMORY
+ * allocates. Checked against RLIMIT_MEMLOCK. A size of 0 means no
+ * pool: each allocation is locked on its own.
+ *
+ * @param[in] log the logger
+ * @param[in] size the size of the pool, in bytes
+ * @return true on success, false on failure
+ */
+int locked_pool(circus_log_t *log, size_t size);
+
+/**
+ * Log the locked pool usage and high-water mark.
+ *
+ * @param[in] log the logger
+ */
+void locked_pool_report(circus_log_t *log);
+
+/**
+ * Set the soft and hard budgets of locked memory. A budget of 0 is
+ * computed from the locked pool size or RLIMIT_MEMLOCK (75% and 90%
+ * respectively); if neither is known, there is no budget.
+ *
+ * @param[in] log the logger
+ * @param[in] soft the soft budget, in bytes
+ * @param[in] hard the hard budget, in bytes
+ */
+void memory_budget(circus_log_t *log, size_t soft, size_t hard);
+
+/**
+ * The memory pressure, with respect to the budgets.
+ */
+typedef enum {
+   memory_pressure_none = 0,
+   memory_pressure_soft,
+   memory_pressure_hard,
+} memory_pressure_t;
+
+/**
+ * @return the current memory pressure; the caches should be shrunk
+ * accordingly (never from within an allocation)
+ */
+memory_pressure_t memory_pressure(void);
+
+/**
+ * Visit the locked memory counters: live bytes, high-water mark,
+ * allocation count and wiped bytes, in total, per size class, and per
+ * call site (file and line of the @ref memory_malloc and @ref
+ * memory_realloc calls; the direct @ref MEMORY calls are gathered in
+ * "other").
+ *
+ * @param[in] fn the visitor
+ * @param[in] data the visitor data
+ */
+void memory_stats(circus_stats_fn fn, void *data);
+
+/**
+ * Log the locked memory counters.
+ *
+ * @param[in] log the logger
+ */
+void memory_report(circus_log_t *log);
+
 size_t max_bzero(size_t count);
 void force_bzero(void *buf, size_t count);
 
@@ -29,4 +29,10 @@ union circus_message_visitor_s {
    circus_message_visitor_reply_t reply;
 };
 
+/**
+ * Release the message objects kept for recycling. Call it when no more
+ * messages will be allocated, e.g. when freeing the message handler.
+ */
+__PUBLIC__ void circus_message_pool_clean(void);
+
 #endif /* __CIRCUS_MESSAGE_IMPL_H */
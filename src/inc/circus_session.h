@@ -30,6 +30,10 @@ typedef const char *(*circus_session_data_token_fn)(circus_session_data_t *this)
 typedef const char *(*circus_session_data_set_token_fn)(circus_session_data_t *this);
 typedef circus_user_t *(*circus_session_data_user_fn)(circus_session_data_t *this);
 
+/*
+ * The sessionid and token strings are valid until the next call to the
+ * session or its data.
+ */
 struct circus_session_data_s {
    circus_session_data_sessionid_fn sessionid;
    circus_session_data_token_fn token;
@@ -46,15 +50,42 @@ typedef struct circus_session_s circus_session_t;
  */
 
 typedef circus_session_data_t *(*circus_session_get_fn)(circus_session_t *this, const char *sessionid, const char *token);
+/*
+ * A new session for the user; the user keeps their other sessions, up
+ * to "session"/"max_per_user" (the least recently used ones are closed)
+ */
 typedef circus_session_data_t *(*circus_session_set_fn)(circus_session_t *this, circus_user_t *user);
+/*
+ * Close all the sessions of the user
+ */
+typedef void (*circus_session_close_fn)(circus_session_t *this, circus_user_t *user);
+/*
+ * Release memory: keep only the latest token of each session; if all
+ * is true, close all the sessions.
+ */
+typedef void (*circus_session_shrink_fn)(circus_session_t *this, int all);
+/*
+ * The open sessions count, and the number of sessions expired, restored,
+ * and evicted (too many per user) since the start
+ */
+typedef void (*circus_session_stats_fn)(circus_session_t *this, circus_stats_fn fn, void *data);
 typedef void (*circus_session_free_fn)(circus_session_t *this);
 
 struct circus_session_s {
    circus_session_get_fn get;
    circus_session_set_fn set;
+   circus_session_close_fn close;
+   circus_session_shrink_fn shrink;
+   circus_session_stats_fn stats;
    circus_session_free_fn free;
 };
 
-__PUBLIC__ circus_session_t *circus_session(cad_memory_t memory, circus_log_t *log, circus_config_t *config);
+/*
+ * If "session"/"snapshot" is configured, the sessions are saved there,
+ * encrypted with "session"/"snapshot_secret" (at least 16 characters),
+ * every "session"/"snapshot_interval" seconds and when freed; they are
+ * restored at startup. The vault (may be NULL) gets their users back.
+ */
+__PUBLIC__ circus_session_t *circus_session(cad_memory_t memory, circus_log_t *log, circus_config_t *config, circus_vault_t *vault);
 
 #endif /* __CIRCUS_SESSION_H */
@@ -34,35 +34,82 @@ typedef struct circus_key_s circus_key_t;
 
 typedef char *(*circus_key_get_password_fn)(circus_key_t *this);
 typedef int (*circus_key_set_password_fn)(circus_key_t *this, const char *password);
+/*
+ * A key may have any number of tags; tagging twice is harmless.
+ */
+typedef int (*circus_key_tag_fn)(circus_key_t *this, const char *tag);
+typedef int (*circus_key_untag_fn)(circus_key_t *this, const char *tag);
+typedef void (*circus_key_tags_fn)(void *data, const char *tag);
+/*
+ * Visit the tags of the key, in ascending order.
+ */
+typedef int (*circus_key_get_tags_fn)(circus_key_t *this, circus_key_tags_fn fn, void *data);
 typedef void (*circus_key_free_fn)(circus_key_t *this);
 
 struct circus_key_s {
    circus_key_get_password_fn get_password;
    circus_key_set_password_fn set_password;
+   circus_key_tag_fn tag;
+   circus_key_untag_fn untag;
+   circus_key_get_tags_fn get_tags;
    circus_key_free_fn free;
 };
 
 typedef struct circus_user_s circus_user_t;
 
+/*
+ * The returned key belongs to the user; it is valid until the next
+ * call to get() or new().
+ */
 typedef circus_key_t *(*circus_user_get_fn)(circus_user_t *this, const char *keyname);
-typedef cad_hash_t *(*circus_user_get_all_fn)(circus_user_t *this);
+typedef void (*circus_user_keys_fn)(void *data, const char *keyname);
+/*
+ * Visit the key names, in ascending order.
+ */
+typedef int (*circus_user_get_all_fn)(circus_user_t *this, circus_user_keys_fn fn, void *data);
+/*
+ * Visit the names of the keys having the given tag, in ascending
+ * order.
+ */
+typedef int (*circus_user_get_tagged_fn)(circus_user_t *this, const char *tag, circus_user_keys_fn fn, void *data);
+/*
+ * Visit the tag names used by the user keys, in ascending order.
+ */
+typedef int (*circus_user_get_tags_fn)(circus_user_t *this, circus_user_keys_fn fn, void *data);
 typedef circus_key_t *(*circus_user_new_fn)(circus_user_t *this, const char *keyname);
 typedef const char *(*circus_user_name_fn)(circus_user_t *this);
 typedef int (*circus_user_set_password_fn)(circus_user_t *this, const char *password, uint64_t validity);
 typedef int (*circus_user_set_email_fn)(circus_user_t *this, const char *email);
 typedef int (*circus_user_is_admin_fn)(circus_user_t *this);
 typedef time_t (*circus_user_validity_fn)(circus_user_t *this);
+/*
+ * The vault keeps a bounded cache of users: the users not pinned may
+ * be evicted (and their references become invalid) by the next call
+ * to the vault. Pin the users kept for longer, e.g. by a session.
+ */
+typedef void (*circus_user_pin_fn)(circus_user_t *this);
+typedef void (*circus_user_unpin_fn)(circus_user_t *this);
+/*
+ * The unlocked symmetric key of the user (NULL if not unlocked), only
+ * to be saved in the encrypted session snapshot
+ */
+typedef const char *(*circus_user_symmkey_fn)(circus_user_t *this);
 typedef void (*circus_user_free_fn)(circus_user_t *this);
 
 struct circus_user_s {
    circus_user_get_fn get;
    circus_user_get_all_fn get_all;
+   circus_user_get_tagged_fn get_tagged;
+   circus_user_get_tags_fn get_tags;
    circus_user_new_fn new;
    circus_user_name_fn name;
    circus_user_set_password_fn set_password;
    circus_user_set_email_fn set_email;
    circus_user_is_admin_fn is_admin;
    circus_user_validity_fn validity;
+   circus_user_pin_fn pin;
+   circus_user_unpin_fn unpin;
+   circus_user_symmkey_fn symmkey;
    circus_user_free_fn free;
 };
 
@@ -71,16 +118,52 @@ typedef struct circus_vault_s circus_vault_t;
 typedef circus_user_t *(*circus_vault_get_fn)(circus_vault_t *this, const char *username, const char *password);
 typedef circus_user_t *(*circus_vault_new_fn)(circus_vault_t *this, const char *username, const char *password, uint64_t validity);
 typedef int (*circus_vault_install_fn)(circus_vault_t *this, const char *admin_username, const char *admin_password);
+/*
+ * Get a user without their password, unlocked by the given symmetric
+ * key (may be NULL): only for the sessions restored from the encrypted
+ * session snapshot. Revoked users are not restored.
+ */
+typedef circus_user_t *(*circus_vault_restore_fn)(circus_vault_t *this, const char *username, const char *symmkey);
+/*
+ * Release memory: drop the cached users and keys, but the pinned
+ * users. All the other user and key references become invalid.
+ */
+typedef void (*circus_vault_shrink_fn)(circus_vault_t *this);
+/*
+ * Start an online backup of the vault to the configured
+ * "vault"/"backup" path. done (may be NULL) is called when finished.
+ */
+typedef int (*circus_vault_backup_fn)(circus_vault_t *this, circus_database_done_fn done, void *data);
+/*
+ * Commit the pending deferred writes of the vault (see the group commit
+ * in circus_database.h). Returns 1 if all the deferred writes since the
+ * previous flush are durable, 0 if any was lost. Nothing that depends
+ * on such a write may be reported before that.
+ */
+typedef int (*circus_vault_flush_fn)(circus_vault_t *this);
+/*
+ * The statistics of the vault databases
+ */
+typedef void (*circus_vault_stats_fn)(circus_vault_t *this, circus_stats_fn fn, void *data);
 typedef void (*circus_vault_free_fn)(circus_vault_t *this);
 
 struct circus_vault_s {
    circus_vault_get_fn get;
    circus_vault_new_fn new;
    circus_vault_install_fn install;
+   circus_vault_restore_fn restore;
+   circus_vault_shrink_fn shrink;
+   circus_vault_backup_fn backup;
+   circus_vault_flush_fn flush;
+   circus_vault_stats_fn stats;
    circus_vault_free_fn free;
 };
 
-typedef circus_database_t *(*database_factory_fn)(cad_memory_t memory, circus_log_t *log, const char *path);
-__PUBLIC__ circus_vault_t *circus_vault(cad_memory_t memory, circus_log_t *log, circus_config_t *config, database_factory_fn db_factory);
+typedef circus_database_t *(*database_factory_fn)(cad_memory_t memory, circus_log_t *log, circus_config_t *config, const char *path);
+/*
+ * Open the vault. If migrate is 0 the vault is left at its current
+ * version (the --backup command line must copy the database as is).
+ */
+__PUBLIC__ circus_vault_t *circus_vault(cad_memory_t memory, circus_log_t *log, circus_config_t *config, database_factory_fn db_factory, int migrate);
 
 #endif /* __CIRCUS_VAULT_H */
@@ -18,6 +18,7 @@
 
 #include <inttypes.h>
 #include <string.h>
+#include <uv.h>
 
 #include "_test_database.h"
 
@@ -37,14 +38,89 @@ static int check_data(sqlite3_stmt *stmt) {
    return 1;
 }
 
+static int check_count(sqlite3_stmt *stmt) {
+   assert(sqlite3_column_int64(stmt, 0) == 2);
+   return 1;
+}
+
+static void deferred_done(int *status, int done) {
+   *status = done;
+}
+
+static const char *group_config_get(circus_config_t *UNUSED(this), const char *section, const char *key) {
+   if (strcmp(section, "vault.sqlite") != 0) {
+      return NULL;
+   }
+   if (!strcmp(key, "journal_mode")) {
+      return "wal";
+   }
+   if (!strcmp(key, "read_connections")) {
+      return "1";
+   }
+   if (!strcmp(key, "group_size")) {
+      return "4";
+   }
+   return NULL;
+}
+
+static int64_t count(circus_database_t *db) {
+   circus_database_query_t *q = db->query(db, "SELECT COUNT(*) FROM TEST;");
+   circus_database_resultset_t *rs = q->run(q);
+   assert(rs->has_next(rs));
+   rs->next(rs);
+   int64_t result = rs->get_int(rs, 0);
+   rs->free(rs);
+   q->free(q);
+   return result;
+}
+
+/*
+ * A pending write group is not visible to the reads until it is
+ * committed, and its writes are only reported done then
+ */
+static void check_group(void) {
+   circus_config_t config = { group_config_get, NULL, NULL };
+   const char *path = "test_database_group.db";
+   circus_database_query_t *q;
+   circus_database_resultset_t *rs;
+   int status = -1;
+
+   // the configured database logs its settings: not on the checked output
+   circus_log_t *log = circus_new_log_file(stdlib_memory, "test_database_group.log", LOG_PII);
+   circus_database_t *db = circus_database_sqlite3(stdlib_memory, log, &config, path);
+   assert(db != NULL);
+   assert(database_exec(log, db, "CREATE TABLE IF NOT EXISTS TEST(ID INTEGER PRIMARY KEY AUTOINCREMENT, VALUE TEXT);"));
+
+   assert(db->begin_deferred(db));
+   q = db->query(db, "INSERT INTO TEST (VALUE) VALUES ('grouped');");
+   rs = q->run(q);
+   assert(!rs->has_error(rs));
+   rs->free(rs);
+   q->free(q);
+   assert(db->commit_deferred(db, (circus_database_done_fn)deferred_done, &status));
+   assert(status == -1);
+   assert(count(db) == 0);
+
+   assert(db->flush(db));
+   assert(status == 1);
+   assert(count(db) == 1);
+
+   db->free(db);
+   uv_run(uv_default_loop(), UV_RUN_NOWAIT); // the database is freed when its timer is closed
+   log->free(log);
+}
+
 int main() {
    LOG = circus_new_log_file_descriptor(stdlib_memory, LOG_PII, 1);
    const char *path = "test_database.db";
    circus_database_query_t *q;
    circus_database_resultset_t *rs;
-   int i;
+   int i, status;
+   size_t len;
+   const char *s;
+   const void *b;
 
-   circus_database_t *db = circus_database_sqlite3(stdlib_memory, LOG, path);
+   circus_database_t *db = circus_database_sqlite3(stdlib_memory, LOG, NULL, path);
    assert(db != NULL);
 
    q = db->query(db, "CREATE TABLE IF NOT EXISTS TEST(ID INTEGER PRIMARY KEY AUTOINCREMENT, VALUE TEXT);");
@@ -74,10 +150,99 @@ int main() {
    rs->free(rs);
    q->free(q);
 
+   // static binds and length-aware accessors
+   q = db->query(db, "SELECT ?, ?;");
+   assert(q->set_string_static(q, 0, "static string", 6));
+   assert(q->set_blob_static(q, 1, "\0blob", 5));
+   rs = q->run(q);
+   assert(rs->has_next(rs));
+   rs->next(rs);
+   s = rs->get_string_len(rs, 0, &len);
+   assert(len == 6 && !strcmp(s, "static"));
+   b = rs->get_blob(rs, 1, &len);
+   assert(len == 5 && !memcmp(b, "\0blob", 5));
+   rs->free(rs);
+   q->free(q);
+
+   // rolled back transaction, with a savepoint
+   assert(db->begin(db));
+   q = db->query(db, "INSERT INTO TEST (VALUE) VALUES ('rolled back');");
+   rs = q->run(q);
+   assert(!rs->has_error(rs));
+   rs->free(rs);
+   assert(db->begin(db));
+   rs = q->run(q);
+   assert(!rs->has_error(rs));
+   rs->free(rs);
+   assert(db->rollback(db));
+   assert(db->rollback(db));
+   q->free(q);
+
+   // committed transaction, with a rolled back savepoint
+   assert(db->begin(db));
+   assert(db->begin(db));
+   q = db->query(db, "DELETE FROM TEST;");
+   rs = q->run(q);
+   assert(!rs->has_error(rs));
+   rs->free(rs);
+   q->free(q);
+   assert(db->rollback(db));
+   assert(db->commit(db));
+
+   // deferred write, called back when its enclosing transaction ends
+   status = -1;
+   assert(db->begin(db));
+   assert(db->begin_deferred(db));
+   q = db->query(db, "INSERT INTO TEST (VALUE) VALUES ('rolled back');");
+   rs = q->run(q);
+   assert(!rs->has_error(rs));
+   rs->free(rs);
+   q->free(q);
+   assert(db->commit_deferred(db, (circus_database_done_fn)deferred_done, &status));
+   assert(status == -1);
+   assert(db->rollback(db));
+   assert(status == 0);
+
+   status = -1;
+   assert(db->begin_deferred(db));
+   assert(db->commit_deferred(db, (circus_database_done_fn)deferred_done, &status));
+   assert(db->flush(db));
+   assert(status == 1);
+
+   q = db->query(db, "SELECT COUNT(*) FROM TEST;");
+   rs = q->run(q);
+   assert(rs->has_next(rs));
+   rs->next(rs);
+   assert(rs->get_int(rs, 0) == 2);
+   rs->free(rs);
+   q->free(q);
+
    db->free(db);
 
    query_database(path, "SELECT * FROM TEST;", check_data);
 
+   // in-memory database, seeded from the file and not dumped back
+   db = circus_database_memory(stdlib_memory, LOG, NULL, path);
+   assert(db != NULL);
+   q = db->query(db, "INSERT INTO TEST (VALUE) VALUES ('in memory');");
+   rs = q->run(q);
+   assert(!rs->has_error(rs));
+   rs->free(rs);
+   q->free(q);
+   q = db->query(db, "SELECT COUNT(*) FROM TEST;");
+   rs = q->run(q);
+   assert(rs->has_next(rs));
+   rs->next(rs);
+   assert(rs->get_int(rs, 0) == 3);
+   rs->free(rs);
+   q->free(q);
+   db->free(db);
+
+   query_database(path, "SELECT COUNT(*) FROM TEST;", check_count);
+
+   check_group();
+
+   uv_loop_close(uv_default_loop());
    LOG->free(LOG);
    return 0;
 }
@@ -16,5 +16,5 @@
 #
 #    Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
 
-rm -f test_database.db
+rm -f test_database.db test_database_group.db*
 exec $1
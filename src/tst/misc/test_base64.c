@@ -31,4 +31,15 @@ int main() {
    printf("%s\n", decoded);
    assert(d == strlen(test) + 1);
    assert(!strcmp(decoded, test));
+
+   char b64[64];
+   base64_to(b64, test, strlen(test) + 1);
+   printf("%s\n", b64);
+   assert(!strcmp(b64, encoded));
+   char raw[64];
+   int n = unbase64_to(raw, b64, strlen(b64));
+   printf("%s\n", raw);
+   assert(n == (int)strlen(test) + 1);
+   assert(unbase64_to(raw, "VGhp!yBp", 8) == -1);
+   assert(unbase64_to(raw, "VGhpc", 5) == -1);
 }
@@ -356,3 +356,33 @@ int do_login(const char *userid, const char *password, char **sessionid, char **
 
    return result;
 }
+
+/*
+ * Create a user with the admin session; the admin token is replaced by
+ * the new one, and the generated password is returned
+ */
+int do_create_user(const char *sessionid, char **token, const char *username, const char *email, char **password) {
+   int result = 0;
+
+   circus_message_query_create_user_t *create = new_circus_message_query_create_user(stdlib_memory, sessionid, *token, username, email, "user");
+   circus_message_t *reply = NULL;
+   send_message(I(create), &reply);
+   circus_message_reply_user_t *created = check_reply(reply, "user", "reply", "");
+   if (created == NULL) {
+      result = 1;
+   } else {
+      stdlib_memory.free(*token);
+      *token = szprintf(stdlib_memory, NULL, "%s", created->token(created));
+      *password = szprintf(stdlib_memory, NULL, "%s", created->password(created));
+      reply->free(reply);
+   }
+   I(create)->free(I(create));
+
+   return result;
+}
+
+void do_stop(const char *sessionid, const char *token) {
+   circus_message_query_stop_t *stop = new_circus_message_query_stop(stdlib_memory, sessionid, token, "test");
+   send_message(I(stop), NULL);
+   I(stop)->free(I(stop));
+}
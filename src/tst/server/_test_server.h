@@ -26,6 +26,8 @@ void database(const char *query, database_fn fn);
 database_fn db_count(int *counter);
 
 int do_login(const char *userid, const char *password, char **sessionid, char **token);
+int do_create_user(const char *sessionid, char **token, const char *username, const char *email, char **password);
+void do_stop(const char *sessionid, const char *token);
 
 int test(int argc, char **argv, int (*fn)(void));
 
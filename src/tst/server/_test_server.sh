@@ -0,0 +1,61 @@
+#    This file is part of Circus.
+#
+#    Circus is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License.
+#
+#    Circus is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with Circus.  If not, see <http://www.gnu.org/licenses/>.
+#
+#    Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
+
+# Sourced by the test_server_*.sh scripts. run_test.sh runs them from
+# the test directory, with the test executable as argument, after
+# setting XDG_CONFIG_HOME.
+
+set -e
+set -u
+set -o pipefail
+
+exe=$(basename $1)
+
+# Rewrite the server configuration: $1 goes into the "vault" section,
+# $2 after it (whole sections); both end with a comma.
+server_conf() {
+    cat > $XDG_CONFIG_HOME/circus/server.conf <<EOF
+{
+    "vault": {
+        $1
+        "filename": "vault"
+    },
+    $2
+    "log": {
+        "level": "pii",
+        "filename": "${exe%.exe}-server.log"
+    }
+}
+EOF
+}
+
+# Run the test with the exchanged JSON messages rewritten with sorted
+# keys, and with the session ids, tokens, generated passwords and
+# validities masked: they depend on how many fake random bytes and
+# clock ticks were consumed before, which these tests are not about.
+MASK='with_entries(if (.key == "sessionid" or .key == "token" or .key == "password" or .key == "validity") and .value != "" then .value = "<\(.key)>" else . end)'
+run_masked() {
+    "$@" | while IFS= read -r line; do
+        case "$line" in
+            ">>>> "*|"<<<< "*)
+                echo "${line:0:5}$(jq -cS "$MASK" <<< "${line:5}")"
+                ;;
+            *)
+                echo "$line"
+                ;;
+        esac
+    done
+}
@@ -0,0 +1,166 @@
+/*
+    This file is part of Circus.
+
+    Circus is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License.
+
+    Circus is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Circus.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
+*/
+
+#include <string.h>
+
+#include <circus_message_impl.h>
+
+#include "_test_server.h"
+
+static void set_token(char **token, const char *value) {
+   stdlib_memory.free(*token);
+   *token = szprintf(stdlib_memory, NULL, "%s", value);
+}
+
+static int set_pass(const char *sessionid, char **token, const char *key) {
+   int result = 0;
+   circus_message_t *reply = NULL;
+   circus_message_query_set_prompt_pass_t *query = new_circus_message_query_set_prompt_pass(stdlib_memory, sessionid, *token, key, "secret", "secret");
+   send_message(I(query), &reply);
+   I(query)->free(I(query));
+   circus_message_reply_pass_t *pass = check_reply(reply, "pass", "reply", "");
+   if (pass == NULL) {
+      result = 1;
+   } else {
+      set_token(token, pass->token(pass));
+      reply->free(reply);
+   }
+   return result;
+}
+
+static int set_property(const char *sessionid, char **token, const char *key, const char *property, int set) {
+   int result = 0;
+   circus_message_t *reply = NULL;
+   circus_message_t *query;
+   if (set) {
+      query = I(new_circus_message_query_set_property(stdlib_memory, sessionid, *token, key, property, ""));
+   } else {
+      query = I(new_circus_message_query_unset_property(stdlib_memory, sessionid, *token, key, property));
+   }
+   send_message(query, &reply);
+   query->free(query);
+   circus_message_reply_property_t *prop = check_reply(reply, "property", "reply", "");
+   if (prop == NULL) {
+      result = 1;
+   } else {
+      set_token(token, prop->token(prop));
+      reply->free(reply);
+   }
+   return result;
+}
+
+static void print_names(const char *what, cad_array_t *names) {
+   int i, n = names->count(names);
+   printf("%s:", what);
+   for (i = 0; i < n; i++) {
+      printf(" %s", *(char**)names->get(names, i));
+   }
+   printf("\n");
+}
+
+static int get_pass(const char *sessionid, char **token, const char *key) {
+   int result = 0;
+   circus_message_t *reply = NULL;
+   circus_message_query_get_pass_t *query = new_circus_message_query_get_pass(stdlib_memory, sessionid, *token, key);
+   send_message(I(query), &reply);
+   I(query)->free(I(query));
+   circus_message_reply_pass_t *pass = check_reply(reply, "pass", "reply", "");
+   if (pass == NULL) {
+      result = 1;
+   } else {
+      set_token(token, pass->token(pass));
+      print_names(key, pass->properties(pass));
+      reply->free(reply);
+   }
+   return result;
+}
+
+static int tag_list(const char *sessionid, char **token, const char *tag) {
+   int result = 0;
+   circus_message_t *reply = NULL;
+   circus_message_query_tag_list_t *query = new_circus_message_query_tag_list(stdlib_memory, sessionid, *token, tag);
+   send_message(I(query), &reply);
+   I(query)->free(I(query));
+   circus_message_reply_list_t *list = check_reply(reply, "list", "reply", "");
+   if (list == NULL) {
+      result = 1;
+   } else {
+      set_token(token, list->token(list));
+      print_names(tag, list->names(list));
+      reply->free(reply);
+   }
+   return result;
+}
+
+static int tags(const char *sessionid, char **token) {
+   int result = 0;
+   circus_message_t *reply = NULL;
+   circus_message_query_tags_t *query = new_circus_message_query_tags(stdlib_memory, sessionid, *token);
+   send_message(I(query), &reply);
+   I(query)->free(I(query));
+   circus_message_reply_tags_t *all = check_reply(reply, "tags", "reply", "");
+   if (all == NULL) {
+      result = 1;
+   } else {
+      set_token(token, all->token(all));
+      print_names("tags", all->names(all));
+      reply->free(reply);
+   }
+   return result;
+}
+
+static int send_tags() {
+   int result;
+
+   char *admin_sessionid = NULL;
+   char *admin_token = NULL;
+   char *password = NULL;
+   char *sessionid = NULL;
+   char *token = NULL;
+
+   result = do_login("test", "pass", &admin_sessionid, &admin_token)
+      || do_create_user(admin_sessionid, &admin_token, "noob", "noob@clueless.lol", &password)
+      || do_login("noob", password, &sessionid, &token)
+      || set_pass(sessionid, &token, "mail")
+      || set_pass(sessionid, &token, "bank")
+      || set_property(sessionid, &token, "mail", "work", 1)
+      || set_property(sessionid, &token, "bank", "work", 1)
+      || set_property(sessionid, &token, "bank", "money", 1)
+      || get_pass(sessionid, &token, "bank")
+      || tag_list(sessionid, &token, "work")
+      || tags(sessionid, &token)
+      || set_property(sessionid, &token, "bank", "work", 0)
+      || get_pass(sessionid, &token, "bank")
+      || tag_list(sessionid, &token, "work")
+      || tag_list(sessionid, &token, "money")
+      || tags(sessionid, &token);
+
+   do_stop(admin_sessionid, admin_token);
+
+   stdlib_memory.free(admin_sessionid);
+   stdlib_memory.free(admin_token);
+   stdlib_memory.free(password);
+   stdlib_memory.free(sessionid);
+   stdlib_memory.free(token);
+
+   return result;
+}
+
+int main(int argc, char **argv) {
+   return test(argc, argv, send_tags);
+}
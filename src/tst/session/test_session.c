@@ -0,0 +1,297 @@
+/*
+    This file is part of Circus.
+
+    Circus is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License.
+
+    Circus is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Circus.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
+*/
+
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include <circus_crypt.h>
+#include <circus_database.h>
+#include <circus_session.h>
+#include <circus_vault.h>
+
+circus_log_t *LOG;
+static circus_vault_t *vault;
+
+static char vault_path[PATH_MAX];
+static char snapshot_path[PATH_MAX];
+
+/*
+ * The session configuration of the current check; the lengths are not
+ * multiples of the period of the fake random generator of the tests,
+ * so that the sessions do not all get the same id
+ */
+typedef struct {
+   const char *idle_timeout;
+   const char *max_lifetime;
+   const char *max_per_user;
+   const char *snapshot;
+   const char *snapshot_secret;
+} session_config_t;
+
+static session_config_t session_config;
+
+static const char *config_get(circus_config_t *UNUSED(this), const char *section, const char *key) {
+   if (!strcmp(section, "vault")) {
+      return strcmp(key, "filename") ? NULL : vault_path;
+   }
+   if (strcmp(section, "session") != 0) {
+      return NULL;
+   }
+   if (!strcmp(key, "sessionid_length") || !strcmp(key, "token_length")) {
+      return "100";
+   }
+   if (!strcmp(key, "idle_timeout")) {
+      return session_config.idle_timeout;
+   }
+   if (!strcmp(key, "max_lifetime")) {
+      return session_config.max_lifetime;
+   }
+   if (!strcmp(key, "max_per_user")) {
+      return session_config.max_per_user;
+   }
+   if (!strcmp(key, "snapshot")) {
+      return session_config.snapshot;
+   }
+   if (!strcmp(key, "snapshot_secret")) {
+      return session_config.snapshot_secret;
+   }
+   return NULL;
+}
+
+static circus_config_t config = { config_get, NULL, NULL };
+
+typedef struct {
+   unsigned long count;
+   unsigned long expired;
+   unsigned long restored;
+   unsigned long evicted;
+} stats_t;
+
+static void get_stat(stats_t *stats, const char *name, unsigned long value) {
+   if (!strcmp(name, "session.count")) {
+      stats->count = value;
+   } else if (!strcmp(name, "session.expired")) {
+      stats->expired = value;
+   } else if (!strcmp(name, "session.restored")) {
+      stats->restored = value;
+   } else if (!strcmp(name, "session.evicted")) {
+      stats->evicted = value;
+   }
+}
+
+static stats_t get_stats(circus_session_t *session) {
+   stats_t result = { 0, 0, 0, 0 };
+   session->stats(session, (circus_stats_fn)get_stat, &result);
+   return result;
+}
+
+/*
+ * The sessionid and token getters share their buffer: the values are
+ * copied
+ */
+typedef struct {
+   char *sessionid;
+   char *token;
+} login_t;
+
+static login_t login(circus_session_t *session, circus_user_t *user) {
+   // the loop time is cached, and checking the password takes a while
+   uv_update_time(uv_default_loop());
+   circus_session_data_t *data = session->set(session, user);
+   assert(data != NULL);
+   login_t result;
+   result.sessionid = szprintf(stdlib_memory, NULL, "%s", data->sessionid(data));
+   result.token = szprintf(stdlib_memory, NULL, "%s", data->token(data));
+   return result;
+}
+
+static int is_valid(circus_session_t *session, login_t *login) {
+   return session->get(session, login->sessionid, login->token) != NULL;
+}
+
+static void free_login(login_t *login) {
+   stdlib_memory.free(login->sessionid);
+   stdlib_memory.free(login->token);
+}
+
+static circus_session_t *open_session(const char *idle_timeout, const char *max_lifetime) {
+   session_config.idle_timeout = idle_timeout;
+   session_config.max_lifetime = max_lifetime;
+   circus_session_t *result = circus_session(stdlib_memory, LOG, &config, vault);
+   assert(result != NULL);
+   return result;
+}
+
+/*
+ * Run the loop (and the session expiry timer) for a while
+ */
+static uv_timer_t wait_timer;
+
+static void on_wait(uv_timer_t *timer) {
+   uv_timer_stop(timer);
+}
+
+static void wait_ms(uint64_t ms) {
+   uv_timer_start(&wait_timer, on_wait, ms, 0);
+   uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+}
+
+/*
+ * Idle sessions expire, and active sessions expire too after their
+ * maximum lifetime
+ */
+static void check_expiry(circus_user_t *user) {
+   circus_session_t *session;
+   login_t l;
+
+   session = open_session("1", "0");
+   l = login(session, user);
+   wait_ms(500);
+   assert(is_valid(session, &l));
+   wait_ms(2500);
+   assert(!is_valid(session, &l));
+   assert(get_stats(session).expired == 1);
+   assert(get_stats(session).count == 0);
+   free_login(&l);
+   session->free(session);
+
+   session = open_session("0", "2");
+   l = login(session, user);
+   wait_ms(1000);
+   assert(is_valid(session, &l));
+   wait_ms(1000);
+   assert(!is_valid(session, &l));
+   free_login(&l);
+   session->free(session);
+}
+
+/*
+ * The sessions survive a restart through the snapshot, but only with
+ * the same secret
+ */
+static void check_snapshot(circus_user_t *user) {
+   circus_session_t *session;
+   circus_session_data_t *data;
+   login_t l;
+
+   session_config.snapshot = snapshot_path;
+   session_config.snapshot_secret = "the snapshot secret";
+   session = open_session("0", "0");
+   l = login(session, user);
+   session->free(session);
+
+   session = open_session("0", "0");
+   data = session->get(session, l.sessionid, l.token);
+   assert(data != NULL);
+   assert(!strcmp(data->user(data)->name(data->user(data)), "alice"));
+   assert(get_stats(session).restored == 1);
+   session->free(session);
+
+   // a short secret disables the snapshot
+   session_config.snapshot_secret = "short";
+   session = open_session("0", "0");
+   assert(!is_valid(session, &l));
+   session->free(session);
+
+   session_config.snapshot_secret = "another snapshot secret";
+   session = open_session("0", "0");
+   assert(!is_valid(session, &l));
+   session->free(session);
+
+   session_config.snapshot = NULL;
+   session_config.snapshot_secret = NULL;
+   free_login(&l);
+}
+
+/*
+ * A user may have several sessions: the logout closes them all, and
+ * beyond max_per_user the least recently used one is evicted
+ */
+static void check_multi(circus_user_t *user) {
+   circus_session_t *session;
+   login_t l1, l2, l3, l4;
+
+   session_config.max_per_user = "2";
+   session = open_session("0", "0");
+
+   l1 = login(session, user);
+   l2 = login(session, user);
+   assert(is_valid(session, &l1));
+   assert(is_valid(session, &l2));
+   assert(get_stats(session).count == 2);
+
+   session->close(session, user);
+   assert(!is_valid(session, &l1));
+   assert(!is_valid(session, &l2));
+   assert(get_stats(session).count == 0);
+   free_login(&l1);
+   free_login(&l2);
+
+   l1 = login(session, user);
+   l2 = login(session, user);
+   l3 = login(session, user);
+   assert(!is_valid(session, &l1));
+   assert(is_valid(session, &l2));
+   assert(is_valid(session, &l3));
+   assert(get_stats(session).evicted == 1);
+
+   // l2 was used last, so l3 is evicted now
+   assert(is_valid(session, &l2));
+   l4 = login(session, user);
+   assert(!is_valid(session, &l3));
+   assert(is_valid(session, &l2));
+   assert(is_valid(session, &l4));
+   assert(get_stats(session).evicted == 2);
+   assert(get_stats(session).count == 2);
+
+   session->free(session);
+   session_config.max_per_user = NULL;
+   free_login(&l1);
+   free_login(&l2);
+   free_login(&l3);
+   free_login(&l4);
+}
+
+int main() {
+   LOG = circus_new_log_file(stdlib_memory, "test_session-server.log", LOG_PII);
+   assert(getcwd(vault_path, sizeof(vault_path) - 32) != NULL);
+   strcpy(snapshot_path, vault_path);
+   strcat(vault_path, "/test_session.db");
+   strcat(snapshot_path, "/test_session.snapshot");
+   assert(init_crypt(LOG));
+   uv_timer_init(uv_default_loop(), &wait_timer);
+
+   vault = circus_vault(stdlib_memory, LOG, &config, circus_database_sqlite3, 1);
+   assert(vault != NULL);
+   assert(vault->install(vault, "admin", "adminpass") == 0);
+   circus_user_t *alice = vault->new(vault, "alice", "alicepass", 0);
+   assert(alice != NULL);
+
+   check_expiry(alice);
+   check_snapshot(alice);
+   check_multi(alice);
+
+   vault->free(vault);
+   uv_close((uv_handle_t*)&wait_timer, NULL);
+   uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+   uv_loop_close(uv_default_loop());
+   LOG->free(LOG);
+   return 0;
+}
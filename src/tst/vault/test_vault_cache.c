@@ -0,0 +1,204 @@
+/*
+    This file is part of Circus.
+
+    Circus is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License.
+
+    Circus is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Circus.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
+*/
+
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include <circus_crypt.h>
+#include <circus_database.h>
+#include <circus_vault.h>
+
+circus_log_t *LOG;
+
+static char path[PATH_MAX];
+static const char *cache_size;
+static const char *cache_ttl;
+
+static const char *config_get(circus_config_t *UNUSED(this), const char *section, const char *key) {
+   if (strcmp(section, "vault") != 0) {
+      return NULL;
+   }
+   if (!strcmp(key, "filename")) {
+      return path;
+   }
+   if (!strcmp(key, "cache_size")) {
+      return cache_size;
+   }
+   if (!strcmp(key, "cache_ttl")) {
+      return cache_ttl;
+   }
+   if (!strcmp(key, "unknown_cache_size")) {
+      return "4";
+   }
+   return NULL;
+}
+
+static circus_config_t config = { config_get, NULL, NULL };
+
+typedef struct {
+   unsigned long cached;
+   unsigned long pinned;
+   unsigned long unknown;
+   unsigned long unknown_hits;
+} stats_t;
+
+static void get_stat(stats_t *stats, const char *name, unsigned long value) {
+   if (!strcmp(name, "vault.users.cached")) {
+      stats->cached = value;
+   } else if (!strcmp(name, "vault.users.pinned")) {
+      stats->pinned = value;
+   } else if (!strcmp(name, "vault.users.unknown")) {
+      stats->unknown = value;
+   } else if (!strcmp(name, "vault.users.unknown_hits")) {
+      stats->unknown_hits = value;
+   }
+}
+
+static void check_stats(circus_vault_t *vault, unsigned long cached, unsigned long pinned) {
+   stats_t stats = { 0, 0, 0, 0 };
+   vault->stats(vault, (circus_stats_fn)get_stat, &stats);
+   assert(stats.cached == cached);
+   assert(stats.pinned == pinned);
+}
+
+static circus_vault_t *open_vault(const char *size, const char *ttl) {
+   cache_size = size;
+   cache_ttl = ttl;
+   circus_vault_t *result = circus_vault(stdlib_memory, LOG, &config, circus_database_sqlite3, 1);
+   assert(result != NULL);
+   return result;
+}
+
+static void create_users(void) {
+   circus_vault_t *vault = open_vault("", "");
+   assert(vault->install(vault, "admin", "adminpass") == 0);
+   assert(vault->new(vault, "user1", "pass1", 0) != NULL);
+   assert(vault->new(vault, "user2", "pass2", 0) != NULL);
+   assert(vault->new(vault, "user3", "pass3", 0) != NULL);
+   vault->free(vault);
+}
+
+/*
+ * At most cache_size users not pinned by a session, the least recently
+ * used one is evicted first
+ */
+static void check_size(void) {
+   circus_vault_t *vault = open_vault("2", "0");
+   circus_user_t *user1, *user2, *user3;
+   check_stats(vault, 0, 0);
+
+   user1 = vault->get(vault, "user1", NULL);
+   user2 = vault->get(vault, "user2", NULL);
+   assert(user1 != NULL && user2 != NULL);
+   check_stats(vault, 2, 0);
+
+   // user2 is now the least recently used
+   assert(vault->get(vault, "user1", NULL) == user1);
+   user3 = vault->get(vault, "user3", NULL);
+   assert(user3 != NULL);
+   check_stats(vault, 2, 0);
+   assert(vault->get(vault, "user1", NULL) == user1);
+
+   // pinned users are out of the count, and never evicted
+   user1->pin(user1);
+   check_stats(vault, 2, 1);
+   assert(vault->get(vault, "user2", NULL) != NULL);
+   check_stats(vault, 3, 1);
+   assert(vault->get(vault, "admin", NULL) != NULL);
+   check_stats(vault, 3, 1);
+   assert(vault->get(vault, "user1", NULL) == user1);
+
+   // shrink drops all the cached users, but the pinned ones
+   vault->shrink(vault);
+   check_stats(vault, 1, 1);
+   assert(vault->get(vault, "user1", NULL) == user1);
+   user1->unpin(user1);
+   check_stats(vault, 1, 0);
+
+   vault->free(vault);
+}
+
+/*
+ * The users not pinned by a session are evicted once idle for
+ * cache_ttl
+ */
+static void check_ttl(void) {
+   circus_vault_t *vault = open_vault("10", "1");
+   circus_user_t *user1;
+
+   user1 = vault->get(vault, "user1", NULL);
+   assert(user1 != NULL);
+   user1->pin(user1);
+   assert(vault->get(vault, "user2", NULL) != NULL);
+   check_stats(vault, 2, 1);
+
+   sleep(2);
+   uv_update_time(uv_default_loop());
+
+   assert(vault->get(vault, "user3", NULL) != NULL);
+   check_stats(vault, 2, 1);
+   assert(vault->get(vault, "user1", NULL) == user1);
+   user1->unpin(user1);
+
+   vault->free(vault);
+}
+
+/*
+ * An unknown user is remembered, and does not prevent its creation
+ */
+static void check_unknown(void) {
+   circus_vault_t *vault = open_vault("", "");
+   stats_t stats = { 0, 0, 0, 0 };
+   circus_user_t *user;
+
+   assert(vault->get(vault, "newbie", NULL) == NULL);
+   assert(vault->get(vault, "newbie", "newpass") == NULL);
+   vault->stats(vault, (circus_stats_fn)get_stat, &stats);
+   assert(stats.unknown == 1);
+   assert(stats.unknown_hits == 1);
+
+   user = vault->new(vault, "newbie", "newpass", 0);
+   assert(user != NULL);
+   assert(vault->get(vault, "newbie", "newpass") == user);
+   assert(vault->get(vault, "newbie", "badpass") == NULL);
+
+   vault->free(vault);
+
+   // and the user is really there
+   vault = open_vault("", "");
+   assert(vault->get(vault, "newbie", "newpass") != NULL);
+   vault->free(vault);
+}
+
+int main() {
+   LOG = circus_new_log_file(stdlib_memory, "test_vault_cache-vault.log", LOG_PII);
+   assert(getcwd(path, sizeof(path) - 32) != NULL);
+   strcat(path, "/test_vault_cache.db");
+   assert(init_crypt(LOG));
+
+   create_users();
+   check_size();
+   check_ttl();
+   check_unknown();
+
+   uv_loop_close(uv_default_loop());
+   LOG->free(LOG);
+   return 0;
+}
@@ -0,0 +1,178 @@
+/*
+    This file is part of Circus.
+
+    Circus is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License.
+
+    Circus is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Circus.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright © 2015-2017 Cyril Adrian <cyril.adrian@gmail.com>
+*/
+
+#include <limits.h>
+#include <sqlite3.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include <circus_crypt.h>
+#include <circus_database.h>
+#include <circus_vault.h>
+
+circus_log_t *LOG;
+
+static char path[PATH_MAX];
+
+static const char *config_get(circus_config_t *UNUSED(this), const char *section, const char *key) {
+   if (!strcmp(section, "vault") && !strcmp(key, "filename")) {
+      return path;
+   }
+   return NULL;
+}
+
+static circus_config_t config = { config_get, NULL, NULL };
+
+/*
+ * A version 1 vault, as installed by the first releases: the tables
+ * only (the indexes were never created), a tagged key, and maybe two
+ * users with the same name
+ */
+static void create_v1(int duplicate) {
+   static const char *sql =
+      "CREATE TABLE META (KEY TEXT PRIMARY KEY, VALUE TEXT NOT NULL);"
+      "CREATE TABLE USERS (USERID INTEGER PRIMARY KEY AUTOINCREMENT, USERNAME TEXT NOT NULL, EMAIL TEXT,"
+      " PERMISSIONS INTEGER NOT NULL, STRETCH INTEGER NOT NULL, PWDSALT TEXT NOT NULL, HASHPWD TEXT NOT NULL,"
+      " PWDVALID INTEGER, KEYSALT TEXT NOT NULL, HASHKEY TEST NOT NULL);"
+      "CREATE TABLE KEYS (KEYID INTEGER PRIMARY KEY AUTOINCREMENT, USERID INTEGER NOT NULL, KEYNAME TEXT NOT NULL,"
+      " SALT TEXT NOT NULL, STRETCH INTEGER NOT NULL, VALUE TEXT NOT NULL);"
+      "CREATE TABLE TAGS (TAGID INTEGER PRIMARY KEY AUTOINCREMENT, KEYID INTEGER NOT NULL, NAME TEXT NOT NULL,"
+      " VALUE TEXT NOT NULL);"
+      "INSERT INTO META (KEY, VALUE) VALUES ('VERSION', '1');"
+      "INSERT INTO KEYS (USERID, KEYNAME, SALT, STRETCH, VALUE) VALUES (7, 'mail', '', 0, '');"
+      "INSERT INTO TAGS (KEYID, NAME, VALUE) VALUES (1, 'work', '');"
+      "INSERT INTO TAGS (KEYID, NAME, VALUE) VALUES (1, 'work', '');";
+   static const char *sql_duplicate =
+      "INSERT INTO USERS (USERNAME, PERMISSIONS, STRETCH, PWDSALT, HASHPWD, KEYSALT, HASHKEY)"
+      " VALUES ('twin', 1, 1, 'salt', 'hash', 'salt', 'hash');"
+      "INSERT INTO USERS (USERNAME, PERMISSIONS, STRETCH, PWDSALT, HASHPWD, KEYSALT, HASHKEY)"
+      " VALUES ('twin', 1, 1, 'salt', 'hash', 'salt', 'hash');";
+   sqlite3 *db;
+   unlink(path);
+   assert(sqlite3_open(path, &db) == SQLITE_OK);
+   assert(sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK);
+   if (duplicate) {
+      assert(sqlite3_exec(db, sql_duplicate, NULL, NULL, NULL) == SQLITE_OK);
+   }
+   sqlite3_close(db);
+}
+
+static int64_t get_int(const char *sql) {
+   sqlite3 *db;
+   sqlite3_stmt *stmt;
+   int64_t result;
+   assert(sqlite3_open(path, &db) == SQLITE_OK);
+   assert(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK);
+   assert(sqlite3_step(stmt) == SQLITE_ROW);
+   result = sqlite3_column_int64(stmt, 0);
+   sqlite3_finalize(stmt);
+   sqlite3_close(db);
+   return result;
+}
+
+static int has_index(const char *name) {
+   char sql[128];
+   snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND name='%s'", name);
+   return get_int(sql) == 1;
+}
+
+/*
+ * The migration runs in the background, on the loop
+ */
+static uv_timer_t wait_timer;
+
+static void on_wait(uv_timer_t *timer) {
+   uv_timer_stop(timer);
+}
+
+static void wait_ms(uint64_t ms) {
+   // the loop time is cached, and the install takes a while
+   uv_update_time(uv_default_loop());
+   uv_timer_start(&wait_timer, on_wait, ms, 0);
+   uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+}
+
+static circus_vault_t *install(void) {
+   circus_vault_t *result = circus_vault(stdlib_memory, LOG, &config, circus_database_sqlite3, 1);
+   assert(result != NULL);
+   assert(result->install(result, "admin", "adminpass") == 0);
+   return result;
+}
+
+/*
+ * Installing over a version 1 vault keeps it at its version; the
+ * migrations then bring all the indexes
+ */
+static void check_migration(void) {
+   circus_vault_t *vault;
+
+   create_v1(0);
+   vault = install();
+   assert(get_int("SELECT VALUE FROM META WHERE KEY='VERSION'") == 1);
+   assert(!has_index("TAGS_IX"));
+
+   wait_ms(1000);
+   assert(get_int("SELECT VALUE FROM META WHERE KEY='VERSION'") == 4);
+   assert(has_index("USERS_IX"));
+   assert(has_index("USERS_PWDVALID_IX"));
+   assert(has_index("KEYS_IX"));
+   assert(has_index("TAGS_IX"));
+   assert(get_int("SELECT COUNT(*) FROM TAGS") == 1);
+   assert(get_int("SELECT USERID FROM TAGS") == 7);
+   assert(vault->get(vault, "admin", "adminpass") != NULL);
+   vault->free(vault);
+
+   // and again, on the migrated vault
+   vault = install();
+   assert(vault->get(vault, "admin", "adminpass") != NULL);
+   vault->free(vault);
+}
+
+/*
+ * Duplicate user names stop the migration before the unique indexes
+ */
+static void check_duplicates(void) {
+   circus_vault_t *vault;
+
+   create_v1(1);
+   vault = install();
+   wait_ms(1000);
+   assert(get_int("SELECT VALUE FROM META WHERE KEY='VERSION'") == 3);
+   assert(has_index("TAGS_IX"));
+   assert(!has_index("USERS_IX"));
+   assert(!has_index("KEYS_IX"));
+   vault->free(vault);
+}
+
+int main() {
+   LOG = circus_new_log_file(stdlib_memory, "test_vault_migration-vault.log", LOG_PII);
+   assert(getcwd(path, sizeof(path) - 32) != NULL);
+   strcat(path, "/test_vault_migration.db");
+   assert(init_crypt(LOG));
+   uv_timer_init(uv_default_loop(), &wait_timer);
+
+   check_migration();
+   check_duplicates();
+
+   uv_close((uv_handle_t*)&wait_timer, NULL);
+   uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+   uv_loop_close(uv_default_loop());
+   LOG->free(LOG);
+   return 0;
+}